@@ -0,0 +1,112 @@
+﻿// キーセットをキーとするハッシュマップの検索時間を計測する
+//
+// 旧実装(std::bitsetをstd::hashでハッシュするstd::unordered_map)と、
+// ワード単位のハッシュを使ったstd::unordered_map、FlatMapおよびFrozenMapを比較する。
+#include <bitset>
+#include <chrono>
+#include <cstdio>
+#include <random>
+#include <unordered_map>
+#include <vector>
+#include <fujinami/flat_map.hpp>
+#include <fujinami/frozen_map.hpp>
+#include <fujinami/keyset_property.hpp>
+
+using namespace fujinami;
+
+namespace {
+constexpr size_t MAPPING_COUNT = 2000;
+constexpr size_t LOOKUP_COUNT = 1 << 20;
+constexpr int ROUND_COUNT = 5;
+
+struct Chord final {
+  std::bitset<KEY_COUNT> bits;
+  Keyset keyset;
+};
+
+// 実際の配列定義に近い、1〜3キーの組み合わせを生成する。
+std::vector<Chord> make_chords() {
+  std::mt19937 engine(12345);
+  std::uniform_int_distribution<size_t> key_dist(1, 120);
+  std::uniform_int_distribution<size_t> size_dist(1, 3);
+  std::vector<Chord> chords(MAPPING_COUNT);
+  for (Chord& chord : chords) {
+    const size_t size = size_dist(engine);
+    for (size_t i = 0; i < size; ++i) {
+      const size_t key = key_dist(engine);
+      chord.bits.set(key);
+      chord.keyset += static_cast<Key>(key);
+    }
+  }
+  return chords;
+}
+
+template <typename F>
+double measure(F&& f) {
+  double best = 0.0;
+  for (int round = 0; round < ROUND_COUNT; ++round) {
+    const auto begin_tp = std::chrono::steady_clock::now();
+    f();
+    const auto end_tp = std::chrono::steady_clock::now();
+    const double ns =
+        std::chrono::duration<double, std::nano>(end_tp - begin_tp).count() /
+        LOOKUP_COUNT;
+    if (round == 0 || ns < best) best = ns;
+  }
+  return best;
+}
+}  // namespace
+
+int main() {
+  const std::vector<Chord> chords = make_chords();
+  std::vector<size_t> indices(LOOKUP_COUNT);
+  std::mt19937 engine(67890);
+  std::uniform_int_distribution<size_t> index_dist(0, chords.size() - 1);
+  for (size_t& index : indices) index = index_dist(engine);
+
+  std::unordered_map<std::bitset<KEY_COUNT>, KeysetProperty> bitset_map;
+  std::unordered_map<Keyset, KeysetProperty> keyset_map;
+  FlatMap<Keyset, KeysetProperty> flat_map;
+  for (const Chord& chord : chords) {
+    bitset_map[chord.bits].make_node(chord.keyset);
+    keyset_map[chord.keyset].make_node(chord.keyset);
+    flat_map[chord.keyset].make_node(chord.keyset);
+  }
+  FrozenMap<Keyset, KeysetProperty> frozen_map;
+  if (!frozen_map.build(flat_map)) return 1;
+
+  size_t found_count = 0;
+  const double bitset_ns = measure([&]() {
+    for (size_t index : indices) {
+      if (bitset_map.find(chords[index].bits) != bitset_map.end()) {
+        ++found_count;
+      }
+    }
+  });
+  const double keyset_ns = measure([&]() {
+    for (size_t index : indices) {
+      if (keyset_map.find(chords[index].keyset) != keyset_map.end()) {
+        ++found_count;
+      }
+    }
+  });
+  const double flat_ns = measure([&]() {
+    for (size_t index : indices) {
+      if (flat_map.find(chords[index].keyset)) ++found_count;
+    }
+  });
+
+  const double frozen_ns = measure([&]() {
+    for (size_t index : indices) {
+      if (frozen_map.find(chords[index].keyset)) ++found_count;
+    }
+  });
+
+  std::printf("entries: %zu, lookups: %zu (found: %zu)\n", flat_map.size(),
+              LOOKUP_COUNT, found_count);
+  std::printf("unordered_map<bitset>: %6.2f ns/lookup\n", bitset_ns);
+  std::printf("unordered_map<Keyset>: %6.2f ns/lookup\n", keyset_ns);
+  std::printf("FlatMap<Keyset>:       %6.2f ns/lookup\n", flat_ns);
+  std::printf("FrozenMap<Keyset>:     %6.2f ns/lookup\n", frozen_ns);
+  return 0;
+}
@@ -0,0 +1,103 @@
+﻿// キーボードレイアウトの構築にかかる時間とメモリを計測する
+//
+// 押し方の途中になる部分集合をすべて登録する旧来の方式と、
+// マッピング済みのキーセットだけを登録するKeyboardLayoutを比較する。
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <new>
+#include <random>
+#include <vector>
+#include <fujinami/flat_map.hpp>
+#include <fujinami/keyboard_layout.hpp>
+
+using namespace fujinami;
+
+namespace {
+std::atomic<size_t> allocated_size{0};
+
+constexpr size_t MAPPING_COUNT = 2000;
+constexpr size_t KEY_KIND_COUNT = 30;
+
+std::vector<std::vector<Key>> make_chords(size_t chord_size) {
+  std::mt19937 engine(12345);
+  std::uniform_int_distribution<size_t> key_dist(1, KEY_KIND_COUNT);
+  std::vector<std::vector<Key>> chords(MAPPING_COUNT);
+  for (auto& chord : chords) {
+    Keyset keyset;
+    while (chord.size() < chord_size) {
+      const Key key = static_cast<Key>(key_dist(engine));
+      if (keyset[key]) continue;
+      keyset += key;
+      chord.push_back(key);
+    }
+  }
+  return chords;
+}
+
+// 旧来の方式: 真部分集合ごとに組み合わせ可能なキーを登録する。
+void expand_subsets(FlatMap<Keyset, KeysetProperty>& map,
+                    const std::vector<Key>& keys) {
+  using Mask = uint64_t;
+  const Mask all_mask = (Mask(1) << keys.size()) - 1;
+  for (Mask mask = 1; mask != all_mask; ++mask) {
+    Keyset active_keyset;
+    Keyset combinable_keyset;
+    for (size_t i = 0; i < keys.size(); ++i) {
+      if (mask & (Mask(1) << i)) {
+        active_keyset += keys[i];
+      } else {
+        combinable_keyset += keys[i];
+      }
+    }
+    map[active_keyset].make_node(combinable_keyset);
+  }
+  Keyset active_keyset(keys);
+  map[active_keyset].make_mapped(active_keyset, Keyset{});
+}
+
+template <typename F>
+void measure(const char* name, F&& f) {
+  const size_t begin_size = allocated_size;
+  const auto begin_tp = std::chrono::steady_clock::now();
+  f();
+  const auto end_tp = std::chrono::steady_clock::now();
+  const double ms =
+      std::chrono::duration<double, std::milli>(end_tp - begin_tp).count();
+  std::printf("  %-18s %9.2f ms %10.2f MiB\n", name, ms,
+              (allocated_size - begin_size) / (1024.0 * 1024.0));
+}
+}  // namespace
+
+// 確保したメモリの総量を数える。
+void* operator new(size_t size) {
+  allocated_size += size;
+  void* p = std::malloc(size);
+  if (!p) throw std::bad_alloc();
+  return p;
+}
+
+void operator delete(void* p) noexcept { std::free(p); }
+
+int main() {
+  const size_t chord_sizes[] = {2, 4, 6, 8};
+  for (size_t chord_size : chord_sizes) {
+    const auto chords = make_chords(chord_size);
+    const std::vector<KeyRole> roles(chord_size, KeyRole::TRIGGER);
+    std::printf("%zu mappings of %zu-key chords:\n", MAPPING_COUNT, chord_size);
+    measure("subset expansion", [&]() {
+      auto* map = new FlatMap<Keyset, KeysetProperty>();
+      map->reserve(10240);
+      for (const auto& chord : chords) expand_subsets(*map, chord);
+      std::printf("  (%zu entries)\n", map->size());
+    });
+    measure("KeyboardLayout", [&]() {
+      auto* layout = new KeyboardLayout("bench");
+      for (const auto& chord : chords) {
+        layout->create_mapping(chord, roles, Command{});
+      }
+    });
+  }
+  return 0;
+}
@@ -1,9 +1,10 @@
 ﻿#pragma once
 
-#include <deque>
-#include <mutex>
-#include <condition_variable>
+#include <atomic>
 #include <fujinami/logging.hpp>
+#include <fujinami/event_queue.hpp>
+#include <fujinami/keyset.hpp>
+#include <fujinami/queue_option.hpp>
 #include "event.hpp"
 #include "engine.hpp"
 
@@ -19,57 +20,101 @@ class Context final {
 
   Context(Engine& engine) {}
 
+  // 送受信スレッドが止まっている間に呼ぶ。
+  void set_option(const QueueOption::Queue& option) {
+    event_queue_.reset(option.capacity);
+    overflow_policy_ = option.overflow_policy;
+    pressed_keyset_.reset();
+    drop_count_.store(0, std::memory_order_relaxed);
+  }
+
+  // キューが満杯の場合はoverflow_policyに従う。
+  // PASSTHROUGHで積めなかった場合と、閉じられた場合はfalseを返す。
+  //
+  // 押したまま送ったキーを離すイベントは、どのoverflow_policyでも空きを待つ。
+  // 素通しにすると後段ではキーが押されたままになる。
   bool send_event(const AnyEvent& event) noexcept {
-    if (is_closed_) return false;
-    std::lock_guard<std::mutex> lck(queue_mtx_);
-    event_queue_.push_back(event);
-    queue_cv_.notify_one();
+    const bool is_repeat = event.type() == EventType::KEY_PRESS &&
+                           pressed_keyset_[event.as<KeyPressEvent>().key()];
+    const bool is_pressed_release =
+        event.type() == EventType::KEY_RELEASE &&
+        pressed_keyset_[event.as<KeyReleaseEvent>().key()];
+    while (!event_queue_.push(event)) {
+      switch (overflow_policy_) {
+        case OverflowPolicy::BLOCK:
+          break;
+        case OverflowPolicy::DROP_REPEAT:
+          if (is_repeat) {
+            drop_count_.fetch_add(1, std::memory_order_relaxed);
+            return true;
+          }
+          break;
+        case OverflowPolicy::PASSTHROUGH:
+          if (!is_pressed_release) return false;
+          break;
+      }
+      if (!event_queue_.wait_writable()) return false;
+    }
+    // 積めなかったキーを押したままとして扱わないよう、積めてから記録する。
+    update_pressed_keyset(event);
     return true;
   }
 
+  // 後段へ押したまま送ったキーか (送信スレッドから呼ぶ)
+  bool is_pressed(Key key) const noexcept { return pressed_keyset_[key]; }
+
   bool receive_event(const Clock::time_point& timeout_tp,
                      AnyEvent& event) noexcept {
-    if (is_closed_) return false;
-    std::unique_lock<std::mutex> lck(queue_mtx_);
-    if (event_queue_.empty()) {
-      if (timeout_tp < Clock::time_point::max()) {
-        queue_cv_.wait_until(lck, timeout_tp, [&]() noexcept {
-          return is_closed_ || !event_queue_.empty();
-        });
-      } else {
-        queue_cv_.wait(lck, [&]() noexcept {
-          return is_closed_ || !event_queue_.empty();
-        });
-      }
-      if (is_closed_ || event_queue_.empty()) return false;
-    }
-    event = std::move(event_queue_.front());
-    event_queue_.pop_front();
-    return true;
+    return event_queue_.pop(timeout_tp, event);
   }
 
   bool receive_event(AnyEvent& event) noexcept {
     return receive_event(Clock::time_point::max(), event);
   }
 
-  void reset() noexcept {
-    std::lock_guard<std::mutex> lck(queue_mtx_);
-    event_queue_.clear();
+  // 届いているイベントをまとめてfに渡し、その数を返す。
+  // 1つも届いていない場合はtimeout_tpまで待機する。
+  template <typename F>
+  size_t receive_events(const Clock::time_point& timeout_tp, F&& f) noexcept {
+    return event_queue_.pop_all(timeout_tp, std::forward<F>(f));
   }
 
-  void close() noexcept {
-    is_closed_ = true;
-    std::lock_guard<std::mutex> lck(queue_mtx_);
-    queue_cv_.notify_one();
-  }
+  void reset() noexcept { event_queue_.clear(); }
+
+  void close() noexcept { event_queue_.close(); }
+
+  bool is_closed() const noexcept { return event_queue_.is_closed(); }
+
+  size_t wakeup_count() const noexcept { return event_queue_.wakeup_count(); }
 
-  bool is_closed() const noexcept { return is_closed_; }
+  QueueStats stats() const noexcept {
+    QueueStats stats;
+    stats.capacity = event_queue_.capacity();
+    stats.high_water_mark = event_queue_.high_water_mark();
+    stats.overflow_count = event_queue_.overflow_count();
+    stats.drop_count = drop_count_.load(std::memory_order_relaxed);
+    return stats;
+  }
 
  private:
-  std::atomic<bool> is_closed_{false};
-  std::deque<AnyEvent> event_queue_;
-  std::mutex queue_mtx_;
-  std::condition_variable queue_cv_;
+  // 押したままのキーを覚えておく。
+  void update_pressed_keyset(const AnyEvent& event) noexcept {
+    switch (event.type()) {
+      case EventType::KEY_PRESS:
+        pressed_keyset_ += event.as<KeyPressEvent>().key();
+        break;
+      case EventType::KEY_RELEASE:
+        pressed_keyset_ -= event.as<KeyReleaseEvent>().key();
+        break;
+      default:
+        break;
+    }
+  }
+
+  EventQueue<AnyEvent> event_queue_;
+  OverflowPolicy overflow_policy_ = OverflowPolicy::BLOCK;
+  Keyset pressed_keyset_;  // 送信スレッドが更新する
+  std::atomic<size_t> drop_count_{0};
 };
 }  // namespace buffering
 }  // namespace fujinami
@@ -1,5 +1,6 @@
 ﻿#pragma once
 
+#include <fujinami/logging.hpp>
 #include "state.hpp"
 #include "event.hpp"
 #include "flow/immediate.hpp"
@@ -8,14 +9,18 @@
 #include "flow/dual.hpp"
 
 namespace fujinami {
-namespace mapping {
-class Context;
-}  // namespace mapping
-
 namespace buffering {
-namespace next_stage = mapping;
-using NextStageContext = next_stage::Context;
-
+// 後段への接続はテンプレート引数NextStageContextとして受け取る。
+//
+// NextStageContextはsend_press, send_repeat, send_release, send_retract,
+// send_configを持つ型で、
+// キューを介して別スレッドへ送るもの (mapping::Context) と
+// 後段を直接呼び出すもの (mapping::InlineContext) がある。
+//
+// 同時打鍵の判定は一度に1つずつ、押した順に確定する。
+// 確定するたびに修飾キーやレイアウトが変わり、次の判定はそれに依存するので、
+// 複数の判定を並行して進めることはしない。代わりに各フローは結果が決まった
+// 時点で終了し、後続のイベントは窓から読み直して次の判定を始める。
 class Engine {
  public:
   Engine(const Engine&) = delete;
@@ -27,9 +32,40 @@ class Engine {
 
   ~Engine() noexcept;
 
+  template <typename NextStageContext>
   void update(NextStageContext& context) noexcept;
 
-  void update(const AnyEvent& event, NextStageContext& context) noexcept;
+  // 先読みの窓が溢れてもイベントは捨てない。
+  //
+  // 離すイベントを捨てるとキーが押されたままになり、設定の変更を捨てると
+  // 設定もエポックも切り替わらないので、空きができるまで処理を進める。
+  template <typename NextStageContext>
+  void update(const AnyEvent& event, NextStageContext& context) noexcept {
+    // 窓が埋まっている場合は、溜まったイベントを先に処理して空きを作る。
+    if (state_.events().is_full()) drain(context);
+    if (event.type() == EventType::KEY_RELEASE) {
+      simul_key_flow_.observe(event.as<KeyReleaseEvent>());
+    }
+    while (!state_.push_event(event)) make_room(context);
+    update(context);
+  }
+
+  // 新たなイベントなしで進められる処理を、待機が必要になるまで進める。
+  //
+  // 更新してもイベントの消費もフローの進行もない場合は、
+  // 呼び出し元のスレッドを止めないよう打ち切る。
+  template <typename NextStageContext>
+  void drain(NextStageContext& context) noexcept {
+    while (!is_idle()) {
+      const Progress prev_progress = progress();
+      update(context);
+      if (progress() == prev_progress) {
+        FUJINAMI_LOG(error, "buffering engine made no progress (flow:{})",
+                     current_flow_);
+        break;
+      }
+    }
+  }
 
   bool is_idle() const noexcept;
 
@@ -37,18 +73,82 @@ class Engine {
 
   Clock::time_point timeout_tp() const noexcept;
 
+  // 使っている設定のエポック (ConfigReclaimerへ公開する)
+  uint64_t epoch() const noexcept { return epoch_; }
+
+  // SIMULのキーを単打として先に出力した回数
+  size_t speculation_count() const noexcept { return speculation_count_; }
+
+  // 先に出力したものを取り消した回数
+  size_t retraction_count() const noexcept { return retraction_count_; }
+
+  // 先読みの窓が溢れて、判定中のフローを待たずに確定した回数
+  size_t forced_commit_count() const noexcept { return forced_commit_count_; }
+
+  // SIMULの判定時間の学習結果 (resetでは消えない)
+  SimulTiming& simul_timing() noexcept { return simul_key_flow_.timing(); }
+
+  const SimulTiming& simul_timing() const noexcept {
+    return simul_key_flow_.timing();
+  }
+
  private:
+  template <typename NextStageContext>
+  void send_press(NextStageContext& context) noexcept;
+  template <typename NextStageContext>
+  void speculate(NextStageContext& context) noexcept;
+  template <typename NextStageContext>
+  void make_room(NextStageContext& context) noexcept;
+  template <typename NextStageContext>
   void update(const KeyPressEvent& event, NextStageContext& context) noexcept;
+  template <typename NextStageContext>
   void update(const KeyReleaseEvent& event, NextStageContext& context) noexcept;
+  template <typename NextStageContext>
   void update(const DefaultLayoutEvent& event,
               NextStageContext& context) noexcept;
+  template <typename NextStageContext>
   void update(const ControlEvent& event, NextStageContext& context) noexcept;
 
-  std::shared_ptr<const KeyboardLayout> default_layout_;
-  std::shared_ptr<const KeyboardLayout> default_im_layout_;
+  // 処理の進み具合 (drainが進んでいるかを調べるのに使う)
+  struct Progress final {
+    size_t consumed_count;
+    size_t observed_count;
+    FlowType flow;
+
+    bool operator==(const Progress& other) const noexcept {
+      return consumed_count == other.consumed_count &&
+             observed_count == other.observed_count && flow == other.flow;
+    }
+  };
+  Progress progress() const noexcept;
+
+  // 後段に依存しない処理
+  FlowResult update_flow() noexcept;
+  void commit_flow() noexcept;
+  FlowResult reset_flow(const KeyPressEvent& event) noexcept;
+  bool update_im_status(const KeyPressEvent& event) noexcept;
+
+  const KeyboardLayout* default_layout_ = nullptr;
+  const KeyboardLayout* default_im_layout_ = nullptr;
   bool auto_layout_ = false;
+  uint64_t epoch_ = 0;
   bool prev_im_status_ = false;
 
+  // キーリピートで送り直すエントリ
+  //
+  // 押した時点のレイアウトで確定したものを保持し、遷移後のレイアウトで
+  // 引き直さない。修飾キーを離してキーセットが変わった場合のみ、
+  // 押した時点のレイアウトから引き直す。
+  const KeyboardLayout* repeat_layout_ = nullptr;
+  Keyset repeat_keyset_;
+  const KeysetEntry* repeat_entry_ = nullptr;
+
+  // 先に出力したコマンド (SIMULのフローが終わるまで保持する)
+  const Command* speculative_command_ = nullptr;
+  size_t speculation_count_ = 0;
+  size_t retraction_count_ = 0;
+  size_t forced_commit_count_ = 0;
+
   State state_;
   FlowType current_flow_ = FlowType::UNKNOWN;
   ImmediateKeyFlow immediate_key_flow_;
@@ -56,5 +156,189 @@ class Engine {
   SimulKeyFlow simul_key_flow_;
   DualKeyFlow dual_key_flow_;
 };
+
+template <typename NextStageContext>
+void Engine::update(NextStageContext& context) noexcept {
+  if (current_flow_ != FlowType::UNKNOWN) {
+    if (update_flow() == FlowResult::DONE) send_press(context);
+    return;
+  }
+
+  if (state_.events().empty()) return;
+  const WindowEvent& event = state_.events().front();
+  switch (event.type()) {
+    case EventType::NONE: {
+      state_.pop_event();
+      break;
+    }
+    case EventType::KEY_PRESS: {
+      update(event.as<KeyPressEvent>(), context);
+      break;
+    }
+    case EventType::KEY_RELEASE: {
+      update(event.as<KeyReleaseEvent>(), context);
+      break;
+    }
+    case EventType::DEFAULT_LAYOUT: {
+      update(state_.events().front_payload().as<DefaultLayoutEvent>(),
+             context);
+      break;
+    }
+    case EventType::CONTROL: {
+      update(state_.events().front_payload().as<ControlEvent>(), context);
+      break;
+    }
+  }
+}
+
+template <typename NextStageContext>
+void Engine::send_press(NextStageContext& context) noexcept {
+  // 確定したキーセットのエントリは遷移前のレイアウトから引く。
+  const KeysetEntry* active_entry = state_.active_entry();
+  repeat_layout_ = state_.layout();
+  repeat_keyset_ = state_.active_keyset();
+  repeat_entry_ = active_entry;
+  state_.set_next_layout(active_entry);
+  const Command* command = active_entry ? active_entry->command() : nullptr;
+  if (speculative_command_) {
+    // 先に出力したものと一致すれば送り直さない。異なれば取り消してから送る。
+    const Command* speculative_command = speculative_command_;
+    speculative_command_ = nullptr;
+    if (speculative_command == command) return;
+    FUJINAMI_LOG(trace, "retract speculative command");
+    ++retraction_count_;
+    context.send_retract(
+        static_cast<uint32_t>(speculative_command->action_count()));
+  }
+  context.send_press(command);
+}
+
+template <typename NextStageContext>
+void Engine::speculate(NextStageContext& context) noexcept {
+  // 第1キーを単打した場合のエントリを、SimulKeyFlowの解釈と同じく引く。
+  const KeysetEntry* entry = state_.find_keyset_entry(
+      state_.modifier_keyset() + simul_key_flow_.first_key());
+  const Command* command = entry ? entry->command() : nullptr;
+  if (!command || !command->is_retractable()) return;
+
+  FUJINAMI_LOG(trace, "speculate (command_id:{})", command->id());
+  speculative_command_ = command;
+  ++speculation_count_;
+  context.send_press(command);
+}
+
+template <typename NextStageContext>
+void Engine::make_room(NextStageContext& context) noexcept {
+  // 窓が空ならばどのイベントも入るので、ここには来ない。
+  assert(!state_.events().empty());
+  if (current_flow_ == FlowType::UNKNOWN) {
+    update(context);
+    return;
+  }
+
+  // 判定中のフローが後続のイベントを待っていて窓が空かない場合は、
+  // 時間切れと同じく確定させ、後続のイベントを処理する。
+  FUJINAMI_LOG(warn, "event window is full, commit flow (flow:{})",
+               current_flow_);
+  ++forced_commit_count_;
+  commit_flow();
+  send_press(context);
+  drain(context);
+}
+
+template <typename NextStageContext>
+void Engine::update(const KeyPressEvent& event,
+                    NextStageContext& context) noexcept {
+  FUJINAMI_LOG(debug, "press (event:{})", event);
+
+  if (state_.trigger_keyset() && state_.active_keyset()[event.key()]) {
+    FUJINAMI_LOG(trace, "repeat (active_keyset:{})", state_.active_keyset());
+    if (repeat_keyset_ != state_.active_keyset()) {
+      repeat_keyset_ = state_.active_keyset();
+      repeat_entry_ = repeat_layout_
+                          ? repeat_layout_->find_keyset_entry(repeat_keyset_)
+                          : nullptr;
+    }
+    context.send_repeat(repeat_entry_ ? repeat_entry_->command() : nullptr);
+    state_.pop_event();
+    return;
+  }
+
+  if (state_.dontcare_keyset()[event.key()]) {
+    FUJINAMI_LOG(trace, "ignore (active_keyset:{})", state_.active_keyset());
+    state_.pop_event();
+    return;
+  }
+
+  // IMの状態の変化に応じてレイアウトを切り替える。
+  update_im_status(event);
+
+  // 登録されたフローにキーイベントを投げる。
+  if (reset_flow(event) == FlowResult::DONE) {
+    send_press(context);
+  } else if (current_flow_ == FlowType::SIMUL && state_.config() &&
+             state_.config()->speculative_simul()) {
+    speculate(context);
+  }
+}
+
+template <typename NextStageContext>
+void Engine::update(const KeyReleaseEvent& event,
+                    NextStageContext& context) noexcept {
+  FUJINAMI_LOG(debug, "release (event:{})", event);
+
+  if (state_.try_release_trigger_key(event.key())) {
+    FUJINAMI_LOG(trace, "release trigger key");
+    context.send_release();
+  } else if (state_.try_release_modifier_key(event.key())) {
+    FUJINAMI_LOG(trace, "release modifier key");
+    // キーリピート中でない場合のみ、リリースイベントを送る。
+    if (!state_.trigger_keyset()) {
+      context.send_release();
+    }
+  } else if (state_.try_release_dontcare_key(event.key())) {
+    FUJINAMI_LOG(trace, "release dontcare key");
+  } else {
+    FUJINAMI_LOG(trace, "release other key");
+  }
+  state_.pop_event();
+}
+
+template <typename NextStageContext>
+void Engine::update(const DefaultLayoutEvent& event,
+                    NextStageContext& context) noexcept {
+  FUJINAMI_LOG(trace, "default_layout (event:{})", event);
+  default_layout_ = event.default_layout();
+  default_im_layout_ = event.default_im_layout();
+  prev_im_status_ = false;
+  state_.set_layout(default_layout_);
+  state_.pop_event();
+}
+
+template <typename NextStageContext>
+void Engine::update(const ControlEvent& event,
+                    NextStageContext& context) noexcept {
+  FUJINAMI_LOG(trace, "control (event:{})", event);
+  if (event.config()) {
+    default_layout_ = event.config()->default_layout().get();
+    default_im_layout_ = event.config()->default_im_layout().get();
+    auto_layout_ = event.config()->auto_layout();
+    prev_im_status_ = false;
+    state_.reset(event.config());
+  } else {
+    default_layout_ = nullptr;
+    default_im_layout_ = nullptr;
+    auto_layout_ = false;
+    prev_im_status_ = false;
+    state_.reset();
+  }
+  // 以降は古い設定を参照しない。後段にも同じエポックを渡す。
+  repeat_layout_ = nullptr;
+  repeat_keyset_.reset();
+  repeat_entry_ = nullptr;
+  epoch_ = event.epoch();
+  context.send_config(event.config(), event.epoch());
+  state_.pop_event();
+}
 }  // namespace buffering
 }  // namespace fujinami
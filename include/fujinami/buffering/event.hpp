@@ -1,5 +1,6 @@
 ﻿#pragma once
 
+#include <cstdint>
 #include <new>
 #include <fujinami/logging.hpp>
 #include <fujinami/key.hpp>
@@ -21,17 +22,25 @@ FUJINAMI_LOGGING_ENUM(inline, EventType,
 
 class KeyPressEvent {
  public:
-  explicit KeyPressEvent(const Clock::time_point& time, Key key)
-      : time_(time), key_(key) {}
+  explicit KeyPressEvent(const Clock::time_point& time, Key key,
+                         uint32_t frame = 0)
+      : time_(time), frame_(frame), key_(key) {}
 
   const Clock::time_point& time() const noexcept { return time_; }
 
   Key key() const noexcept { return key_; }
 
-  FUJINAMI_LOGGING_STRUCT(KeyPressEvent, (("time", time_))(("key", key_)));
+  // 入力デバイスが一度に報告したキーに共通の番号 (0は不明)
+  //
+  // 同じ番号のキーはキーボードが同時に走査したもので、同時に押したとみなせる。
+  uint32_t frame() const noexcept { return frame_; }
+
+  FUJINAMI_LOGGING_STRUCT(KeyPressEvent, (("time", time_))(("key", key_))(
+                                             ("frame", frame_)));
 
  private:
   Clock::time_point time_;
+  uint32_t frame_ = 0;
   Key key_ = Key::UNKNOWN;
 };
 
@@ -51,20 +60,19 @@ class KeyReleaseEvent {
   Key key_ = Key::UNKNOWN;
 };
 
+// レイアウトは最後にControlEventで渡した設定のものでなければならない。
 class DefaultLayoutEvent final {
  public:
-  explicit DefaultLayoutEvent(
-      std::shared_ptr<const KeyboardLayout> default_layout,
-      std::shared_ptr<const KeyboardLayout> default_im_layout) noexcept
-      : default_layout_(std::move(default_layout)),
-        default_im_layout_(std::move(default_im_layout)) {}
+  explicit DefaultLayoutEvent(const KeyboardLayout* default_layout,
+                              const KeyboardLayout* default_im_layout) noexcept
+      : default_layout_(default_layout),
+        default_im_layout_(default_im_layout) {}
 
-  const std::shared_ptr<const KeyboardLayout>& default_layout() const noexcept {
+  const KeyboardLayout* default_layout() const noexcept {
     return default_layout_;
   }
 
-  const std::shared_ptr<const KeyboardLayout>& default_im_layout() const
-      noexcept {
+  const KeyboardLayout* default_im_layout() const noexcept {
     return default_im_layout_;
   }
 
@@ -73,23 +81,28 @@ class DefaultLayoutEvent final {
                               ("default_im_layout", default_im_layout_)));
 
  private:
-  std::shared_ptr<const KeyboardLayout> default_layout_;
-  std::shared_ptr<const KeyboardLayout> default_im_layout_;
+  const KeyboardLayout* default_layout_ = nullptr;
+  const KeyboardLayout* default_im_layout_ = nullptr;
 };
 
+// 設定を差し替えるイベント
+//
+// 設定の寿命はConfigReclaimerが保ち、epochはそこで得たものを渡す。
 class ControlEvent final {
  public:
-  explicit ControlEvent(std::shared_ptr<const KeyboardConfig> config) noexcept
-      : config_(std::move(config)) {}
+  explicit ControlEvent(const KeyboardConfig* config, uint64_t epoch) noexcept
+      : config_(config), epoch_(epoch) {}
 
-  const std::shared_ptr<const KeyboardConfig>& config() const noexcept {
-    return config_;
-  }
+  const KeyboardConfig* config() const noexcept { return config_; }
+
+  uint64_t epoch() const noexcept { return epoch_; }
 
-  FUJINAMI_LOGGING_STRUCT(ControlEvent, (("config", config_)));
+  FUJINAMI_LOGGING_STRUCT(ControlEvent,
+                          (("config", config_))(("epoch", epoch_)));
 
  private:
-  std::shared_ptr<const KeyboardConfig> config_;
+  const KeyboardConfig* config_ = nullptr;
+  uint64_t epoch_ = 0;
 };
 
 class AnyEvent final {
@@ -0,0 +1,147 @@
+﻿#pragma once
+
+#include <array>
+#include <cassert>
+#include <type_traits>
+#include "event.hpp"
+
+namespace fujinami {
+namespace buffering {
+// 先読みの対象となるイベント
+//
+// キーイベントはそのまま持ち、それ以外のイベントは種類だけを持つ。
+class WindowEvent final {
+ public:
+  WindowEvent() = default;
+
+  explicit WindowEvent(const KeyPressEvent& event) noexcept
+      : time_(event.time()),
+        frame_(event.frame()),
+        key_(event.key()),
+        type_(EventType::KEY_PRESS) {}
+
+  explicit WindowEvent(const KeyReleaseEvent& event) noexcept
+      : time_(event.time()),
+        key_(event.key()),
+        type_(EventType::KEY_RELEASE) {}
+
+  explicit WindowEvent(EventType type) noexcept : type_(type) {}
+
+  EventType type() const noexcept { return type_; }
+
+  // キーイベントの場合に限り、元のイベントを返す。
+  template <typename T>
+  T as() const noexcept;
+
+  // リングの外に中身を置くイベントかどうか
+  bool is_out_of_line() const noexcept {
+    return type_ == EventType::DEFAULT_LAYOUT || type_ == EventType::CONTROL;
+  }
+
+ private:
+  Clock::time_point time_;
+  uint32_t frame_ = 0;  // KEY_PRESSの場合のみ
+  Key key_ = Key::UNKNOWN;
+  EventType type_ = EventType::NONE;
+};
+
+template <>
+inline KeyPressEvent WindowEvent::as<KeyPressEvent>() const noexcept {
+  assert(type_ == EventType::KEY_PRESS);
+  return KeyPressEvent(time_, key_, frame_);
+}
+
+template <>
+inline KeyReleaseEvent WindowEvent::as<KeyReleaseEvent>() const noexcept {
+  assert(type_ == EventType::KEY_RELEASE);
+  return KeyReleaseEvent(time_, key_);
+}
+
+// 先読み用のイベントを溜めておく固定長のリング
+//
+// 追加、参照、先頭からの削除はいずれも確保を伴わないO(1)の操作で、
+// 溢れた場合はpushがfalseを返す。DefaultLayoutEventとControlEventは
+// 別のリングに置き、先頭に来たときにfront_payloadで取り出す。
+class EventWindow final {
+ public:
+  static constexpr size_t CAPACITY = 128;
+  static constexpr size_t PAYLOAD_CAPACITY = 16;
+
+  bool push(const AnyEvent& event) noexcept {
+    if (is_full()) return false;
+    switch (event.type()) {
+      case EventType::NONE:
+        return true;
+      case EventType::KEY_PRESS:
+        events_[tail_ & MASK] = WindowEvent(event.as<KeyPressEvent>());
+        break;
+      case EventType::KEY_RELEASE:
+        events_[tail_ & MASK] = WindowEvent(event.as<KeyReleaseEvent>());
+        break;
+      case EventType::DEFAULT_LAYOUT:
+      case EventType::CONTROL:
+        if (payload_tail_ - payload_head_ >= PAYLOAD_CAPACITY) return false;
+        payloads_[payload_tail_++ & PAYLOAD_MASK] = event;
+        events_[tail_ & MASK] = WindowEvent(event.type());
+        break;
+    }
+    ++tail_;
+    return true;
+  }
+
+  void pop() noexcept { consume(1); }
+
+  // 先頭からcount個のイベントを取り除く。
+  void consume(size_t count) noexcept {
+    assert(count <= size());
+    for (size_t i = 0; i < count; ++i) {
+      // 取り除いたイベントの本体も空ける。
+      if (events_[head_ & MASK].is_out_of_line()) {
+        payloads_[payload_head_++ & PAYLOAD_MASK] = AnyEvent();
+      }
+      ++head_;
+    }
+  }
+
+  void clear() noexcept { consume(size()); }
+
+  // 先頭のイベントがリングの外に中身を置くものの場合、その中身を返す。
+  const AnyEvent& front_payload() const noexcept {
+    assert(!empty() && front().is_out_of_line());
+    return payloads_[payload_head_ & PAYLOAD_MASK];
+  }
+
+  const WindowEvent& operator[](size_t i) const noexcept {
+    assert(i < size());
+    return events_[(head_ + i) & MASK];
+  }
+
+  const WindowEvent& front() const noexcept { return (*this)[0]; }
+
+  size_t size() const noexcept { return tail_ - head_; }
+
+  // これまでに取り除いたイベントの数
+  size_t consumed_count() const noexcept { return head_; }
+
+  bool empty() const noexcept { return head_ == tail_; }
+
+  bool is_full() const noexcept { return size() >= CAPACITY; }
+
+ private:
+  static constexpr size_t MASK = CAPACITY - 1;
+  static constexpr size_t PAYLOAD_MASK = PAYLOAD_CAPACITY - 1;
+  static_assert((CAPACITY & MASK) == 0, "CAPACITY must be a power of 2");
+  static_assert((PAYLOAD_CAPACITY & PAYLOAD_MASK) == 0,
+                "PAYLOAD_CAPACITY must be a power of 2");
+  static_assert(std::is_trivially_copyable<WindowEvent>::value,
+                "WindowEvent must be trivially copyable");
+
+  std::array<WindowEvent, CAPACITY> events_;
+  size_t head_ = 0;
+  size_t tail_ = 0;
+  std::array<AnyEvent, PAYLOAD_CAPACITY> payloads_;
+  size_t payload_head_ = 0;
+  size_t payload_tail_ = 0;
+};
+}  // namespace buffering
+}  // namespace fujinami
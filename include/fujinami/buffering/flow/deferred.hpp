@@ -18,6 +18,11 @@ class DeferredKeyFlow final {
 
   Clock::time_point timeout_tp() const noexcept;
 
+  // 先読みの窓が溢れたときに呼び、時間切れと同じく現在の状態で確定する。
+  void commit(State& state) noexcept;
+
+  size_t observed_event_last() const noexcept { return observed_event_last_; }
+
  private:
   FlowResult update(const KeyPressEvent& event, State& state) noexcept;
   FlowResult update(const KeyReleaseEvent& event, State& state) noexcept;
@@ -28,7 +33,7 @@ class DeferredKeyFlow final {
   Key repeat_key_ = Key::UNKNOWN;  // キーリピートの対象となるキー
   Keyset pressed_keyset_;  // 押されている有効なキーのセット
   Keyset dontcare_keyset_;  // 処理終了時の状態を記録する無視するキーのセット
-  const KeysetProperty* keyset_property_ = nullptr;
+  KeysetProperty keyset_property_;
 };
 }  // namespace buffering
 }  // namespace fujinami
@@ -20,9 +20,17 @@ class DualKeyFlow final {
     return Clock::time_point::max();
   }
 
+  // 先読みの窓が溢れたときに呼ぶ。時間切れはないので、
+  // 第1キーを押し続けているとみなして修飾キーとして確定する。
+  void commit(State& state) noexcept;
+
+  size_t observed_event_last() const noexcept { return observed_event_last_; }
+
  private:
   void finish(State& state, bool mod) noexcept;
 
+  size_t observed_event_last_ = 0;  // 次に覗き見るイベントを指す
+
   Keyset modifier_keyset_;
   Keyset dontcare_keyset_;
   Key first_key_;
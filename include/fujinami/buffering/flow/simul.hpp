@@ -5,6 +5,7 @@
 #include "../state.hpp"
 #include "../event.hpp"
 #include "result.hpp"
+#include "../simul_timing.hpp"
 
 namespace fujinami {
 namespace buffering {
@@ -19,9 +20,44 @@ class SimulKeyFlow final {
 
   Clock::time_point timeout_tp() const noexcept;
 
+  // 先読みの窓が溢れたときに呼び、時間切れと同じく現在の状態で確定する。
+  void commit(State& state) noexcept;
+
+  size_t observed_event_last() const noexcept { return observed_event_last_; }
+
+  // resetで受け取った第1キー
+  Key first_key() const noexcept { return first_key_; }
+
+  // 学習した判定時間 (設定のadaptive_simulが有効な場合に使う)
+  SimulTiming& timing() noexcept { return timing_; }
+
+  const SimulTiming& timing() const noexcept { return timing_; }
+
+  // キーを離したイベントを受け取り、保留している学習を済ませる。
+  // フローを通らずに処理されるイベントもあるので、窓に入れる前に呼ぶ。
+  void observe(const KeyReleaseEvent& event) noexcept;
+
  private:
   void consume(State& state) noexcept;
 
+  // 第1キーと第2キーの押下時刻が揃ったフローの終わりに、打ち方を学習する。
+  // 第1キーを離した時刻がまだわからなければ、届くまで保留する。
+  void learn(const State& state, Key second_key,
+             Clock::time_point second_begin_tp) noexcept;
+
+  // 第1キーを離すまで保留している学習
+  struct Sample final {
+    Key first_key = Key::UNKNOWN;
+    Key second_key = Key::UNKNOWN;
+    Clock::duration gap;
+    Clock::time_point second_begin_tp;
+    double error_rate = 0.0;
+  };
+
+  SimulTiming timing_;
+  bool is_adaptive_ = false;
+  Sample sample_;
+
   Clock::time_point timeout_tp_;
   Clock::time_point press_timeout_tp_;
   Clock::time_point release_timeout_tp_;
@@ -33,12 +69,14 @@ class SimulKeyFlow final {
 
   // はじめに押されるキー
   Key first_key_;
+  uint32_t first_frame_;
   Clock::time_point first_begin_tp_;
   Clock::time_point first_end_tp_;
 
   // 次に押されるキー
   Key second_key_;
   Clock::time_point second_begin_tp_;
+  bool is_same_frame_;  // 第1キーと同じフレームで押された
   size_t second_consumed_event_last_;
   Keyset second_dontcare_keyset_;
   Keyset second_post_released_keyset_;
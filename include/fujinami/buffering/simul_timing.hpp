@@ -0,0 +1,97 @@
+﻿#pragma once
+
+#include <array>
+#include <cstdint>
+#include <string>
+#include <fujinami/key.hpp>
+#include <fujinami/keyset.hpp>
+#include <fujinami/time.hpp>
+
+namespace fujinami {
+namespace buffering {
+// 同時打鍵とみなす押下間隔を、キーの組ごとに学習する
+//
+// 第1キーと第2キーの押下間隔を、同時打鍵だったか順次打鍵だったかに分けて
+// ヒストグラムに数える。判定を誤る割合が目標以下に収まる最小の間隔を、
+// そのキーの組の判定時間とする。
+// 同時打鍵だったかは、第2キーを押してから第1キーを離すまでの重なりが
+// 押下間隔以上あるかで見分ける。
+class SimulTiming final {
+ public:
+  static constexpr size_t BIN_COUNT = 32;
+  static constexpr int64_t BIN_WIDTH_US = 4000;
+  static constexpr size_t PAIR_CAPACITY = 256;  // 超えたら最も古い組を捨てる
+  static constexpr uint32_t MIN_SAMPLE_COUNT = 32;  // これ未満は判定に使わない
+  static constexpr uint32_t MAX_SAMPLE_COUNT = 4096;  // 超えたら全て半分にする
+
+  // 第1キーから始まる組で、同時打鍵と判定しうる最大の押下間隔
+  // partner_keysetは第1キーとの同時押しが登録されている第2キーのセット。
+  // 学習していない組が1つでもあればdefault_durを返し、
+  // default_durより長くはしない。
+  Clock::duration first_window(Key first, const Keyset& partner_keyset,
+                               Clock::duration default_dur) const noexcept;
+
+  // 第1キーと第2キーの組を同時打鍵と判定する押下間隔の上限
+  Clock::duration pair_window(Key first, Key second,
+                              Clock::duration default_dur) const noexcept {
+    const Pair* pair = find(to_pair_key(first, second));
+    return to_window(pair ? pair->window_bins : 0, default_dur);
+  }
+
+  // 打鍵の結果を数え、判定時間を更新する。
+  void learn(Key first, Key second, Clock::duration gap, bool is_simul,
+             double target_error_rate) noexcept;
+
+  void clear() noexcept;
+
+  // 学習した内容をバイナリ形式で保存する。
+  bool save(const std::string& path) const;
+
+  // 形式が異なる場合はfalseを返し、学習した内容を捨てる。
+  bool load(const std::string& path);
+
+  // 学習しているキーの組の数
+  size_t pair_count() const noexcept;
+
+ private:
+  struct Pair final {
+    uint16_t key;          // 第1キー << 8 | 第2キー (0の場合は空き)
+    uint8_t window_bins;   // 判定時間のビン数 (0の場合は未学習)
+    uint8_t reserved;
+    uint32_t sample_count;
+    uint32_t learn_tick;   // 最後に数えた時点 (捨てる組を選ぶのに使う)
+    std::array<uint16_t, BIN_COUNT> simul_bins;
+    std::array<uint16_t, BIN_COUNT> serial_bins;
+  };
+
+  static size_t to_home_index(uint16_t key) noexcept {
+    return (key * 0x9E37u) & (PAIR_CAPACITY - 1);
+  }
+
+  static uint16_t to_pair_key(Key first, Key second) noexcept {
+    return static_cast<uint16_t>(static_cast<uint16_t>(first) << 8 |
+                                 static_cast<uint16_t>(second));
+  }
+
+  static Clock::duration to_window(uint8_t window_bins,
+                                   Clock::duration default_dur) noexcept {
+    if (window_bins == 0) return default_dur;
+    const Clock::duration window = std::chrono::duration_cast<Clock::duration>(
+        std::chrono::microseconds(window_bins * BIN_WIDTH_US));
+    return window < default_dur ? window : default_dur;
+  }
+
+  const Pair* find(uint16_t key) const noexcept;
+
+  Pair* find_or_insert(uint16_t key) noexcept;
+
+  void erase(size_t index) noexcept;
+
+  static uint8_t compute_window_bins(const Pair& pair,
+                                     double target_error_rate) noexcept;
+
+  std::array<Pair, PAIR_CAPACITY> pairs_{};
+  uint32_t learn_tick_ = 0;
+};
+}  // namespace buffering
+}  // namespace fujinami
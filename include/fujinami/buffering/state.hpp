@@ -1,11 +1,11 @@
 ﻿#pragma once
 
-#include <deque>
 #include <gsl/gsl>
 #include <fujinami/logging.hpp>
 #include <fujinami/keyboard_config.hpp>
 #include <fujinami/keyboard_layout.hpp>
 #include "event.hpp"
+#include "event_window.hpp"
 
 namespace fujinami {
 namespace buffering {
@@ -60,9 +60,11 @@ class State final {
     dontcare_keyset_ = dontcare_keyset;
   }
 
-  void reset(std::shared_ptr<const KeyboardConfig> config = nullptr) noexcept {
-    config_ = std::move(config);
-    layout_ = config_ ? config_->default_layout() : nullptr;
+  void reset(const KeyboardConfig* config = nullptr) noexcept {
+    config_ = config;
+    layout_ = config_ ? config_->default_layout().get() : nullptr;
+    found_entry_ = nullptr;
+    is_found_ = false;
     active_keyset_.reset();
     trigger_keyset_.reset();
     modifier_keyset_.reset();
@@ -74,40 +76,61 @@ class State final {
     return layout_->find_key_property(key);
   }
 
-  const KeysetProperty* find_keyset_property(const Keyset& keyset) const
-      noexcept {
-    if (!layout_) return nullptr;
-    return layout_->find_keyset_property(keyset);
+  const KeysetEntry* find_keyset_entry(const Keyset& keyset) const noexcept {
+    find(keyset);
+    return found_entry_;
   }
 
-  void set_layout(std::shared_ptr<const KeyboardLayout> layout) noexcept {
-    layout_ = std::move(layout);
+  KeysetProperty find_keyset_property(const Keyset& keyset) const noexcept {
+    find(keyset);
+    return found_property_;
   }
 
-  void set_next_layout() noexcept {
-    if (layout_) {
-      auto next_layout = layout_->find_next_layout(active_keyset_).lock();
-      if (next_layout) next_layout = std::move(next_layout);
-    }
+  const KeysetEntry* active_entry() const noexcept {
+    return find_keyset_entry(active_keyset_);
   }
 
-  void push_event(const AnyEvent& event) { events_.push_back(event); }
-
-  void pop_event() { events_.pop_front(); }
+  void set_layout(const KeyboardLayout* layout) noexcept {
+    layout_ = layout;
+    found_entry_ = nullptr;
+    is_found_ = false;
+  }
 
-  void consume_events(size_t last) {
-    events_.erase(events_.begin(), events_.begin() + last);
+  void set_next_layout(const KeysetEntry* active_entry) noexcept {
+    if (!active_entry) return;
+    const KeyboardLayout* next_layout = active_entry->next_layout();
+    if (next_layout) set_layout(next_layout);
   }
 
-  const std::shared_ptr<const KeyboardConfig>& config() const noexcept {
-    return config_;
+  // 先読みの窓が溢れた場合はfalseを返し、イベントは積まない。
+  bool push_event(const AnyEvent& event) noexcept {
+    return events_.push(event);
   }
 
-  const std::shared_ptr<const KeyboardLayout>& layout() const noexcept {
-    return layout_;
+  void pop_event() noexcept { events_.pop(); }
+
+  void consume_events(size_t last) noexcept { events_.consume(last); }
+
+  const KeyboardConfig* config() const noexcept { return config_; }
+
+  const KeyboardLayout* layout() const noexcept { return layout_; }
+
+  // keyから始まるフローの待ち時間
+  //
+  // keyを押して至ったキーセットから組み合わせうるキーセットの指定、
+  // キーの指定、設定全体の順に優先する。
+  Clock::duration timeout_dur(
+      Key key, const KeysetProperty& keyset_property) const noexcept {
+    const Clock::duration default_dur =
+        config_ ? config_->timeout_dur() : Clock::duration::zero();
+    const KeyProperty* key_property = find_key_property(key);
+    const Clock::duration key_dur =
+        key_property ? key_property->timeout().value_or(default_dur)
+                     : default_dur;
+    return keyset_property.chord_timeout().value_or(key_dur);
   }
 
-  const std::deque<AnyEvent>& events() const noexcept { return events_; }
+  const EventWindow& events() const noexcept { return events_; }
 
   const Keyset& active_keyset() const noexcept { return active_keyset_; }
 
@@ -118,15 +141,38 @@ class State final {
   const Keyset& dontcare_keyset() const noexcept { return dontcare_keyset_; }
 
  private:
-  std::shared_ptr<const KeyboardConfig> config_;
-  std::shared_ptr<const KeyboardLayout> layout_;
+  // キーセットのエントリと属性を探す。
+  //
+  // 直前に探した結果を覚えておき、同じキーセットを続けて探す場合は
+  // レイアウトを引かずに済ませる。
+  void find(const Keyset& keyset) const noexcept {
+    if (is_found_ && found_keyset_ == keyset) return;
+    found_keyset_ = keyset;
+    if (layout_) {
+      found_entry_ = layout_->find_keyset_entry(keyset);
+      found_property_ = layout_->find_keyset_property(keyset, found_entry_);
+    } else {
+      found_entry_ = nullptr;
+      found_property_ = KeysetProperty{};
+    }
+    is_found_ = true;
+  }
+
+  // 寿命はConfigReclaimerが保つ。
+  const KeyboardConfig* config_ = nullptr;
+  const KeyboardLayout* layout_ = nullptr;
 
-  std::deque<AnyEvent> events_;
+  EventWindow events_;
 
   Keyset active_keyset_;
   Keyset trigger_keyset_;
   Keyset modifier_keyset_;
   Keyset dontcare_keyset_;
+
+  mutable Keyset found_keyset_;
+  mutable const KeysetEntry* found_entry_ = nullptr;
+  mutable KeysetProperty found_property_;
+  mutable bool is_found_ = false;
 };
 }  // namespace buffering
 }  // namespace fujinami
@@ -1,10 +1,12 @@
 ﻿#pragma once
 
+#include <atomic>
 #include <cstdint>
 #include <new>
 #include <type_traits>
 #include <vector>
 #include "logging.hpp"
+#include "output.hpp"
 #include "platform.hpp"
 #if defined(FUJINAMI_PLATFORM_WIN32)
 #include <fujinami_win32/action.hpp>
@@ -92,91 +94,103 @@ class AnyAction {
     return *this;
   }
 
-  void press(const AnyAction& prev) const noexcept {
+  void press(const AnyAction& prev, Output& output) const noexcept {
     switch (type_) {
       case Type::KEY: {
         if (prev.type_ == Type::KEY) {
-          key_.press(prev.key_);
+          key_.press(prev.key_, output);
         } else {
-          prev.release();
-          key_.press();
+          prev.release(output);
+          key_.press(output);
         }
         break;
       }
       case Type::CHAR: {
         if (prev.type_ == Type::CHAR) {
-          char_.press(prev.char_);
+          char_.press(prev.char_, output);
         } else {
-          prev.release();
-          char_.press();
+          prev.release(output);
+          char_.press(output);
         }
         break;
       }
     }
   }
 
-  void press() const noexcept {
+  void press(Output& output) const noexcept {
     switch (type_) {
       case Type::KEY: {
-        key_.press();
+        key_.press(output);
         break;
       }
       case Type::CHAR: {
-        char_.press();
+        char_.press(output);
         break;
       }
     }
   }
 
-  void repeat(const AnyAction& prev) const noexcept {
+  void repeat(const AnyAction& prev, Output& output) const noexcept {
     switch (type_) {
       case Type::KEY: {
         if (prev.type_ == Type::KEY) {
-          key_.repeat(prev.key_);
+          key_.repeat(prev.key_, output);
         } else {
-          prev.release();
-          key_.repeat();
+          prev.release(output);
+          key_.repeat(output);
         }
         break;
       }
       case Type::CHAR: {
         if (prev.type_ == Type::CHAR) {
-          char_.repeat(prev.char_);
+          char_.repeat(prev.char_, output);
         } else {
-          prev.release();
-          char_.repeat();
+          prev.release(output);
+          char_.repeat(output);
         }
         break;
       }
     }
   }
 
-  void repeat() const noexcept {
+  void repeat(Output& output) const noexcept {
     switch (type_) {
       case Type::KEY: {
-        key_.repeat();
+        key_.repeat(output);
         break;
       }
       case Type::CHAR: {
-        char_.repeat();
+        char_.repeat(output);
         break;
       }
     }
   }
 
-  void release() const noexcept {
+  void release(Output& output) const noexcept {
     switch (type_) {
       case Type::KEY: {
-        key_.release();
+        key_.release(output);
         break;
       }
       case Type::CHAR: {
-        char_.release();
+        char_.release(output);
         break;
       }
     }
   }
 
+  // 1文字を入力するアクションかどうか
+  bool is_printable() const noexcept {
+    switch (type_) {
+      case Type::KEY:
+        return key_.is_printable();
+      case Type::CHAR:
+        return char_.is_printable();
+      default:
+        return false;
+    }
+  }
+
   FUJINAMI_LOGGING_UNION(AnyAction, Type,
                          ((KEY, "key", key_))((CHAR, "char", char_)));
 
@@ -232,48 +246,76 @@ class AnyAction {
 
 class Command final {
  public:
-  void press(const Command* prev) const noexcept {
+  void press(const Command* prev, Output& output) const noexcept {
+    // 直前の出力がない場合、事前に生成した出力をそのまま使う。
+    if (id_ != 0 && (!prev || prev->actions_.empty())) {
+      output.append(pressed_output_);
+      return;
+    }
     if (actions_.empty()) {
-      if (prev) prev->release();
+      if (prev) prev->release(output);
     } else {
       if (!prev || prev->actions_.empty()) {
-        actions_.front().press();
+        actions_.front().press(output);
       } else {
-        actions_.front().press(prev->actions_.back());
+        actions_.front().press(prev->actions_.back(), output);
       }
       for (size_t i = 1; i < actions_.size(); ++i) {
-        actions_[i].press(actions_[i - 1]);
+        actions_[i].press(actions_[i - 1], output);
       }
     }
   }
 
-  void repeat(const Command* prev) const noexcept {
+  void repeat(const Command* prev, Output& output) const noexcept {
+    // 直前の出力がない場合、事前に生成した出力をそのまま使う。
+    if (id_ != 0 && (!prev || prev->actions_.empty())) {
+      output.append(repeated_output_);
+      return;
+    }
     if (actions_.empty()) {
-      if (prev) prev->release();
+      if (prev) prev->release(output);
     } else {
       if (!prev || prev->actions_.empty()) {
-        actions_.front().repeat();
+        actions_.front().repeat(output);
       } else {
-        actions_.front().repeat(prev->actions_.back());
+        actions_.front().repeat(prev->actions_.back(), output);
       }
       for (size_t i = 1; i < actions_.size(); ++i) {
-        actions_[i].press(actions_[i - 1]);
+        actions_[i].press(actions_[i - 1], output);
       }
     }
   }
 
-  void release() const noexcept {
-    if (!actions_.empty()) actions_.back().release();
+  void release(Output& output) const noexcept {
+    if (!actions_.empty()) actions_.back().release(output);
+  }
+
+  // 直前の出力がない状態からpress/repeatしたときの出力を事前に生成する。
+  // 生成した出力を識別するためのIDも振り直す。
+  void render() {
+    static std::atomic<uint32_t> last_id{0};
+    id_ = 0;
+    pressed_output_.clear();
+    repeated_output_.clear();
+    press(nullptr, pressed_output_);
+    repeat(nullptr, repeated_output_);
+    is_retractable_ = !actions_.empty();
+    for (const AnyAction& action : actions_) {
+      if (!action.is_printable()) is_retractable_ = false;
+    }
+    id_ = ++last_id;
   }
 
   template <typename... Args>
   void emplace_back(Args&&... args) {
     actions_.emplace_back(std::forward<Args>(args)...);
+    id_ = 0;
   }
 
   void insert(const Command& command) {
     actions_.insert(actions_.end(), command.actions_.begin(),
                     command.actions_.end());
+    id_ = 0;
   }
 
   void insert(Command&& command) {
@@ -281,13 +323,34 @@ class Command final {
                     std::make_move_iterator(command.actions_.begin()),
                     std::make_move_iterator(command.actions_.end()));
     command.actions_.clear();
+    command.id_ = 0;
+    id_ = 0;
   }
 
   bool is_empty() const noexcept { return actions_.empty(); }
 
+  // 出力する単位 (打鍵または文字) の数
+  size_t action_count() const noexcept { return actions_.size(); }
+
+  bool is_rendered() const noexcept { return id_ != 0; }
+
+  // 出力を取り消し列で打ち消せるか (render済みで、全てのアクションが
+  // 1文字を入力する場合)
+  //
+  // 取り消し列は1アクションを1文字として打ち消す。修飾キーを伴う出力や
+  // Enter・カーソル移動などの制御キーは文字を入力しないので、後から取り消せない。
+  bool is_retractable() const noexcept { return id_ != 0 && is_retractable_; }
+
+  // render済みのコマンドを一意に識別するID (未renderの場合は0)
+  uint32_t id() const noexcept { return id_; }
+
   FUJINAMI_LOGGING_STRUCT(Command, (("actions", actions_)));
 
  private:
   std::vector<AnyAction> actions_;
+  uint32_t id_ = 0;
+  bool is_retractable_ = false;
+  Output pressed_output_;
+  Output repeated_output_;
 };
 }  // namespace fujinami
@@ -0,0 +1,199 @@
+﻿#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <fujinami/keyboard_config.hpp>
+#include "errors.hpp"
+
+namespace fujinami {
+namespace config {
+// 設定スクリプトを評価した結果を、そのまま保存できる形で記録したもの
+//
+// 記録した内容をapply()で再生するとKeyboardConfigを構築できる。
+// バイナリ形式で保存しておけば、次回以降はスクリプトを評価せずに済む。
+class CompiledConfig final {
+ public:
+  // バイナリ形式が変わったら増やす。
+  static constexpr uint32_t VERSION = 6;
+  static constexpr uint32_t NO_LAYOUT = UINT32_MAX;
+
+  enum class ActionType : uint16_t {
+    KEY,
+    CHAR,
+  };
+
+  void reset() noexcept;
+
+  // 設定スクリプトとして読み込んだファイルを記録する。
+  //
+  // 保存したものを読み込む際、記録したファイルの内容が変わっていないか調べる。
+  // 同じパスを再び記録した場合は内容を更新する。
+  void add_source(const std::string& path, const char* data, size_t size);
+
+  // ファイルを読んで記録する。読めなかった場合はfalseを返す。
+  bool add_source(const std::string& path);
+
+  void set_timeout_milliseconds(int32_t timeout_ms) noexcept;
+
+  void set_default_layout(uint32_t layout) noexcept;
+
+  void set_default_im_layout(uint32_t layout) noexcept;
+
+  void set_auto_layout(bool is_enabled) noexcept;
+
+  void set_speculative_simul(bool is_enabled) noexcept;
+
+  // 先行出力を取り消すときのアクションを記録する。
+  void add_undo_action(ActionType type, uint16_t value,
+                       uint16_t modifiers = 0);
+
+  void set_adaptive_simul(bool is_enabled, double error_rate) noexcept;
+
+  void set_realtime_option(const RealtimeOption& option) noexcept;
+
+  const RealtimeOption& realtime_option() const noexcept {
+    return realtime_option_;
+  }
+
+  void set_queue_option(const QueueOption& option) noexcept;
+
+  const QueueOption& queue_option() const noexcept { return queue_option_; }
+
+  uint32_t add_layout(const std::string& name);
+
+  // timeout_msが負の場合は設定全体の待ち時間を使う。
+  void add_flow(uint32_t layout, Key key, FlowType flow_type,
+                int32_t timeout_ms = -1);
+
+  void begin_mapping(uint32_t layout, int32_t timeout_ms = -1);
+
+  void add_mapping_key(Key key, KeyRole role);
+
+  void add_mapping_action(ActionType type, uint16_t value,
+                          uint16_t modifiers = 0);
+
+  void end_mapping();
+
+  void add_transition(uint32_t layout, const Keyset& keyset,
+                      uint32_t next_layout);
+
+  // 記録した内容からKeyboardConfigを構築する。
+  void apply(KeyboardConfig& config) const;
+
+  // バイナリ形式で保存する。失敗した場合は例外を投げる。
+  void save(const std::string& path) const;
+
+  // バイナリ形式から読み込む。
+  //
+  // ファイルが存在しないか、形式が異なるか、記録したソースの内容が
+  // 変わっている場合はfalseを返す。
+  bool load(const std::string& path);
+
+  size_t layout_count() const noexcept { return layout_names_.size(); }
+
+  size_t mapping_count() const noexcept { return mappings_.size(); }
+
+ private:
+  struct Source final {
+    std::string path;
+    uint64_t hash;
+  };
+
+  struct FlowRecord final {
+    uint32_t layout;
+    uint16_t key;
+    uint16_t flow_type;
+    int32_t timeout_ms;  // 負の場合は未設定
+  };
+
+  struct MappingRecord final {
+    uint32_t layout;
+    uint32_t key_first;
+    uint32_t key_count;
+    uint32_t action_first;
+    uint32_t action_count;
+    int32_t timeout_ms;  // 負の場合は未設定
+  };
+
+  struct KeyRecord final {
+    uint16_t key;
+    uint16_t role;
+  };
+
+  struct ActionRecord final {
+    uint16_t type;
+    uint16_t value;
+    uint16_t modifiers;
+  };
+
+  struct TransitionRecord final {
+    uint32_t layout;
+    uint32_t key_first;
+    uint32_t key_count;
+    uint32_t next_layout;
+  };
+
+  bool is_valid_layout(uint32_t layout) const noexcept {
+    return layout < layout_names_.size();
+  }
+
+  // 壊れたファイルの値をそのまま列挙型やキーの添字に使わないよう、
+  // 読み込んだ記録の値を確かめる。
+  static bool is_valid_key(uint16_t key) noexcept { return key < KEY_COUNT; }
+
+  static bool is_valid_flow(const FlowRecord& flow) noexcept {
+    return is_valid_key(flow.key) &&
+           flow.flow_type <= static_cast<uint16_t>(FlowType::DUAL) &&
+           is_valid_timeout(flow.timeout_ms);
+  }
+
+  static bool is_valid_key_record(const KeyRecord& key) noexcept {
+    return is_valid_key(key.key) &&
+           key.role <= static_cast<uint16_t>(KeyRole::MODIFIER);
+  }
+
+  static bool is_valid_action(const ActionRecord& action) noexcept {
+    switch (static_cast<ActionType>(action.type)) {
+      case ActionType::KEY:
+        return is_valid_key(action.value) &&
+               action.modifiers <= static_cast<uint16_t>(Modifier::ALL);
+      case ActionType::CHAR:
+        return action.modifiers == 0;
+    }
+    return false;
+  }
+
+  // 追加できたか (このプラットフォームで出力できないアクションはfalse)
+  static bool append_action(Command& command, const ActionRecord& action);
+
+  static TimeoutOverride to_timeout(int32_t timeout_ms) noexcept {
+    TimeoutOverride timeout;
+    if (timeout_ms >= 0) timeout.timeout_ms = static_cast<uint16_t>(timeout_ms);
+    return timeout;
+  }
+
+  static bool is_valid_timeout(int32_t timeout_ms) noexcept {
+    return timeout_ms >= -1 && timeout_ms <= TimeoutOverride::MAX_TIMEOUT_MS;
+  }
+
+  std::vector<Source> sources_;
+  int32_t timeout_ms_ = -1;  // 負の場合は未設定
+  uint32_t default_layout_ = NO_LAYOUT;
+  uint32_t default_im_layout_ = NO_LAYOUT;
+  bool auto_layout_ = false;
+  bool speculative_simul_ = false;
+  std::vector<ActionRecord> undo_actions_;
+  bool adaptive_simul_ = false;
+  double simul_error_rate_ = KeyboardConfig::DEFAULT_SIMUL_ERROR_RATE;
+  RealtimeOption realtime_option_;
+  QueueOption queue_option_;
+  std::vector<std::string> layout_names_;
+  std::vector<FlowRecord> flows_;
+  std::vector<MappingRecord> mappings_;
+  std::vector<KeyRecord> keys_;
+  std::vector<ActionRecord> actions_;
+  std::vector<TransitionRecord> transitions_;
+};
+}  // namespace config
+}  // namespace fujinami
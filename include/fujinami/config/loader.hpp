@@ -6,6 +6,7 @@
 #include <sol.hpp>
 #include <fujinami/logging.hpp>
 #include <fujinami/keyboard_config.hpp>
+#include "compiled_config.hpp"
 #include "errors.hpp"
 
 namespace fujinami {
@@ -18,23 +19,34 @@ class LuaLoader final {
 
   void load(KeyboardConfig& config);
 
+  // コンパイル済みの設定が有効であればそれを使い、そうでなければ
+  // スクリプトを評価した結果をコンパイル済みの設定として保存する。
+  void load(KeyboardConfig& config, const std::string& compiled_path);
+
+  // 直前のload()でスクリプトを評価した結果
+  const CompiledConfig& compiled() const noexcept { return compiled_; }
+
  private:
   struct PassthroughHash final {
     using argument_type = size_t;
     using result_type = size_t;
     size_t operator()(size_t key) const noexcept { return key; }
   };
-  using LayoutMap = std::unordered_map<size_t, std::shared_ptr<KeyboardLayout>,
-                                       PassthroughHash>;
+  using LayoutMap = std::unordered_map<size_t, uint32_t, PassthroughHash>;
+
+  sol::object wrequire(sol::this_state self, const std::string& modname);
 
   void set_global_option(const sol::table& tbl);
 
   size_t get_layout_handle(const std::string& name);
 
-  void create_flow(size_t layout_handle, int key, int flow_type);
+  // timeout_msを省略した場合は設定全体の待ち時間を使う。
+  void create_flow(size_t layout_handle, int key, int flow_type,
+                   sol::optional<int> timeout_ms);
 
   void create_mapping(size_t layout_handle, const sol::table& active_keys_tbl,
-                      const sol::table& command_tbl);
+                      const sol::table& command_tbl,
+                      sol::optional<int> timeout_ms);
 
   void create_next_layout(size_t layout_handle, const sol::table& keys_tbl,
                           const std::string& name);
@@ -42,9 +54,8 @@ class LuaLoader final {
   LayoutMap::const_iterator create_layout(const std::string& name);
 
   KeyboardConfig* config_ = nullptr;
+  CompiledConfig compiled_;
   LayoutMap layout_map_;
-  std::vector<Key> keys_;
-  std::vector<KeyRole> roles_;
 };
 }  // namespace config
 }  // namespace fujinami
@@ -0,0 +1,85 @@
+﻿#pragma once
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include "keyboard_config.hpp"
+
+namespace fujinami {
+// 差し替えた設定を、どの段からも参照されなくなってから解放する
+//
+// 設定を差し替えるたびにエポックを一つ進める。各段は新しい設定を使い始めた
+// ときにそのエポックを公開し、それより前の設定を参照しないことを示す。
+// 全段が通過したエポックより前の設定は解放してよい。
+// これにより、各段は設定とレイアウトを参照カウントなしの生ポインタで扱える。
+class ConfigReclaimer final {
+ public:
+  // 設定を参照する段
+  enum class Reader : uint8_t {
+    BUFFERING,
+    MAPPING,
+  };
+  static constexpr size_t READER_COUNT = 2;
+
+  ConfigReclaimer() noexcept {
+    for (auto&& reader_epoch : reader_epochs_) reader_epoch.store(0);
+  }
+
+  // 設定を差し替えるスレッドから呼ぶ。
+  // configを保持し、各段へ設定と共に渡すエポックを返す。
+  uint64_t install(std::shared_ptr<const KeyboardConfig> config) {
+    configs_.push_back(Entry{++epoch_, std::move(config)});
+    return epoch_;
+  }
+
+  // 設定を差し替えるスレッドから呼ぶ。
+  // 全段が通過したエポックより前の設定を解放し、解放した数を返す。
+  size_t collect() noexcept {
+    uint64_t min_epoch = epoch_;
+    for (auto&& reader_epoch : reader_epochs_) {
+      min_epoch =
+          std::min(min_epoch, reader_epoch.load(std::memory_order_acquire));
+    }
+    size_t count = 0;
+    while (!configs_.empty() && configs_.front().epoch < min_epoch) {
+      configs_.pop_front();
+      ++count;
+    }
+    return count;
+  }
+
+  // 各段のスレッドから呼ぶ。
+  // epochの設定を使い始め、それより前の設定を参照しないことを公開する。
+  // エポックが変わらない間は書き込まず、変わった場合はtrueを返す。
+  bool enter(Reader reader, uint64_t epoch) noexcept {
+    std::atomic<uint64_t>& reader_epoch =
+        reader_epochs_[static_cast<size_t>(reader)];
+    if (reader_epoch.load(std::memory_order_relaxed) == epoch) return false;
+    reader_epoch.store(epoch, std::memory_order_release);
+    return true;
+  }
+
+  // 全段が止まっている間に呼ぶ。
+  void reset() noexcept {
+    configs_.clear();
+    epoch_ = 0;
+    for (auto&& reader_epoch : reader_epochs_) reader_epoch.store(0);
+  }
+
+  // 保持している設定の数 (現在の設定を含む)
+  size_t size() const noexcept { return configs_.size(); }
+
+ private:
+  struct Entry final {
+    uint64_t epoch;
+    std::shared_ptr<const KeyboardConfig> config;
+  };
+
+  std::deque<Entry> configs_;
+  uint64_t epoch_ = 0;
+  std::array<std::atomic<uint64_t>, READER_COUNT> reader_epochs_;
+};
+}  // namespace fujinami
@@ -0,0 +1,218 @@
+﻿#pragma once
+
+#include <atomic>
+#include <cassert>
+#include <chrono>
+#include <memory>
+#include <thread>
+#include "logging.hpp"
+#include "time.hpp"
+#include "wakeup.hpp"
+
+namespace fujinami {
+// 1つの送信スレッドと1つの受信スレッドを繋ぐ固定長のロックフリーキュー
+//
+// 送受信はロックを取らずに行い、受信側はキューが空の場合に限りWakeupで待機する。
+// 送信側はstageで溜めたイベントをcommitでまとめて公開でき、
+// 受信側はtry_pop_allで届いているイベントをまとめて取り出せる。
+template <typename T>
+class EventQueue final {
+ public:
+  static constexpr size_t DEFAULT_CAPACITY = 1024;
+
+  EventQueue(const EventQueue&) = delete;
+  EventQueue(EventQueue&&) = delete;
+  EventQueue& operator=(const EventQueue&) = delete;
+  EventQueue& operator=(EventQueue&&) = delete;
+
+  // capacityは2の累乗に切り上げる。
+  explicit EventQueue(size_t capacity = DEFAULT_CAPACITY)
+      : capacity_(round_up(capacity)),
+        mask_(capacity_ - 1),
+        slots_(new T[capacity_]) {}
+
+  // 送受信スレッドが止まっている間に呼ぶ。
+  // 容量を変え、中身と統計を捨てて開き直す。
+  void reset(size_t capacity) {
+    is_closed_ = false;
+    capacity_ = round_up(capacity);
+    mask_ = capacity_ - 1;
+    slots_.reset(new T[capacity_]);
+    head_.store(0, std::memory_order_relaxed);
+    cached_tail_ = 0;
+    tail_.store(0, std::memory_order_relaxed);
+    staged_tail_ = 0;
+    cached_head_ = 0;
+    high_water_mark_.store(0, std::memory_order_relaxed);
+    overflow_count_.store(0, std::memory_order_relaxed);
+  }
+
+  // 送信スレッドから呼ぶ。キューが満杯の場合はfalseを返す。
+  bool push(const T& value) noexcept {
+    if (!stage(value)) return false;
+    commit();
+    return true;
+  }
+
+  // 送信スレッドから呼ぶ。イベントを積むが、commitするまで受信側には見えない。
+  // キューが満杯の場合は溜めたイベントを公開してfalseを返す。
+  bool stage(const T& value) noexcept {
+    if (is_closed_) return false;
+    if (staged_tail_ - cached_head_ >= capacity_) {
+      cached_head_ = head_.load(std::memory_order_acquire);
+      if (staged_tail_ - cached_head_ >= capacity_) {
+        overflow_count_.fetch_add(1, std::memory_order_relaxed);
+        commit();
+        return false;
+      }
+    }
+    slots_[staged_tail_ & mask_] = value;
+    ++staged_tail_;
+    return true;
+  }
+
+  // 送信スレッドから呼ぶ。
+  // 満杯の間は少しずつ眠って空きを待つ。閉じられた場合はfalseを返す。
+  bool wait_writable() noexcept {
+    using namespace std::chrono_literals;
+    while (true) {
+      if (is_closed_) return false;
+      cached_head_ = head_.load(std::memory_order_acquire);
+      if (staged_tail_ - cached_head_ < capacity_) return true;
+      std::this_thread::sleep_for(100us);
+    }
+  }
+
+  // 送信スレッドから呼ぶ。stageしたイベントをまとめて公開する。
+  void commit() noexcept {
+    if (tail_.load(std::memory_order_relaxed) == staged_tail_) return;
+    tail_.store(staged_tail_, std::memory_order_release);
+
+    // 受信スレッドが待機している場合のみ起こす。
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (is_waiting_.load(std::memory_order_relaxed)) wakeup_.notify();
+  }
+
+  // 受信スレッドから呼ぶ。
+  // キューが空の場合、イベントが届くか指定時刻を過ぎるまで待機する。
+  bool pop(const Clock::time_point& timeout_tp, T& value) noexcept {
+    while (true) {
+      if (is_closed_) return false;
+      if (try_pop(value)) return true;
+
+      is_waiting_.store(true, std::memory_order_relaxed);
+      std::atomic_thread_fence(std::memory_order_seq_cst);
+      if (try_pop(value)) {
+        is_waiting_.store(false, std::memory_order_relaxed);
+        return true;
+      }
+      const bool is_notified = is_closed_ || wakeup_.wait_until(timeout_tp);
+      is_waiting_.store(false, std::memory_order_relaxed);
+      ++wakeup_count_;
+      if (!is_notified) return !is_closed_ && try_pop(value);
+    }
+  }
+
+  bool pop(T& value) noexcept { return pop(Clock::time_point::max(), value); }
+
+  // 受信スレッドから呼ぶ。待機せずにイベントを取り出す。
+  bool try_pop(T& value) noexcept {
+    const size_t head = head_.load(std::memory_order_relaxed);
+    if (head == cached_tail_) {
+      cached_tail_ = tail_.load(std::memory_order_acquire);
+      if (head == cached_tail_) return false;
+      update_high_water_mark(cached_tail_ - head);
+    }
+    value = std::move(slots_[head & mask_]);
+    head_.store(head + 1, std::memory_order_release);
+    return true;
+  }
+
+  // 受信スレッドから呼ぶ。待機せずに、届いているイベントを全てfに渡す。
+  // 取り出しの公開はまとめて1回で行い、渡した数を返す。
+  template <typename F>
+  size_t try_pop_all(F&& f) noexcept {
+    const size_t head = head_.load(std::memory_order_relaxed);
+    cached_tail_ = tail_.load(std::memory_order_acquire);
+    update_high_water_mark(cached_tail_ - head);
+    for (size_t i = head; i != cached_tail_; ++i) {
+      f(static_cast<const T&>(slots_[i & mask_]));
+    }
+    head_.store(cached_tail_, std::memory_order_release);
+    return cached_tail_ - head;
+  }
+
+  // 受信スレッドから呼ぶ。
+  // イベントが届くか指定時刻を過ぎるまで待機し、
+  // 届いているイベントを全てfに渡す。
+  template <typename F>
+  size_t pop_all(const Clock::time_point& timeout_tp, F&& f) noexcept {
+    T value;
+    if (!pop(timeout_tp, value)) return 0;
+    f(static_cast<const T&>(value));
+    return 1 + try_pop_all(f);
+  }
+
+  // 受信スレッドから呼ぶ。残っているイベントを破棄する。
+  void clear() noexcept {
+    T value;
+    while (try_pop(value)) {
+    }
+  }
+
+  void close() noexcept {
+    is_closed_ = true;
+    wakeup_.notify();
+  }
+
+  bool is_closed() const noexcept { return is_closed_; }
+
+  size_t capacity() const noexcept { return capacity_; }
+
+  // 受信スレッドが待機から起きた回数
+  size_t wakeup_count() const noexcept { return wakeup_count_; }
+
+  // 受信スレッドが一度に見た滞留数の最大
+  size_t high_water_mark() const noexcept {
+    return high_water_mark_.load(std::memory_order_relaxed);
+  }
+
+  // 満杯で積めなかった回数
+  size_t overflow_count() const noexcept {
+    return overflow_count_.load(std::memory_order_relaxed);
+  }
+
+ private:
+  // 送信側の位置を読み直したときだけ測るので、受信側の負担は増えない。
+  void update_high_water_mark(size_t size) noexcept {
+    if (size > high_water_mark_.load(std::memory_order_relaxed)) {
+      high_water_mark_.store(size, std::memory_order_relaxed);
+    }
+  }
+
+  static size_t round_up(size_t capacity) noexcept {
+    size_t n = 1;
+    while (n < capacity) n <<= 1;
+    return n;
+  }
+
+  size_t capacity_;
+  size_t mask_;
+  std::unique_ptr<T[]> slots_;
+  std::atomic<bool> is_closed_{false};
+  std::atomic<bool> is_waiting_{false};
+  Wakeup wakeup_;
+
+  // 受信スレッドが更新する
+  alignas(64) std::atomic<size_t> head_{0};
+  size_t cached_tail_ = 0;
+  size_t wakeup_count_ = 0;
+  std::atomic<size_t> high_water_mark_{0};
+
+  // 送信スレッドが更新する
+  alignas(64) std::atomic<size_t> tail_{0};
+  size_t staged_tail_ = 0;
+  size_t cached_head_ = 0;
+  std::atomic<size_t> overflow_count_{0};
+};
+}  // namespace fujinami
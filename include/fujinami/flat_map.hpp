@@ -0,0 +1,117 @@
+﻿#pragma once
+
+#include <cstdint>
+#include <functional>
+#include <utility>
+#include <vector>
+
+namespace fujinami {
+// オープンアドレス法(線形探索)によるハッシュマップ
+//
+// 要素をノードではなく連続した配列に置くので、検索がキャッシュに乗りやすい。
+// キーボードレイアウトのように構築後は読むだけの用途を想定しているため、
+// 要素の削除はサポートしない。
+// 再ハッシュで要素が移動するので、要素へのポインタは挿入によって無効になる。
+template <typename Key, typename Value, typename Hash = std::hash<Key>>
+class FlatMap final {
+ public:
+  static constexpr size_t MIN_CAPACITY = 16;
+
+  FlatMap() = default;
+
+  void reserve(size_t size) {
+    size_t capacity = MIN_CAPACITY;
+    while (capacity < size * 2) capacity *= 2;
+    if (capacity > slots_.size()) rehash(capacity);
+  }
+
+  void clear() noexcept {
+    slots_.clear();
+    size_ = 0;
+  }
+
+  size_t size() const noexcept { return size_; }
+
+  bool empty() const noexcept { return size_ == 0; }
+
+  size_t capacity() const noexcept { return slots_.size(); }
+
+  Value* find(const Key& key) noexcept {
+    return const_cast<Value*>(static_cast<const FlatMap&>(*this).find(key));
+  }
+
+  const Value* find(const Key& key) const noexcept {
+    if (slots_.empty()) return nullptr;
+    const size_t tag = tag_of(key);
+    const size_t mask = slots_.size() - 1;
+    for (size_t i = index_of(tag, mask);; i = (i + 1) & mask) {
+      const Slot& slot = slots_[i];
+      if (slot.tag == 0) return nullptr;
+      if (slot.tag == tag && slot.key == key) return &slot.value;
+    }
+  }
+
+  // 要素を挿入する。既に存在する場合は挿入せずにfalseを返す。
+  template <typename... Args>
+  std::pair<Value*, bool> emplace(const Key& key, Args&&... args) {
+    if ((size_ + 1) * 2 > slots_.size()) {
+      rehash(slots_.empty() ? MIN_CAPACITY : slots_.size() * 2);
+    }
+    const size_t tag = tag_of(key);
+    Slot& slot = probe(tag, key);
+    if (slot.tag != 0) return {&slot.value, false};
+    slot.tag = tag;
+    slot.key = key;
+    slot.value = Value(std::forward<Args>(args)...);
+    ++size_;
+    return {&slot.value, true};
+  }
+
+  Value& operator[](const Key& key) { return *emplace(key).first; }
+
+  template <typename F>
+  void for_each(F&& f) const {
+    for (const Slot& slot : slots_) {
+      if (slot.tag != 0) f(slot.key, slot.value);
+    }
+  }
+
+ private:
+  // tagが0のスロットは空いていることを表す。
+  struct Slot final {
+    size_t tag = 0;
+    Key key;
+    Value value;
+  };
+
+  static size_t tag_of(const Key& key) noexcept { return Hash{}(key) | 1; }
+
+  static size_t index_of(size_t tag, size_t mask) noexcept {
+    return (tag >> 1) & mask;
+  }
+
+  Slot& probe(size_t tag, const Key& key) noexcept {
+    const size_t mask = slots_.size() - 1;
+    for (size_t i = index_of(tag, mask);; i = (i + 1) & mask) {
+      Slot& slot = slots_[i];
+      if (slot.tag == 0) return slot;
+      if (slot.tag == tag && slot.key == key) return slot;
+    }
+  }
+
+  void rehash(size_t capacity) {
+    std::vector<Slot> slots(capacity);
+    slots_.swap(slots);
+    for (Slot& slot : slots) {
+      if (slot.tag == 0) continue;
+      Slot& new_slot = probe(slot.tag, slot.key);
+      new_slot.tag = slot.tag;
+      new_slot.key = slot.key;
+      new_slot.value = std::move(slot.value);
+    }
+  }
+
+  std::vector<Slot> slots_;
+  size_t size_ = 0;
+};
+}  // namespace fujinami
@@ -0,0 +1,143 @@
+﻿#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <functional>
+#include <vector>
+#include "flat_map.hpp"
+
+namespace fujinami {
+// 構築後に変更しないハッシュマップ
+//
+// 要素数と同じ大きさの配列に完全ハッシュ(CHD法)で要素を配置するので、
+// 検索は必ず1回の比較で終わる。
+// 要素はバケットごとのシードで決まる位置に置き、シードは構築時に総当たりで探す。
+// 空きの少なくなった終盤に残る要素1つのバケットには、空いた位置を直接割り当てる。
+template <typename Key, typename Value, typename Hash = std::hash<Key>>
+class FrozenMap final {
+ public:
+  // 1つのバケットに入る要素数の平均
+  static constexpr size_t BUCKET_SIZE = 4;
+  // シードを探す回数の上限
+  static constexpr uint32_t MAX_SEED = 1 << 16;
+  // シードの代わりに位置を直接持っていることを表すフラグ
+  static constexpr uint32_t DIRECT_FLAG = uint32_t(1) << 31;
+
+  FrozenMap() = default;
+
+  // 要素を配置し直す。配置できなかった場合はfalseを返す。
+  bool build(const FlatMap<Key, Value, Hash>& map) {
+    clear();
+    if (map.empty()) return true;
+
+    struct Item final {
+      uint64_t hash;
+      const Key* key;
+      const Value* value;
+    };
+    // 除算を避けるため、バケット数は2のべき乗にする。
+    size_t bucket_count = 1;
+    while (bucket_count * BUCKET_SIZE < map.size()) bucket_count *= 2;
+    std::vector<std::vector<Item>> buckets(bucket_count);
+    map.for_each([&](const Key& key, const Value& value) {
+      const uint64_t hash = Hash{}(key);
+      buckets[hash & (bucket_count - 1)].push_back(Item{hash, &key, &value});
+    });
+
+    // 要素の多いバケットから順に、衝突しないシードを探す。
+    std::vector<size_t> order(bucket_count);
+    for (size_t i = 0; i < bucket_count; ++i) order[i] = i;
+    std::stable_sort(order.begin(), order.end(), [&](size_t lhs, size_t rhs) {
+      return buckets[lhs].size() > buckets[rhs].size();
+    });
+
+    const size_t slot_count = map.size();
+    if (slot_count >= DIRECT_FLAG) return false;
+    std::vector<bool> is_used(slot_count);
+    std::vector<size_t> indices;
+    std::vector<uint32_t> seeds(bucket_count);
+    size_t free_index = 0;
+    for (size_t bucket_index : order) {
+      const auto& bucket = buckets[bucket_index];
+      if (bucket.empty()) break;
+      if (bucket.size() == 1) {
+        while (is_used[free_index]) ++free_index;
+        is_used[free_index] = true;
+        seeds[bucket_index] = static_cast<uint32_t>(free_index) | DIRECT_FLAG;
+        continue;
+      }
+      uint32_t seed = 0;
+      for (;; ++seed) {
+        if (seed == MAX_SEED) return false;
+        indices.clear();
+        for (const Item& item : bucket) {
+          const size_t index = index_of(item.hash, seed, slot_count);
+          if (is_used[index] ||
+              std::find(indices.begin(), indices.end(), index) !=
+                  indices.end()) {
+            break;
+          }
+          indices.push_back(index);
+        }
+        if (indices.size() == bucket.size()) break;
+      }
+      seeds[bucket_index] = seed;
+      for (size_t index : indices) is_used[index] = true;
+    }
+
+    std::vector<Slot> slots(slot_count);
+    for (size_t i = 0; i < bucket_count; ++i) {
+      for (const Item& item : buckets[i]) {
+        Slot& slot = slots[slot_index_of(item.hash, seeds[i], slot_count)];
+        slot.key = *item.key;
+        slot.value = *item.value;
+      }
+    }
+    slots_.swap(slots);
+    seeds_.swap(seeds);
+    return true;
+  }
+
+  void clear() noexcept {
+    slots_.clear();
+    seeds_.clear();
+  }
+
+  size_t size() const noexcept { return slots_.size(); }
+
+  bool empty() const noexcept { return slots_.empty(); }
+
+  const Value* find(const Key& key) const noexcept {
+    if (slots_.empty()) return nullptr;
+    const uint64_t hash = Hash{}(key);
+    const uint32_t seed = seeds_[hash & (seeds_.size() - 1)];
+    const Slot& slot = slots_[slot_index_of(hash, seed, slots_.size())];
+    if (!(slot.key == key)) return nullptr;
+    return &slot.value;
+  }
+
+ private:
+  struct Slot final {
+    Key key;
+    Value value;
+  };
+
+  static size_t slot_index_of(uint64_t hash, uint32_t seed,
+                              size_t slot_count) noexcept {
+    if (seed & DIRECT_FLAG) return seed & ~DIRECT_FLAG;
+    return index_of(hash, seed, slot_count);
+  }
+
+  static size_t index_of(uint64_t hash, uint32_t seed,
+                         size_t slot_count) noexcept {
+    uint64_t h = hash + (uint64_t(seed) + 1) * 0x9E3779B97F4A7C15ull;
+    h = (h ^ (h >> 30)) * 0xBF58476D1CE4E5B9ull;
+    h = (h ^ (h >> 27)) * 0x94D049BB133111EBull;
+    // 上位32ビットを乗算で[0, slot_count)に写す。
+    return static_cast<size_t>(((h >> 32) * uint64_t(slot_count)) >> 32);
+  }
+
+  std::vector<Slot> slots_;
+  std::vector<uint32_t> seeds_;
+};
+}  // namespace fujinami
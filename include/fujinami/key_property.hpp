@@ -1,7 +1,10 @@
 ﻿#pragma once
 
+#include <chrono>
+#include <cstdint>
 #include "flagset.hpp"
 #include "logging.hpp"
+#include "time.hpp"
 
 namespace fujinami {
 class KeyPropertyMap;
@@ -16,17 +19,47 @@ enum class FlowType : uint8_t {
 FUJINAMI_LOGGING_ENUM(inline, FlowType,
                       (UNKNOWN)(IMMEDIATE)(DEFERRED)(SIMUL)(DUAL));
 
+// キーやキーセットごとに上書きする待ち時間 (ミリ秒)
+//
+// 属性を小さく保つため16ビットで持ち、NO_TIMEOUTは上書きしないことを表す。
+struct TimeoutOverride final {
+  static constexpr uint16_t NO_TIMEOUT = UINT16_MAX;
+  static constexpr int32_t MAX_TIMEOUT_MS = UINT16_MAX - 1;
+
+  bool has_value() const noexcept { return timeout_ms != NO_TIMEOUT; }
+
+  // 上書きしない場合はdefault_durを返す。
+  Clock::duration value_or(const Clock::duration& default_dur) const noexcept {
+    if (!has_value()) return default_dur;
+    return std::chrono::duration_cast<Clock::duration>(
+        std::chrono::milliseconds(timeout_ms));
+  }
+
+  FUJINAMI_LOGGING_DEFINE_PRINT(friend, TimeoutOverride, value,
+                                (if (value.has_value()) os << value.timeout_ms;
+                                 else os << "none";))
+
+  uint16_t timeout_ms = NO_TIMEOUT;
+};
+
 class KeyProperty final {
  public:
   KeyProperty() = default;
 
-  explicit KeyProperty(FlowType flow_type) noexcept : flow_type_(flow_type) {}
+  explicit KeyProperty(FlowType flow_type,
+                       TimeoutOverride timeout = TimeoutOverride{}) noexcept
+      : flow_type_(flow_type), timeout_(timeout) {}
 
   FlowType flow_type() const noexcept { return flow_type_; }
 
-  FUJINAMI_LOGGING_STRUCT(KeyProperty, (("flow_type", flow_type_)));
+  // このキーから始まるフローの待ち時間
+  const TimeoutOverride& timeout() const noexcept { return timeout_; }
+
+  FUJINAMI_LOGGING_STRUCT(KeyProperty,
+                          (("flow_type", flow_type_))(("timeout", timeout_)));
 
  private:
   FlowType flow_type_ = FlowType::UNKNOWN;
+  TimeoutOverride timeout_;
 };
 }  // namespace fujinami
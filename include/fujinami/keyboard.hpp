@@ -1,18 +1,29 @@
 ﻿#pragma once
 
 #include <atomic>
-#include <condition_variable>
+#include <functional>
 #include <memory>
-#include <mutex>
 #include <stdexcept>
+#include <string>
 #include <thread>
 #include <gsl/gsl>
+#include "config_reclaimer.hpp"
 #include "buffering/context.hpp"
 #include "buffering/engine.hpp"
 #include "mapping/context.hpp"
 #include "mapping/engine.hpp"
+#include "queue_option.hpp"
+#include "realtime.hpp"
 
 namespace fujinami {
+// 各段の繋ぎ方
+enum class KeyboardMode : uint8_t {
+  THREADED,  // 段ごとにスレッドを立て、キューで繋ぐ
+  DRAIN,     // THREADEDと同じだが、溜まったイベントをまとめて処理して送る
+  INLINE,    // send_eventを呼んだスレッドで全段を直接処理する
+};
+FUJINAMI_LOGGING_ENUM(inline, KeyboardMode, (THREADED)(DRAIN)(INLINE));
+
 class Keyboard final {
  public:
   Keyboard(const Keyboard&) = delete;
@@ -24,14 +35,78 @@ class Keyboard final {
 
   ~Keyboard() noexcept;
 
-  bool open();
+  // realtime_optionはBUFFERINGとMAPPINGのスレッドに適用する。
+  // HOOKのスレッドには呼び出し元で、openの後に適用する。
+  // 先に適用すると、立てたスレッドが優先度とCPUを引き継いでしまう。
+  // queue_optionは段を繋ぐキューに適用する。INLINEでは使わない。
+  bool open(KeyboardMode mode = KeyboardMode::THREADED,
+            const RealtimeOption& realtime_option = RealtimeOption{},
+            const QueueOption& queue_option = QueueOption{});
 
   void close() noexcept;
 
+  // send_eventを呼ぶスレッドを起こす関数を渡す。閉じている間に呼ぶ。
+  // 各段のスレッドが、以前の設定を解放できるようになったときと、
+  // 学習結果の写しを渡したときに呼ぶので、受け取ったらupdateを呼ぶ。
+  void set_wakeup(std::function<void()> wakeup) {
+    wakeup_ = std::move(wakeup);
+  }
+
+  // キューが満杯でBUFFERINGのoverflow_policyがPASSTHROUGHの場合はfalseを返す。
+  // 呼び出し元はイベントを素通しに切り替える。
+  // 先読みの窓が溢れた場合は、どのモードでも判定中のフローを確定させて続行する。
   bool send_event(const buffering::AnyEvent& event) noexcept;
 
+  // send_eventで押したまま送り、まだ離していないキーか
+  // 素通しに切り替えた後も、これらのキーを離すイベントはsend_eventで送る。
+  // send_eventと同じスレッドから呼ぶ。
+  bool is_pressed(Key key) const noexcept;
+
+  // 設定を差し替える。send_eventと同じスレッドから呼ぶ。
+  // 以前の設定は、どの段からも参照されなくなったものから解放する。
+  // 各段がまだ参照していれば、wakeupで起こされたupdateで改めて解放する。
+  bool install_config(std::shared_ptr<const KeyboardConfig> config) noexcept;
+
+  // INLINEの場合、タイムアウトを待つ処理を進める。
+  // どのモードでも、参照されなくなった以前の設定を解放し、
+  // 届いた学習結果の写しを保存する。
+  // timeout_tp()を過ぎたときと、wakeupで起こされたときに
+  // send_eventと同じスレッドから呼ぶ。
+  void update() noexcept;
+
+  // 次にupdateを呼ぶべき時刻を返す。INLINEのタイムアウトに限る。
+  Clock::time_point timeout_tp() const noexcept;
+
+  KeyboardMode mode() const noexcept { return mode_; }
+
+  // キューの統計。閉じた後も次に開くまで残る。
+  QueueStats queue_stats(PipelineQueue pipeline_queue) const noexcept;
+
+  // SIMULの判定時間の学習結果を読み書きする。閉じている間に呼ぶ。
+  bool load_simul_timing(const std::string& path);
+
+  bool save_simul_timing(const std::string& path) const;
+
+  // 開いている間に定期的に呼び、学習結果を保存する。
+  // send_eventと同じスレッドから呼ぶ。スレッドを立てている場合は
+  // BUFFERINGのスレッドに写しを頼み、写しが届いた後のupdateで保存する。
+  bool checkpoint_simul_timing(const std::string& path);
+
  private:
+  void run_buffering() noexcept;
+  void run_buffering_drain() noexcept;
+  void run_mapping() noexcept;
+  void drain() noexcept;
+  void collect_configs() noexcept;
+  bool publish_simul_timing() noexcept;
+  void save_timing_snapshot() noexcept;
+  void wakeup() noexcept;
+
   std::atomic<bool> is_closed_{true};
+  KeyboardMode mode_ = KeyboardMode::THREADED;
+  RealtimeOption realtime_option_;
+  ConfigReclaimer config_reclaimer_;
+  std::function<void()> wakeup_;
 
   std::thread b_thread_;
   buffering::Engine b_engine_;
@@ -40,5 +115,14 @@ class Keyboard final {
   std::thread m_thread_;
   mapping::Engine m_engine_;
   mapping::Context m_context_;
+  mapping::BatchContext m_batch_context_;
+  mapping::InlineContext m_inline_context_;
+  Keyset inline_pressed_keyset_;  // INLINEで押したまま送ったキー
+
+  // BUFFERINGのスレッドから受け取る学習結果の写し
+  // 頼まれている間はBUFFERINGのスレッドが書き、それ以外は呼び出し元が読む。
+  std::atomic<bool> is_timing_requested_{false};
+  buffering::SimulTiming timing_snapshot_;
+  std::string timing_path_;  // 写しの保存先 (空の場合は頼んでいない)
 };
 }  // namespace fujinami
@@ -4,12 +4,17 @@
 #include <memory>
 #include <unordered_map>
 #include <vector>
+#include "command.hpp"
 #include "keyboard_layout.hpp"
+#include "queue_option.hpp"
+#include "realtime.hpp"
 #include "time.hpp"
 
 namespace fujinami {
 class KeyboardConfig final {
  public:
+  static constexpr double DEFAULT_SIMUL_ERROR_RATE = 0.05;
+
   bool has_timeout_dur() const noexcept { return has_timeout_dur_; }
 
   const Clock::duration& timeout_dur() const noexcept { return timeout_dur_; }
@@ -32,6 +37,27 @@ class KeyboardConfig final {
 
   bool auto_layout() const noexcept { return auto_layout_; }
 
+  // SIMULのキーを単打したとして先に出力し、同時打鍵になった場合は
+  // undo_commandで取り消すか
+  bool speculative_simul() const noexcept { return speculative_simul_; }
+
+  // 先に出力したコマンドを取り消すときに出力するコマンド
+  const Command& undo_command() const noexcept { return undo_command_; }
+
+  // SIMULの判定時間をキーの組ごとに学習して縮めるか
+  bool adaptive_simul() const noexcept { return adaptive_simul_; }
+
+  // 学習した判定時間で許す、同時打鍵と順次打鍵の取り違えの割合
+  double simul_error_rate() const noexcept { return simul_error_rate_; }
+
+  // 起動時にのみ適用する。
+  const RealtimeOption& realtime_option() const noexcept {
+    return realtime_option_;
+  }
+
+  // 起動時にのみ適用する。
+  const QueueOption& queue_option() const noexcept { return queue_option_; }
+
   void reset() {
     has_timeout_dur_ = false;
     timeout_dur_ = Clock::duration::zero();
@@ -39,6 +65,12 @@ class KeyboardConfig final {
     default_layout_ = nullptr;
     default_im_layout_ = nullptr;
     auto_layout_ = false;
+    speculative_simul_ = false;
+    undo_command_ = Command{};
+    adaptive_simul_ = false;
+    simul_error_rate_ = DEFAULT_SIMUL_ERROR_RATE;
+    realtime_option_ = RealtimeOption{};
+    queue_option_ = QueueOption{};
   }
 
   void set_timeout_dur(const Clock::duration& dur) {
@@ -58,9 +90,37 @@ class KeyboardConfig final {
 
   void set_auto_layout(bool is_enabled) noexcept { auto_layout_ = is_enabled; }
 
+  void set_speculative_simul(bool is_enabled) noexcept {
+    speculative_simul_ = is_enabled;
+  }
+
+  void set_undo_command(Command&& command) {
+    command.render();
+    undo_command_ = std::move(command);
+  }
+
+  void set_adaptive_simul(bool is_enabled, double error_rate) noexcept {
+    adaptive_simul_ = is_enabled;
+    simul_error_rate_ = error_rate;
+  }
+
+  void set_realtime_option(const RealtimeOption& option) noexcept {
+    realtime_option_ = option;
+  }
+
+  void set_queue_option(const QueueOption& option) noexcept {
+    queue_option_ = option;
+  }
+
+  // 読み込みを終えたレイアウトを検索に適した形に変換する。
+  void freeze() {
+    for (auto&& layout : layouts_) layout->freeze();
+  }
+
   std::shared_ptr<KeyboardLayout> create_layout(const std::string& name) {
     FUJINAMI_LOG(debug, "create_layout (name:{})", name);
-    auto sp = std::make_shared<KeyboardLayout>(name);
+    auto sp = std::make_shared<KeyboardLayout>(
+        name, static_cast<uint32_t>(layouts_.size()));
     layouts_.push_back(sp);
     return sp;
   }
@@ -72,5 +132,11 @@ class KeyboardConfig final {
   std::shared_ptr<const KeyboardLayout> default_layout_;
   std::shared_ptr<const KeyboardLayout> default_im_layout_;
   bool auto_layout_ = false;
+  bool speculative_simul_ = false;
+  Command undo_command_;
+  bool adaptive_simul_ = false;
+  double simul_error_rate_ = DEFAULT_SIMUL_ERROR_RATE;
+  RealtimeOption realtime_option_;
+  QueueOption queue_option_;
 };
 }  // namespace fujinami
@@ -1,9 +1,13 @@
 ﻿#pragma once
 
+#include <deque>
 #include <gsl/gsl>
 #include "logging.hpp"
 #include "command.hpp"
+#include "flat_map.hpp"
+#include "frozen_map.hpp"
 #include "key_property.hpp"
+#include "keyset_entry.hpp"
 #include "keyset_property.hpp"
 
 namespace fujinami {
@@ -19,28 +23,34 @@ class KeyboardLayout final {
   using ActiveKeyMask = uint64_t;
   static constexpr size_t MAX_ACTIVE_KEY_COUNT = sizeof(ActiveKeyMask) * 8;
 
-  explicit KeyboardLayout(const std::string& name) : name_(name) {
-    keyset_property_map_.reserve(10240);
-  }
+  // indexはKeyboardConfigの中での番号
+  explicit KeyboardLayout(const std::string& name, uint32_t index = 0)
+      : name_(name), index_(index) {}
 
   ~KeyboardLayout() noexcept {}
 
   void reset() {
     inserted_key_property_bits_.reset();
-    keyset_property_map_.clear();
-    command_map_.clear();
-    next_layout_map_.clear();
+    entry_map_.clear();
+    frozen_entry_map_.clear();
+    is_frozen_ = false;
+    commands_.clear();
+    for (auto&& mapped_keysets : mapped_keysets_) mapped_keysets.clear();
   }
 
-  bool create_flow(Key key, FlowType flow_type) {
+  bool create_flow(Key key, FlowType flow_type,
+                   TimeoutOverride timeout = TimeoutOverride{}) {
+    if (is_frozen_) throw std::logic_error("layout is frozen");
     if (inserted_key_property_bits_[key]) return false;
     inserted_key_property_bits_ += key;
-    key_properties_[static_cast<size_t>(key)] = KeyProperty(flow_type);
+    key_properties_[static_cast<size_t>(key)] = KeyProperty(flow_type, timeout);
     return true;
   }
 
   bool create_mapping(gsl::span<const Key> keys, gsl::span<const KeyRole> roles,
-                      Command&& command) {
+                      Command&& command,
+                      TimeoutOverride timeout = TimeoutOverride{}) {
+    if (is_frozen_) throw std::logic_error("layout is frozen");
     if (keys.size() != roles.size()) {
       throw std::invalid_argument("keys size != roles size");
     }
@@ -66,15 +76,22 @@ class KeyboardLayout final {
     // FUJINAMI_LOG(debug, "new mapping (active_keyset:{}, command:{})",
     // active_keyset, command);
 
-    if (!command_map_.emplace(active_keyset, std::move(command)).second) {
+    // 実行時の処理を減らすため、コマンドの出力を事前に生成しておく。
+    command.render();
+
+    const KeysetEntry* found_entry = entry_map_.find(active_keyset);
+    if (found_entry && found_entry->command()) {
       // FUJINAMI_LOG(info, "mapping already exists (active_keyset:{})",
       // active_keyset);
       return false;
     }
 
-    map(keys);
-    keyset_property_map_[active_keyset].make_mapped(trigger_keyset,
-                                                    modifier_keyset);
+    commands_.push_back(std::move(command));
+    KeysetEntry& entry = entry_map_[active_keyset];
+    entry.set_command(&commands_.back());
+    entry.property().make_mapped(trigger_keyset, modifier_keyset);
+    entry.property().set_timeout(timeout);
+    map(active_keyset);
     return true;
   }
 
@@ -86,67 +103,143 @@ class KeyboardLayout final {
   bool create_transition(
       const Keyset& active_keyset,
       const std::shared_ptr<const KeyboardLayout>& next_layout) {
+    if (is_frozen_) throw std::logic_error("layout is frozen");
     if (!next_layout) return false;
-    return next_layout_map_.emplace(active_keyset, next_layout).second;
+    return entry_map_[active_keyset].set_next_layout(next_layout.get());
+  }
+
+  // 以降変更しないレイアウトを検索に適した形に変換する。
+  //
+  // キーセットのエントリを完全ハッシュで配置し直し、1回の比較で引けるようにする。
+  // 配置できなかった場合は変換前のまま使い続ける。
+  void freeze() {
+    if (is_frozen_) return;
+    if (!frozen_entry_map_.build(entry_map_)) {
+      FUJINAMI_LOG(warn, "failed to freeze layout (name:{})", name_);
+      return;
+    }
+    entry_map_ = FlatMap<Keyset, KeysetEntry>();
+    is_frozen_ = true;
   }
 
+  bool is_frozen() const noexcept { return is_frozen_; }
+
   const KeyProperty* find_key_property(Key key) const noexcept {
     if (!inserted_key_property_bits_[key]) return nullptr;
     return &key_properties_[static_cast<size_t>(key)];
   }
 
-  const KeysetProperty* find_keyset_property(const Keyset& keyset) const
-      noexcept {
-    auto iter = keyset_property_map_.find(keyset);
-    if (iter == keyset_property_map_.end()) return nullptr;
-    return &iter->second;
+  const KeysetEntry* find_keyset_entry(const Keyset& keyset) const noexcept {
+    if (is_frozen_) return frozen_entry_map_.find(keyset);
+    return entry_map_.find(keyset);
+  }
+
+  // キーセットの属性を求める。
+  //
+  // 途中までしか押されていないキーセットはエントリを持たないので、
+  // マッピング済みのキーセットから組み合わせ可能なキーをその場で求める。
+  // どちらにも該当しない場合は登録されていない属性を返す。
+  KeysetProperty find_keyset_property(const Keyset& keyset) const noexcept {
+    return find_keyset_property(keyset, find_keyset_entry(keyset));
+  }
+
+  // find_keyset_entry()で引いたエントリからキーセットの属性を求める。
+  KeysetProperty find_keyset_property(const Keyset& keyset,
+                                      const KeysetEntry* entry) const noexcept {
+    if (entry && entry->property().is_registered()) return entry->property();
+    KeysetProperty property;
+    add_chords(keyset, property);
+    return property;
   }
 
   const Command* find_command(const Keyset& keyset) const noexcept {
-    const auto iter = command_map_.find(keyset);
-    if (iter == command_map_.end()) return nullptr;
-    return &iter->second;
+    const KeysetEntry* entry = find_keyset_entry(keyset);
+    if (!entry) return nullptr;
+    return entry->command();
   }
 
-  std::weak_ptr<const KeyboardLayout> find_next_layout(
-      const Keyset& keyset) const noexcept {
-    const auto iter = next_layout_map_.find(keyset);
-    if (iter == next_layout_map_.end()) return {};
-    return iter->second;
+  const KeyboardLayout* find_next_layout(const Keyset& keyset) const noexcept {
+    const KeysetEntry* entry = find_keyset_entry(keyset);
+    if (!entry) return nullptr;
+    return entry->next_layout();
   }
 
   gsl::czstring name() const noexcept { return name_.c_str(); }
 
+  uint32_t index() const noexcept { return index_; }
+
  private:
   // 組み合わせ可能なキーセットを設定する。
-  void map(gsl::span<const Key> keys) {
-    // nodes
-    const ActiveKeyMask all_mask = (ActiveKeyMask(1) << keys.size()) - 1;
-    for (ActiveKeyMask mask = 1; mask != all_mask; ++mask) {
-      Keyset active_keyset;
-      Keyset combinable_keyset;
-      for (decltype(keys.size()) i = 0; i < keys.size(); ++i) {
-        if (mask & (ActiveKeyMask(1) << i)) {
-          active_keyset += keys[i];
-        } else {
-          combinable_keyset += keys[i];
+  //
+  // 部分集合をすべて登録する代わりに、マッピング済みのキーセットを
+  // キーごとの一覧に登録しておき、包含関係を必要なときに調べる。
+  // マッピング済みのキーセット同士の関係だけはここで求めておく。
+  void map(const Keyset& active_keyset) {
+    KeysetProperty& property = entry_map_.find(active_keyset)->property();
+    add_chords(active_keyset, property);
+    active_keyset.for_each([&](Key key) {
+      for (const Keyset& mapped_keyset : mapped_keysets_of(key)) {
+        if (active_keyset.contains(mapped_keyset)) {
+          entry_map_.find(mapped_keyset)
+              ->property()
+              .add_chord(active_keyset - mapped_keyset, property.timeout());
         }
       }
-      keyset_property_map_[active_keyset].make_node(combinable_keyset);
+    });
+    active_keyset.for_each(
+        [&](Key key) { mapped_keysets_of(key).push_back(active_keyset); });
+  }
+
+  // keysetを真に含むマッピング済みのキーセットを、
+  // 組み合わせ可能なキーと待ち時間としてpropertyに加える。
+  void add_chords(const Keyset& keyset,
+                  KeysetProperty& property) const noexcept {
+    // 一覧が最も短いキーを手掛かりに調べる。
+    const std::vector<Keyset>* candidates = nullptr;
+    keyset.for_each([&](Key key) {
+      const auto& mapped_keysets = mapped_keysets_of(key);
+      if (!candidates || mapped_keysets.size() < candidates->size()) {
+        candidates = &mapped_keysets;
+      }
+    });
+    if (!candidates) return;
+    for (const Keyset& mapped_keyset : *candidates) {
+      if (mapped_keyset != keyset && mapped_keyset.contains(keyset)) {
+        property.add_chord(
+            mapped_keyset - keyset,
+            find_keyset_entry(mapped_keyset)->property().timeout());
+      }
     }
   }
 
+  std::vector<Keyset>& mapped_keysets_of(Key key) noexcept {
+    return mapped_keysets_[static_cast<size_t>(key)];
+  }
+
+  const std::vector<Keyset>& mapped_keysets_of(Key key) const noexcept {
+    return mapped_keysets_[static_cast<size_t>(key)];
+  }
+
   std::string name_;
+  uint32_t index_ = 0;
   Keyset inserted_key_property_bits_;
   std::array<KeyProperty, KEY_COUNT> key_properties_;
-  std::unordered_map<Keyset, KeysetProperty> keyset_property_map_;
-  std::unordered_map<Keyset, Command> command_map_;
-  std::unordered_map<Keyset, std::weak_ptr<const KeyboardLayout>>
-      next_layout_map_;
+  FlatMap<Keyset, KeysetEntry> entry_map_;
+  FrozenMap<Keyset, KeysetEntry> frozen_entry_map_;  // freeze()後に使う
+  bool is_frozen_ = false;
+  std::deque<Command> commands_;  // 要素へのポインタを保つためdequeを使う
+  // キーごとの、そのキーを含むマッピング済みのキーセットの一覧
+  std::array<std::vector<Keyset>, KEY_COUNT> mapped_keysets_;
 };
 
 FUJINAMI_LOGGING_DEFINE_PRINT(inline, std::shared_ptr<const KeyboardLayout>,
                               layout_ptr, (if (layout_ptr) {
                                 os << layout_ptr->name();
                               } else { os << "null"; }));
+
+using KeyboardLayoutPtr = const KeyboardLayout*;
+FUJINAMI_LOGGING_DEFINE_PRINT(inline, KeyboardLayoutPtr, layout_ptr,
+                              (if (layout_ptr) {
+                                os << layout_ptr->name();
+                              } else { os << "null"; }));
 }  // namespace fujinami
@@ -1,61 +1,61 @@
 ﻿#pragma once
 
+#include <array>
 #include <bitset>
+#include <cstdint>
 #include <gsl/gsl>
 #include "key.hpp"
 #include "logging.hpp"
 
 namespace fujinami {
+// 押されたキーの集合
+//
+// ハッシュや比較を安く済ませるため、64ビットのワード単位でビットを保持する。
 class Keyset {
  public:
+  using Word = uint64_t;
+  static constexpr size_t WORD_BITS = sizeof(Word) * 8;
+  static constexpr size_t WORD_COUNT = (KEY_COUNT + WORD_BITS - 1) / WORD_BITS;
+
   Keyset() = default;
 
-  Keyset(Key key) noexcept {
-    if (key != Key::UNKNOWN) {
-      pressed_keys_.set(static_cast<std::underlying_type_t<Key>>(key));
-    }
-  }
+  Keyset(Key key) noexcept { set(key); }
 
   Keyset(gsl::span<const Key> keys) noexcept {
-    for (auto&& key : keys) {
-      if (key != Key::UNKNOWN) {
-        pressed_keys_.set(static_cast<std::underlying_type_t<Key>>(key));
-      }
-    }
+    for (auto&& key : keys) set(key);
   }
 
   Keyset(std::initializer_list<const Key> list) noexcept
       : Keyset(gsl::span<const Key>{list.begin(), list.end()}) {}
 
   bool operator==(const Keyset& other) const noexcept {
-    return pressed_keys_ == other.pressed_keys_;
+    return words_ == other.words_;
   }
 
   bool operator!=(const Keyset& other) const noexcept {
-    return pressed_keys_ != other.pressed_keys_;
+    return words_ != other.words_;
   }
 
   Keyset& operator+=(Key key) noexcept {
-    if (key != Key::UNKNOWN) {
-      pressed_keys_.set(static_cast<std::underlying_type_t<Key>>(key));
-    }
+    set(key);
     return *this;
   }
 
   Keyset& operator+=(const Keyset& other) noexcept {
-    pressed_keys_ |= other.pressed_keys_;
+    for (size_t i = 0; i < WORD_COUNT; ++i) words_[i] |= other.words_[i];
     return *this;
   }
 
   Keyset& operator-=(Key key) noexcept {
     if (key != Key::UNKNOWN) {
-      pressed_keys_.reset(static_cast<std::underlying_type_t<Key>>(key));
+      const size_t index = static_cast<std::underlying_type_t<Key>>(key);
+      words_[index / WORD_BITS] &= ~(Word(1) << (index % WORD_BITS));
     }
     return *this;
   }
 
   Keyset& operator-=(const Keyset& other) noexcept {
-    pressed_keys_ &= ~other.pressed_keys_;
+    for (size_t i = 0; i < WORD_COUNT; ++i) words_[i] &= ~other.words_[i];
     return *this;
   }
 
@@ -73,21 +73,44 @@ class Keyset {
 
   bool operator[](Key key) const noexcept {
     if (key == Key::UNKNOWN) return false;
-    return pressed_keys_.test(static_cast<std::underlying_type_t<Key>>(key));
+    const size_t index = static_cast<std::underlying_type_t<Key>>(key);
+    return test(index);
   }
 
-  explicit operator bool() const noexcept { return pressed_keys_.any(); }
+  explicit operator bool() const noexcept {
+    Word any = 0;
+    for (Word word : words_) any |= word;
+    return any != 0;
+  }
 
   Keyset& reset() noexcept {
-    pressed_keys_.reset();
+    words_.fill(0);
     return *this;
   }
 
   bool contains(const Keyset& keyset) const noexcept {
-    return (pressed_keys_ & keyset.pressed_keys_) == keyset.pressed_keys_;
+    for (size_t i = 0; i < WORD_COUNT; ++i) {
+      if ((words_[i] & keyset.words_[i]) != keyset.words_[i]) return false;
+    }
+    return true;
+  }
+
+  size_t count() const noexcept {
+    size_t count = 0;
+    for (Word word : words_) count += std::bitset<WORD_BITS>(word).count();
+    return count;
   }
 
-  size_t count() const noexcept { return pressed_keys_.count(); }
+  // 含まれるキーを順に列挙する。
+  template <typename F>
+  void for_each(F&& f) const {
+    for (size_t i = 0; i < WORD_COUNT; ++i) {
+      size_t index = i * WORD_BITS;
+      for (Word word = words_[i]; word; word >>= 1, ++index) {
+        if (word & 1) f(static_cast<Key>(index));
+      }
+    }
+  }
 
   friend Keyset operator+(Key key, const Keyset& keyset) noexcept {
     return keyset + key;
@@ -97,22 +120,42 @@ class Keyset {
     return keyset - key;
   }
 
+  // ワードを畳み込んでから乗算で攪拌する。
+  //
+  // 同時に押されるキーはほとんどの場合1ワードに収まるため、
+  // バイト単位でハッシュを取るよりずっと安い。
   friend size_t hash_value(const Keyset& keyset) noexcept {
-    return std::hash<decltype(keyset.pressed_keys_)>{}(keyset.pressed_keys_);
+    uint64_t h = 0;
+    for (size_t i = 0; i < WORD_COUNT; ++i) {
+      h = (h ^ keyset.words_[i]) * 0x9E3779B97F4A7C15ull;
+      h ^= h >> 29;
+    }
+    return static_cast<size_t>(h ^ (h >> 32));
   }
 
   FUJINAMI_LOGGING_DEFINE_PRINT(friend, Keyset, keyset, ({
                                   logging::Separator sep;
                                   os << '[';
                                   for (size_t i = 0; i < KEY_COUNT; ++i) {
-                                    if (keyset.pressed_keys_[i])
+                                    if (keyset.test(i))
                                       os << sep << static_cast<Key>(i);
                                   }
                                   os << ']';
                                 }));
 
  private:
-  std::bitset<KEY_COUNT> pressed_keys_;
+  void set(Key key) noexcept {
+    if (key != Key::UNKNOWN) {
+      const size_t index = static_cast<std::underlying_type_t<Key>>(key);
+      words_[index / WORD_BITS] |= Word(1) << (index % WORD_BITS);
+    }
+  }
+
+  bool test(size_t index) const noexcept {
+    return (words_[index / WORD_BITS] >> (index % WORD_BITS)) & 1;
+  }
+
+  std::array<Word, WORD_COUNT> words_ = {};
 };
 }  // namespace fujinami
 
@@ -0,0 +1,41 @@
+﻿#pragma once
+
+#include "command.hpp"
+#include "keyset_property.hpp"
+
+namespace fujinami {
+class KeyboardLayout;
+
+// キーセットに紐づく情報をまとめたもの
+//
+// 1回の検索でキーセットの属性、コマンド、遷移先のレイアウトを引けるようにする。
+class KeysetEntry final {
+ public:
+  const KeysetProperty& property() const noexcept { return property_; }
+
+  KeysetProperty& property() noexcept { return property_; }
+
+  const Command* command() const noexcept { return command_; }
+
+  // 遷移先のレイアウト (遷移しない場合はnullptr)
+  const KeyboardLayout* next_layout() const noexcept { return next_layout_; }
+
+  bool set_command(const Command* command) noexcept {
+    if (command_) return false;
+    command_ = command;
+    return true;
+  }
+
+  bool set_next_layout(const KeyboardLayout* next_layout) noexcept {
+    if (next_layout_) return false;
+    next_layout_ = next_layout;
+    return true;
+  }
+
+ private:
+  KeysetProperty property_;
+  const Command* command_ = nullptr;  // コマンドの実体はレイアウトが持つ
+  // レイアウトは同じKeyboardConfigが持つので、寿命は設定に従う。
+  const KeyboardLayout* next_layout_ = nullptr;
+};
+}  // namespace fujinami
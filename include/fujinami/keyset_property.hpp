@@ -1,12 +1,16 @@
 ﻿#pragma once
 
 #include "flagset.hpp"
+#include "key_property.hpp"
 #include "keyset.hpp"
 #include "logging.hpp"
 
 namespace fujinami {
 class KeysetProperty final {
  public:
+  // マッピングか組み合わせ可能なキーが存在する
+  bool is_registered() const noexcept { return flags_; }
+
   bool is_mapped() const noexcept { return flags_ & Flag::MAPPED; }
 
   bool is_node() const noexcept { return flags_ & Flag::NODE; }
@@ -23,11 +27,37 @@ class KeysetProperty final {
 
   const Keyset& modifier_keyset() const noexcept { return modifier_keyset_; }
 
+  // このキーセットを同時押しとして待つときの待ち時間 (マッピング済みの場合のみ)
+  const TimeoutOverride& timeout() const noexcept { return timeout_; }
+
+  void set_timeout(TimeoutOverride timeout) noexcept { timeout_ = timeout; }
+
+  // このキーセットから先を待つときの待ち時間
+  //
+  // 組み合わせうるキーセットの待ち時間のうち最も長いもの。
+  // いずれかが上書きしない場合は上書きしない。
+  const TimeoutOverride& chord_timeout() const noexcept {
+    return chord_timeout_;
+  }
+
   void make_node(const Keyset& combinable_keyset) noexcept {
     combinable_keyset_ += combinable_keyset;
     flags_.set(Flag::NODE, !!combinable_keyset_);
   }
 
+  // 組み合わせうるキーセットを1つ加える。
+  void add_chord(const Keyset& combinable_keyset,
+                 TimeoutOverride timeout) noexcept {
+    if (!is_node()) {
+      chord_timeout_ = timeout;
+    } else if (!chord_timeout_.has_value() || !timeout.has_value()) {
+      chord_timeout_ = TimeoutOverride{};
+    } else if (chord_timeout_.timeout_ms < timeout.timeout_ms) {
+      chord_timeout_ = timeout;
+    }
+    make_node(combinable_keyset);
+  }
+
   void make_mapped(const Keyset& trigger_keyset,
                    const Keyset& modifier_keyset) noexcept {
     flags_ += Flag::MAPPED;
@@ -38,8 +68,9 @@ class KeysetProperty final {
   FUJINAMI_LOGGING_STRUCT(
       KeysetProperty,
       (("flags", flags_))(("combinable_keyset", combinable_keyset_))(
-          ("trigger_keyset", trigger_keyset_))(("modifier_keyset",
-                                                modifier_keyset_)));
+          ("trigger_keyset", trigger_keyset_))(
+          ("modifier_keyset", modifier_keyset_))(("timeout", timeout_))(
+          ("chord_timeout", chord_timeout_)));
 
  private:
   enum class Flag : uint8_t {
@@ -54,5 +85,7 @@ class KeysetProperty final {
   Keyset combinable_keyset_;  // 組み合わせ可能なキーのセット
   Keyset trigger_keyset_;     // トリガーキーのセット
   Keyset modifier_keyset_;    // 修飾キーのセット
+  TimeoutOverride timeout_;
+  TimeoutOverride chord_timeout_;
 };
 }  // namespace fujinami
@@ -1,76 +1,152 @@
 ﻿#pragma once
 
 #include <atomic>
-#include <condition_variable>
-#include <deque>
-#include <mutex>
 #include <fujinami/logging.hpp>
+#include <fujinami/event_queue.hpp>
+#include <fujinami/queue_option.hpp>
 #include "event.hpp"
 #include "engine.hpp"
 
 namespace fujinami {
 namespace mapping {
-class Context final {
+// 各Contextに共通する送信の手続き
+//
+// Derivedはsend_eventを持つ。
+template <typename Derived>
+class BasicContext {
  public:
-  Context(Engine& engine) {}
+  // commandは直前にsend_configした設定のものでなければならない。
+  bool send_press(const Command* command) noexcept {
+    return derived().send_event(KeyPressEvent(command));
+  }
 
-  bool send_event(const AnyEvent& event) noexcept {
-    if (is_closed_) return false;
-    std::lock_guard<std::mutex> lck(queue_mtx_);
-    event_queue_.push_back(event);
-    queue_cv_.notify_one();
-    return true;
+  bool send_repeat(const Command* command) noexcept {
+    return derived().send_event(KeyRepeatEvent(command));
   }
 
-  bool send_press(const Keyset& active_keyset,
-                  std::shared_ptr<const KeyboardLayout> next_layout) noexcept {
-    return send_event(KeyPressEvent(active_keyset)) &&
-           send_event(LayoutEvent(std::move(next_layout)));
+  bool send_release() noexcept {
+    return derived().send_event(KeyReleaseEvent());
   }
 
-  bool send_repeat(const Keyset& active_keyset) noexcept {
-    return send_event(KeyRepeatEvent(active_keyset));
+  bool send_retract(uint32_t unit_count) noexcept {
+    return derived().send_event(RetractEvent(unit_count));
   }
 
-  bool send_release(const Keyset& active_keyset) noexcept {
-    return send_event(KeyReleaseEvent(active_keyset));
+  bool send_config(const KeyboardConfig* config, uint64_t epoch) noexcept {
+    return derived().send_event(ConfigEvent(config, epoch));
   }
 
-  bool send_layout(std::shared_ptr<const KeyboardLayout> layout) noexcept {
-    return send_event(LayoutEvent(std::move(layout)));
+ private:
+  Derived& derived() noexcept { return static_cast<Derived&>(*this); }
+};
+
+// 後段のEngineへキューを介してイベントを送るContext
+//
+// Engineは別のスレッドでreceive_eventしたイベントを処理する。
+class Context final : public BasicContext<Context> {
+ public:
+  Context() = default;
+
+  Context(Engine& engine) {}
+
+  // 送受信スレッドが止まっている間に呼ぶ。PASSTHROUGHはBLOCKとして扱う。
+  void set_option(const QueueOption::Queue& option) {
+    event_queue_.reset(option.capacity);
+    overflow_policy_ = option.overflow_policy;
+    drop_count_.store(0, std::memory_order_relaxed);
   }
 
-  bool receive_event(AnyEvent& event) noexcept {
-    if (is_closed_) return false;
-    std::unique_lock<std::mutex> lck(queue_mtx_);
-    if (event_queue_.empty()) {
-      queue_cv_.wait(
-          lck, [&]() noexcept { return is_closed_ || !event_queue_.empty(); });
-      if (is_closed_ || event_queue_.empty()) return false;
+  // キューが満杯の場合はoverflow_policyに従う。閉じられた場合はfalseを返す。
+  bool send_event(const AnyEvent& event) noexcept {
+    if (!stage_event(event)) return false;
+    flush();
+    return true;
+  }
+
+  // flushするまで後段には見えない。
+  bool stage_event(const AnyEvent& event) noexcept {
+    while (!event_queue_.stage(event)) {
+      // キーリピートは次のリピートかリリースで置き換わるので捨ててよい。
+      if (overflow_policy_ == OverflowPolicy::DROP_REPEAT &&
+          event.type() == EventType::KEY_REPEAT) {
+        drop_count_.fetch_add(1, std::memory_order_relaxed);
+        return true;
+      }
+      if (!event_queue_.wait_writable()) return false;
     }
-    event = std::move(event_queue_.front());
-    event_queue_.pop_front();
     return true;
   }
 
-  void reset() noexcept {
-    std::lock_guard<std::mutex> lck(queue_mtx_);
-    event_queue_.clear();
+  // stage_eventしたイベントをまとめて後段へ公開する。
+  void flush() noexcept { event_queue_.commit(); }
+
+  bool receive_event(AnyEvent& event) noexcept {
+    return event_queue_.pop(event);
+  }
+
+  bool try_receive_event(AnyEvent& event) noexcept {
+    return event_queue_.try_pop(event);
+  }
+
+  void reset() noexcept { event_queue_.clear(); }
+
+  void close() noexcept { event_queue_.close(); }
+
+  bool is_closed() const noexcept { return event_queue_.is_closed(); }
+
+  size_t wakeup_count() const noexcept { return event_queue_.wakeup_count(); }
+
+  QueueStats stats() const noexcept {
+    QueueStats stats;
+    stats.capacity = event_queue_.capacity();
+    stats.high_water_mark = event_queue_.high_water_mark();
+    stats.overflow_count = event_queue_.overflow_count();
+    stats.drop_count = drop_count_.load(std::memory_order_relaxed);
+    return stats;
   }
 
-  void close() noexcept {
-    is_closed_ = true;
-    std::lock_guard<std::mutex> lck(queue_mtx_);
-    queue_cv_.notify_one();
+ private:
+  EventQueue<AnyEvent> event_queue_;
+  OverflowPolicy overflow_policy_ = OverflowPolicy::BLOCK;
+  std::atomic<size_t> drop_count_{0};
+};
+
+// 送ったイベントを溜めておき、flushでまとめて後段へ公開するContext
+//
+// 後段の起床はflushごとに高々1回になる。
+// 前段は待機する前にflushしなければならない。
+class BatchContext final : public BasicContext<BatchContext> {
+ public:
+  explicit BatchContext(Context& context) noexcept : context_(context) {}
+
+  bool send_event(const AnyEvent& event) noexcept {
+    return context_.stage_event(event);
   }
 
-  bool is_closed() const noexcept { return is_closed_; }
+  void flush() noexcept { context_.flush(); }
 
  private:
-  std::atomic<bool> is_closed_{false};
-  std::deque<AnyEvent> event_queue_;
-  std::mutex queue_mtx_;
-  std::condition_variable queue_cv_;
+  Context& context_;
 };
+
+// 後段のEngineを呼び出し元のスレッドで直接更新するContext
+//
+// キューを経由しないため、前段と後段は同じスレッドで動かなければならない。
+template <typename NextEngine>
+class BasicInlineContext final
+    : public BasicContext<BasicInlineContext<NextEngine>> {
+ public:
+  BasicInlineContext(NextEngine& engine) noexcept : engine_(engine) {}
+
+  bool send_event(const AnyEvent& event) noexcept {
+    engine_.update(event);
+    return true;
+  }
+
+ private:
+  NextEngine& engine_;
+};
+
+using InlineContext = BasicInlineContext<Engine>;
 }  // namespace mapping
 }  // namespace fujinami
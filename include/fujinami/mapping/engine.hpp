@@ -4,7 +4,9 @@
 #include <fujinami/command.hpp>
 #include <fujinami/keyboard_config.hpp>
 #include <fujinami/keyboard_layout.hpp>
+#include <fujinami/output.hpp>
 #include "event.hpp"
+#include "transition_cache.hpp"
 
 namespace fujinami {
 namespace mapping {
@@ -23,14 +25,22 @@ class Engine final {
 
   void reset() noexcept;
 
+  // 使っている設定のエポック (ConfigReclaimerへ公開する)
+  uint64_t epoch() const noexcept { return epoch_; }
+
  private:
   void update(const KeyPressEvent& event) noexcept;
   void update(const KeyRepeatEvent& event) noexcept;
   void update(const KeyReleaseEvent& event) noexcept;
-  void update(const LayoutEvent& event) noexcept;
+  void update(const RetractEvent& event) noexcept;
+  void update(const ConfigEvent& event) noexcept;
 
-  std::shared_ptr<const KeyboardLayout> layout_;
+  // イベントが指すコマンドと設定の寿命はConfigReclaimerが保つ。
+  uint64_t epoch_ = 0;
+  const KeyboardConfig* config_ = nullptr;
   const Command* prev_command_ = nullptr;
+  Output output_{Output::INITIAL_CAPACITY};
+  TransitionCache transition_cache_;
 };
 }  // namespace mapping
 }  // namespace fujinami
@@ -1,8 +1,10 @@
 ﻿#pragma once
 
 #include <cstdint>
+#include <type_traits>
 #include <fujinami/logging.hpp>
-#include <fujinami/keyset.hpp>
+#include <fujinami/command.hpp>
+#include <fujinami/keyboard_config.hpp>
 
 namespace fujinami {
 namespace mapping {
@@ -11,189 +13,121 @@ enum class EventType : uint8_t {
   KEY_PRESS,
   KEY_REPEAT,
   KEY_RELEASE,
-  LAYOUT,
+  RETRACT,
+  CONFIG,
 };
 FUJINAMI_LOGGING_ENUM(inline, EventType,
-                      (NONE)(KEY_PRESS)(KEY_REPEAT)(KEY_RELEASE)(LAYOUT));
-
-class KeyPressEvent {
+                      (NONE)(KEY_PRESS)(KEY_REPEAT)(KEY_RELEASE)(RETRACT)(
+                          CONFIG));
+
+// キーを押したイベント
+//
+// 前段で解決したコマンドを持つ。レイアウトの遷移も前段で済ませるので、
+// 後段はコマンドだけを出力する。
+// コマンドは直前にCONFIGで渡した設定のものでなければならない。
+class KeyPressEvent final {
  public:
   KeyPressEvent() = default;
 
-  explicit KeyPressEvent(const Keyset& active_keyset) noexcept
-      : active_keyset_(active_keyset) {}
+  explicit KeyPressEvent(const Command* command) noexcept
+      : command_(command) {}
+
+  // 割り当てのない場合はnullptr
+  const Command* command() const noexcept { return command_; }
 
-  const Keyset& active_keyset() const noexcept { return active_keyset_; }
+  uint32_t command_id() const noexcept { return command_ ? command_->id() : 0; }
 
-  FUJINAMI_LOGGING_STRUCT(KeyPressEvent, (("active_keyset", active_keyset_)));
+  FUJINAMI_LOGGING_STRUCT(KeyPressEvent, (("command_id", command_id())));
 
  private:
-  Keyset active_keyset_;
+  const Command* command_ = nullptr;
 };
 
-class KeyRepeatEvent {
+class KeyRepeatEvent final {
  public:
   KeyRepeatEvent() = default;
 
-  explicit KeyRepeatEvent(const Keyset& active_keyset) noexcept
-      : active_keyset_(active_keyset) {}
+  explicit KeyRepeatEvent(const Command* command) noexcept
+      : command_(command) {}
 
-  const Keyset& active_keyset() const noexcept { return active_keyset_; }
+  // 割り当てのない場合はnullptr
+  const Command* command() const noexcept { return command_; }
 
-  FUJINAMI_LOGGING_STRUCT(KeyRepeatEvent, (("active_keyset", active_keyset_)));
+  uint32_t command_id() const noexcept { return command_ ? command_->id() : 0; }
+
+  FUJINAMI_LOGGING_STRUCT(KeyRepeatEvent, (("command_id", command_id())));
 
  private:
-  Keyset active_keyset_;
+  const Command* command_ = nullptr;
+};
+
+// 直前に押したコマンドを離すイベント
+class KeyReleaseEvent final {
+ public:
+  FUJINAMI_LOGGING_DEFINE_PRINT(friend, KeyReleaseEvent, value, (os << "{}";))
 };
 
-class KeyReleaseEvent {
+// 先行して押したコマンドの出力を取り消すイベント
+//
+// 直前に押したコマンドを離し、取り消す単位の数だけ設定の取り消し列を出力する。
+class RetractEvent final {
  public:
-  KeyReleaseEvent() = default;
+  RetractEvent() = default;
 
-  explicit KeyReleaseEvent(const Keyset& active_keyset) noexcept
-      : active_keyset_(active_keyset) {}
+  explicit RetractEvent(uint32_t unit_count) noexcept
+      : unit_count_(unit_count) {}
 
-  const Keyset& active_keyset() const noexcept { return active_keyset_; }
+  uint32_t unit_count() const noexcept { return unit_count_; }
 
-  FUJINAMI_LOGGING_STRUCT(KeyReleaseEvent, (("active_keyset", active_keyset_)));
+  FUJINAMI_LOGGING_STRUCT(RetractEvent, (("unit_count", unit_count_)));
 
  private:
-  Keyset active_keyset_;
+  uint32_t unit_count_ = 0;
 };
 
-class LayoutEvent final {
+// 設定を差し替えるイベント
+//
+// 設定の寿命はConfigReclaimerが保ち、epochは前段が受け取ったものを引き継ぐ。
+class ConfigEvent final {
  public:
-  LayoutEvent() = default;
+  ConfigEvent() = default;
 
-  explicit LayoutEvent(std::shared_ptr<const KeyboardLayout> layout) noexcept
-      : layout_(layout) {}
+  ConfigEvent(const KeyboardConfig* config, uint64_t epoch) noexcept
+      : config_(config), epoch_(epoch) {}
 
-  const std::shared_ptr<const KeyboardLayout>& layout() const noexcept {
-    return layout_;
-  }
+  const KeyboardConfig* config() const noexcept { return config_; }
 
-  FUJINAMI_LOGGING_STRUCT(LayoutEvent, (("layout", layout_)));
+  uint64_t epoch() const noexcept { return epoch_; }
+
+  FUJINAMI_LOGGING_STRUCT(ConfigEvent,
+                          (("config", config_))(("epoch", epoch_)));
 
  private:
-  std::shared_ptr<const KeyboardLayout> layout_;
+  const KeyboardConfig* config_ = nullptr;
+  uint64_t epoch_ = 0;
 };
 
+// 後段へ送るイベント
+//
+// 自明にコピーできるので、キューはmemcpyで受け渡せる。
 class AnyEvent final {
  public:
-  static constexpr bool is_nothrow_copy_constructible =
-      std::is_nothrow_copy_constructible<KeyPressEvent>::value &&
-      std::is_nothrow_copy_constructible<KeyRepeatEvent>::value &&
-      std::is_nothrow_copy_constructible<KeyReleaseEvent>::value &&
-      std::is_nothrow_copy_constructible<LayoutEvent>::value;
-  static constexpr bool is_nothrow_copy_assignable =
-      is_nothrow_copy_constructible &&
-      std::is_nothrow_copy_assignable<KeyPressEvent>::value &&
-      std::is_nothrow_copy_assignable<KeyRepeatEvent>::value &&
-      std::is_nothrow_copy_assignable<KeyReleaseEvent>::value &&
-      std::is_nothrow_copy_assignable<LayoutEvent>::value;
-
-  AnyEvent() noexcept : type_(EventType::NONE) {}
-
-  AnyEvent(const AnyEvent& other) noexcept(is_nothrow_copy_constructible) {
-    construct(other);
-  }
-
-  AnyEvent(AnyEvent&& other) noexcept { construct(std::move(other)); }
-
-  AnyEvent(const KeyPressEvent& other) noexcept(
-      std::is_nothrow_copy_constructible<KeyPressEvent>::value) {
-    new (&key_press_) KeyPressEvent(other);
-    type_ = EventType::KEY_PRESS;
-  }
-
-  AnyEvent(KeyPressEvent&& other) noexcept {
-    new (&key_press_) KeyPressEvent(std::move(other));
-    type_ = EventType::KEY_PRESS;
-  }
-
-  AnyEvent(const KeyRepeatEvent& other) noexcept(
-      std::is_nothrow_copy_constructible<KeyRepeatEvent>::value) {
-    new (&key_repeat_) KeyRepeatEvent(other);
-    type_ = EventType::KEY_REPEAT;
-  }
-
-  AnyEvent(KeyRepeatEvent&& other) noexcept {
-    new (&key_repeat_) KeyRepeatEvent(std::move(other));
-    type_ = EventType::KEY_REPEAT;
-  }
-
-  AnyEvent(const KeyReleaseEvent& other) noexcept(
-      std::is_nothrow_copy_constructible<KeyReleaseEvent>::value) {
-    new (&key_release_) KeyReleaseEvent(other);
-    type_ = EventType::KEY_RELEASE;
-  }
-
-  AnyEvent(KeyReleaseEvent&& other) noexcept {
-    new (&key_release_) KeyReleaseEvent(std::move(other));
-    type_ = EventType::KEY_RELEASE;
-  }
-
-  AnyEvent(const LayoutEvent& other) noexcept(
-      std::is_nothrow_copy_constructible<LayoutEvent>::value) {
-    new (&layout_) LayoutEvent(other);
-    type_ = EventType::LAYOUT;
-  }
-  AnyEvent(LayoutEvent&& other) noexcept(
-      std::is_nothrow_copy_constructible<LayoutEvent>::value) {
-    new (&layout_) LayoutEvent(std::move(other));
-    type_ = EventType::LAYOUT;
-  }
-
-  ~AnyEvent() noexcept { destruct(); }
-
-  AnyEvent& operator=(const AnyEvent& other) noexcept(
-      is_nothrow_copy_assignable) {
-    if (type_ == other.type_) {
-      switch (type_) {
-        case EventType::KEY_PRESS:
-          key_press_ = other.key_press_;
-          break;
-        case EventType::KEY_REPEAT:
-          key_repeat_ = other.key_repeat_;
-          break;
-        case EventType::KEY_RELEASE:
-          key_release_ = other.key_release_;
-          break;
-        case EventType::LAYOUT:
-          layout_ = other.layout_;
-          break;
-      }
-    } else {
-      destruct();
-      type_ = EventType::NONE;
-      construct(other);
-    }
-    return *this;
-  }
-
-  AnyEvent& operator=(AnyEvent&& other) noexcept {
-    if (type_ == other.type_) {
-      switch (type_) {
-        case EventType::KEY_PRESS:
-          key_press_ = std::move(other.key_press_);
-          break;
-        case EventType::KEY_REPEAT:
-          key_repeat_ = std::move(other.key_repeat_);
-          break;
-        case EventType::KEY_RELEASE:
-          key_release_ = std::move(other.key_release_);
-          break;
-        case EventType::LAYOUT:
-          layout_ = std::move(other.layout_);
-          break;
-      }
-    } else {
-      destruct();
-      type_ = EventType::NONE;
-      construct(std::move(other));
-    }
-    return *this;
-  }
+  AnyEvent() noexcept : type_(EventType::NONE), key_release_() {}
+
+  AnyEvent(const KeyPressEvent& other) noexcept
+      : type_(EventType::KEY_PRESS), key_press_(other) {}
+
+  AnyEvent(const KeyRepeatEvent& other) noexcept
+      : type_(EventType::KEY_REPEAT), key_repeat_(other) {}
+
+  AnyEvent(const KeyReleaseEvent& other) noexcept
+      : type_(EventType::KEY_RELEASE), key_release_(other) {}
+
+  AnyEvent(const RetractEvent& other) noexcept
+      : type_(EventType::RETRACT), retract_(other) {}
+
+  AnyEvent(const ConfigEvent& other) noexcept
+      : type_(EventType::CONFIG), config_(other) {}
 
   EventType type() const noexcept { return type_; }
 
@@ -203,72 +137,23 @@ class AnyEvent final {
   FUJINAMI_LOGGING_UNION(AnyEvent, EventType,
                          ((KEY_PRESS, "key_press", key_press_))(
                              (KEY_REPEAT, "key_repeat", key_repeat_))(
-                             (KEY_RELEASE, "key_release",
-                              key_release_))((LAYOUT, "layout", layout_)));
+                             (KEY_RELEASE, "key_release", key_release_))(
+                             (RETRACT, "retract", retract_))(
+                             (CONFIG, "config", config_)));
 
  private:
-  void construct(const AnyEvent& other) noexcept(
-      is_nothrow_copy_constructible) {
-    switch (other.type_) {
-      case EventType::KEY_PRESS:
-        new (&key_press_) KeyPressEvent(other.key_press_);
-        break;
-      case EventType::KEY_REPEAT:
-        new (&key_repeat_) KeyRepeatEvent(other.key_repeat_);
-        break;
-      case EventType::KEY_RELEASE:
-        new (&key_release_) KeyReleaseEvent(other.key_release_);
-        break;
-      case EventType::LAYOUT:
-        new (&layout_) LayoutEvent(other.layout_);
-        break;
-    }
-    type_ = other.type_;
-  }
-
-  void construct(AnyEvent&& other) noexcept {
-    switch (other.type_) {
-      case EventType::KEY_PRESS:
-        new (&key_press_) KeyPressEvent(std::move(other.key_press_));
-        break;
-      case EventType::KEY_REPEAT:
-        new (&key_repeat_) KeyRepeatEvent(std::move(other.key_repeat_));
-        break;
-      case EventType::KEY_RELEASE:
-        new (&key_release_) KeyReleaseEvent(std::move(other.key_release_));
-        break;
-      case EventType::LAYOUT:
-        new (&layout_) LayoutEvent(std::move(other.layout_));
-        break;
-    }
-    type_ = other.type_;
-  }
-
-  void destruct() noexcept {
-    switch (type_) {
-      case EventType::KEY_PRESS:
-        key_press_.~KeyPressEvent();
-        break;
-      case EventType::KEY_REPEAT:
-        key_repeat_.~KeyRepeatEvent();
-        break;
-      case EventType::KEY_RELEASE:
-        key_release_.~KeyReleaseEvent();
-        break;
-      case EventType::LAYOUT:
-        layout_.~LayoutEvent();
-        break;
-    }
-  }
-
-  EventType type_ = EventType::NONE;
+  EventType type_;
   union {
     KeyPressEvent key_press_;
     KeyRepeatEvent key_repeat_;
     KeyReleaseEvent key_release_;
-    LayoutEvent layout_;
+    RetractEvent retract_;
+    ConfigEvent config_;
   };
 };
+static_assert(std::is_trivially_copyable<AnyEvent>::value,
+              "mapping::AnyEvent must be trivially copyable");
+
 template <>
 inline const KeyPressEvent& AnyEvent::as() const noexcept {
   return key_press_;
@@ -285,8 +170,13 @@ inline const KeyReleaseEvent& AnyEvent::as() const noexcept {
 }
 
 template <>
-inline const LayoutEvent& AnyEvent::as() const noexcept {
-  return layout_;
+inline const RetractEvent& AnyEvent::as() const noexcept {
+  return retract_;
+}
+
+template <>
+inline const ConfigEvent& AnyEvent::as() const noexcept {
+  return config_;
 }
 }  // namespace mapping
 }  // namespace fujinami
@@ -0,0 +1,81 @@
+﻿#pragma once
+
+#include <array>
+#include <cstdint>
+#include <fujinami/command.hpp>
+#include <fujinami/output.hpp>
+
+namespace fujinami {
+namespace mapping {
+// コマンド間の遷移で生じる出力をキャッシュする
+//
+// 直前のコマンドと次のコマンドのIDの組をキーとするダイレクトマップ方式で、
+// 衝突した場合は古い遷移を上書きする。
+class TransitionCache final {
+ public:
+  static constexpr size_t SLOT_COUNT = 256;
+
+  void press(const Command* prev, const Command& next,
+             Output& output) noexcept {
+    if (!prev || !prev->is_rendered() || !next.is_rendered()) {
+      next.press(prev, output);
+      return;
+    }
+    output.append(find(*prev, next, Kind::PRESS));
+  }
+
+  void repeat(const Command* prev, const Command& next,
+              Output& output) noexcept {
+    if (!prev || !prev->is_rendered() || !next.is_rendered()) {
+      next.repeat(prev, output);
+      return;
+    }
+    output.append(find(*prev, next, Kind::REPEAT));
+  }
+
+  void reset() noexcept {
+    for (Slot& slot : slots_) {
+      slot.prev_id = 0;
+      slot.next_id = 0;
+      slot.output.clear();
+    }
+  }
+
+ private:
+  enum class Kind : uint8_t {
+    PRESS,
+    REPEAT,
+  };
+
+  struct Slot final {
+    uint32_t prev_id = 0;
+    uint32_t next_id = 0;
+    Kind kind = Kind::PRESS;
+    Output output;
+  };
+
+  const Output& find(const Command& prev, const Command& next,
+                     Kind kind) noexcept {
+    const uint64_t key = (uint64_t(prev.id()) << 32 | next.id()) * 2 +
+                         static_cast<uint64_t>(kind);
+    Slot& slot = slots_[(key * 0x9E3779B97F4A7C15ull) >> 56];
+    if (slot.prev_id != prev.id() || slot.next_id != next.id() ||
+        slot.kind != kind) {
+      slot.prev_id = prev.id();
+      slot.next_id = next.id();
+      slot.kind = kind;
+      slot.output.clear();
+      if (kind == Kind::PRESS) {
+        next.press(&prev, slot.output);
+      } else {
+        next.repeat(&prev, slot.output);
+      }
+    }
+    return slot.output;
+  }
+
+  static_assert(SLOT_COUNT == 256, "slot index is the top 8 bits of hash");
+  std::array<Slot, SLOT_COUNT> slots_;
+};
+}  // namespace mapping
+}  // namespace fujinami
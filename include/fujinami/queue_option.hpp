@@ -0,0 +1,79 @@
+﻿#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include "logging.hpp"
+
+namespace fujinami {
+// パイプラインの段を繋ぐキュー
+enum class PipelineQueue : uint8_t {
+  BUFFERING,  // 入力からbuffering::Engineへ
+  MAPPING,    // buffering::Engineからmapping::Engineへ
+};
+FUJINAMI_LOGGING_ENUM(inline, PipelineQueue, (BUFFERING)(MAPPING));
+
+// キューが満杯のときの振る舞い
+enum class OverflowPolicy : uint8_t {
+  BLOCK,        // 空きができるまで送信側を待たせる
+  DROP_REPEAT,  // キーリピートなら捨て、それ以外はBLOCKと同じく待つ
+  PASSTHROUGH,  // 送らずに失敗を返し、呼び出し元は素通しに切り替える
+};
+FUJINAMI_LOGGING_ENUM(inline, OverflowPolicy,
+                      (BLOCK)(DROP_REPEAT)(PASSTHROUGH));
+
+// キューの容量と満杯のときの振る舞い
+//
+// MAPPINGのキューは前段がキーの状態を持つため、PASSTHROUGHは指定できない。
+// Win32ではフックを待たせられないので、BUFFERINGは常にPASSTHROUGHで開く。
+struct QueueOption final {
+  static constexpr size_t QUEUE_COUNT = 2;
+  static constexpr uint32_t DEFAULT_CAPACITY = 1024;
+  static constexpr uint32_t MIN_CAPACITY = 16;
+  static constexpr uint32_t MAX_CAPACITY = 1 << 20;
+
+  struct Queue final {
+    uint32_t capacity = DEFAULT_CAPACITY;  // 2の累乗に切り上げる
+    OverflowPolicy overflow_policy = OverflowPolicy::BLOCK;
+  };
+
+  static bool is_valid(PipelineQueue pipeline_queue,
+                       const Queue& queue) noexcept {
+    if (queue.capacity < MIN_CAPACITY || queue.capacity > MAX_CAPACITY) {
+      return false;
+    }
+    switch (queue.overflow_policy) {
+      case OverflowPolicy::BLOCK:
+      case OverflowPolicy::DROP_REPEAT:
+        return true;
+      case OverflowPolicy::PASSTHROUGH:
+        return pipeline_queue == PipelineQueue::BUFFERING;
+    }
+    return false;
+  }
+
+  const Queue& queue(PipelineQueue pipeline_queue) const noexcept {
+    return queues[static_cast<size_t>(pipeline_queue)];
+  }
+
+  Queue& queue(PipelineQueue pipeline_queue) noexcept {
+    return queues[static_cast<size_t>(pipeline_queue)];
+  }
+
+  std::array<Queue, QUEUE_COUNT> queues;
+};
+
+// キューの使われ方の統計
+struct QueueStats final {
+  size_t capacity = 0;
+  size_t high_water_mark = 0;  // 受信側が一度に見た滞留数の最大
+  size_t overflow_count = 0;   // 満杯で積めなかった回数
+  size_t drop_count = 0;       // 満杯のために捨てたイベントの数
+
+  FUJINAMI_LOGGING_STRUCT(QueueStats,
+                          (("capacity", capacity))(
+                              ("high_water_mark", high_water_mark))(
+                              ("overflow_count", overflow_count))(
+                              ("drop_count", drop_count)));
+};
+}  // namespace fujinami
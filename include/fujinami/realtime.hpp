@@ -0,0 +1,55 @@
+﻿#pragma once
+
+#include <array>
+#include <cstdint>
+#include "logging.hpp"
+
+namespace fujinami {
+// パイプラインを構成するスレッド
+enum class PipelineThread : uint8_t {
+  HOOK,       // 入力を受け取るスレッド
+  BUFFERING,  // buffering::Engineを動かすスレッド
+  MAPPING,    // mapping::Engineを動かすスレッド
+};
+FUJINAMI_LOGGING_ENUM(inline, PipelineThread, (HOOK)(BUFFERING)(MAPPING));
+
+// 他のプロセスに割り込まれにくくするための設定
+//
+// 既定では何もしない。権限が足りず適用できないものは飛ばして続行する。
+struct RealtimeOption final {
+  static constexpr size_t THREAD_COUNT = 3;
+
+  struct Thread final {
+    int32_t priority = 0;  // SCHED_FIFOの優先度 (0の場合は変更しない)
+    int32_t cpu = -1;      // 固定するCPU (負の場合は変更しない)
+  };
+
+  bool is_enabled() const noexcept {
+    if (lock_memory) return true;
+    for (const Thread& thread : threads) {
+      if (thread.priority > 0 || thread.cpu >= 0) return true;
+    }
+    return false;
+  }
+
+  const Thread& thread(PipelineThread pipeline_thread) const noexcept {
+    return threads[static_cast<size_t>(pipeline_thread)];
+  }
+
+  Thread& thread(PipelineThread pipeline_thread) noexcept {
+    return threads[static_cast<size_t>(pipeline_thread)];
+  }
+
+  bool lock_memory = false;  // mlockallでページアウトとページフォルトを防ぐ
+  std::array<Thread, THREAD_COUNT> threads;
+};
+
+// 呼び出したスレッドに優先度とCPUを適用し、適用できたかをログに出す。
+// すべて適用できた場合はtrueを返す。
+bool apply_realtime_thread(const RealtimeOption& option,
+                           PipelineThread pipeline_thread) noexcept;
+
+// プロセスのメモリを固定し、以降の確保でページフォルトが起きないようにする。
+// すべて適用できた場合はtrueを返す。
+bool apply_realtime_memory(const RealtimeOption& option) noexcept;
+}  // namespace fujinami
@@ -0,0 +1,8 @@
+﻿#pragma once
+
+#include "platform.hpp"
+#if defined(FUJINAMI_PLATFORM_WIN32)
+#include <fujinami_win32/wakeup.hpp>
+#elif defined(FUJINAMI_PLATFORM_LINUX)
+#include <fujinami_linux/wakeup.hpp>
+#endif
@@ -5,7 +5,7 @@
 #include <fujinami/logging.hpp>
 #include <fujinami/flagset.hpp>
 #include <fujinami/key.hpp>
-#include "input.hpp"
+#include "output.hpp"
 
 namespace fujinami {
 namespace {
@@ -30,105 +30,129 @@ class KeyAction {
   explicit KeyAction(Key key, Modifiers modifiers) noexcept
       : code_(to_keycode(key)), modifiers_(modifiers) {}
 
-  void press(const KeyAction& prev) const noexcept {
+  void press(const KeyAction& prev, Output& output) const noexcept {
     // リピート中でないならば、必ずリリースイベントを発生させる。
-    if (prev.code_ != 0) Input::send_release(prev.code_);
-    update_modifiers(prev);
-    if (code_ != 0) Input::send_press(code_);
+    if (prev.code_ != 0) output.release(prev.code_);
+    update_modifiers(prev, output);
+    if (code_ != 0) output.press(code_);
   }
 
-  void press() const noexcept {
-    update_modifiers();
-    if (code_ != 0) Input::send_press(code_);
+  void press(Output& output) const noexcept {
+    update_modifiers(output);
+    if (code_ != 0) output.press(code_);
   }
 
-  void repeat(const KeyAction& prev) const noexcept {
+  void repeat(const KeyAction& prev, Output& output) const noexcept {
     // リピート中ならば、直前と異なるキーのみリリースイベントを発生させる。
-    if (prev.code_ != 0 && code_ != prev.code_) Input::send_release(prev.code_);
-    update_modifiers(prev);
+    if (prev.code_ != 0 && code_ != prev.code_) output.release(prev.code_);
+    update_modifiers(prev, output);
     if (code_ != 0) {
       if (code_ != prev.code_) {
-        Input::send_press(code_);
+        output.press(code_);
       } else {
-        Input::send_repeat(code_);
+        output.repeat(code_);
       }
     }
   }
 
-  void repeat() const noexcept {
-    update_modifiers();
-    if (code_ != 0) Input::send_repeat(code_);
+  void repeat(Output& output) const noexcept {
+    update_modifiers(output);
+    if (code_ != 0) output.repeat(code_);
   }
 
-  void release() const noexcept { cleanup(); }
+  void release(Output& output) const noexcept { cleanup(output); }
+
+  const Modifiers& modifiers() const noexcept { return modifiers_; }
+
+  // 修飾キーを伴わず、1文字を入力するキーかどうか
+  // IMEの変換を起こすスペースや、カーソル移動などの制御キーは含めない。
+  bool is_printable() const noexcept {
+    if (modifiers_) return false;
+    return (code_ >= KEY_1 && code_ <= KEY_EQUAL) ||
+           (code_ >= KEY_Q && code_ <= KEY_RIGHTBRACE) ||
+           (code_ >= KEY_A && code_ <= KEY_GRAVE) ||
+           (code_ >= KEY_BACKSLASH && code_ <= KEY_SLASH) ||
+           code_ == KEY_102ND || code_ == KEY_RO || code_ == KEY_YEN;
+  }
 
   FUJINAMI_LOGGING_STRUCT(KeyAction,
                           (("code", code_))(("modifiers", modifiers_)));
 
  private:
-  void update_modifiers(const KeyAction& prev) const noexcept {
+  void update_modifiers(const KeyAction& prev, Output& output) const noexcept {
     const Modifiers keyup_modifiers = prev.modifiers_ & ~modifiers_;
     const Modifiers keydown_modifiers = ~prev.modifiers_ & modifiers_;
     for (size_t i = 0; i < MODIFIER_LEFT_FLAGS.size(); ++i) {
       if (keyup_modifiers & MODIFIER_LEFT_FLAGS[i]) {
-        Input::send_release(MODIFIER_LEFT_KEYCODES[i]);
+        output.release(MODIFIER_LEFT_KEYCODES[i]);
       } else if (keydown_modifiers & MODIFIER_LEFT_FLAGS[i]) {
-        Input::send_press(MODIFIER_LEFT_KEYCODES[i]);
+        output.press(MODIFIER_LEFT_KEYCODES[i]);
       }
     }
     for (size_t i = 0; i < MODIFIER_RIGHT_FLAGS.size(); ++i) {
       if (keyup_modifiers & MODIFIER_RIGHT_FLAGS[i]) {
-        Input::send_release(MODIFIER_RIGHT_KEYCODES[i]);
+        output.release(MODIFIER_RIGHT_KEYCODES[i]);
       } else if (keydown_modifiers & MODIFIER_RIGHT_FLAGS[i]) {
-        Input::send_press(MODIFIER_RIGHT_KEYCODES[i]);
+        output.press(MODIFIER_RIGHT_KEYCODES[i]);
       }
     }
   }
 
-  void update_modifiers() const noexcept {
+  void update_modifiers(Output& output) const noexcept {
     for (size_t i = 0; i < MODIFIER_LEFT_FLAGS.size(); ++i) {
       if (modifiers_ & MODIFIER_LEFT_FLAGS[i]) {
-        Input::send_press(MODIFIER_LEFT_KEYCODES[i]);
+        output.press(MODIFIER_LEFT_KEYCODES[i]);
       }
     }
     for (size_t i = 0; i < MODIFIER_RIGHT_FLAGS.size(); ++i) {
       if (modifiers_ & MODIFIER_RIGHT_FLAGS[i]) {
-        Input::send_press(MODIFIER_RIGHT_KEYCODES[i]);
+        output.press(MODIFIER_RIGHT_KEYCODES[i]);
       }
     }
   }
 
-  void cleanup() const noexcept {
+  void cleanup(Output& output) const noexcept {
     for (size_t i = 0; i < MODIFIER_LEFT_FLAGS.size(); ++i) {
       if (modifiers_ & MODIFIER_LEFT_FLAGS[i]) {
-        Input::send_release(MODIFIER_LEFT_KEYCODES[i]);
+        output.release(MODIFIER_LEFT_KEYCODES[i]);
       }
     }
     for (size_t i = 0; i < MODIFIER_RIGHT_FLAGS.size(); ++i) {
       if (modifiers_ & MODIFIER_RIGHT_FLAGS[i]) {
-        Input::send_release(MODIFIER_RIGHT_KEYCODES[i]);
+        output.release(MODIFIER_RIGHT_KEYCODES[i]);
       }
     }
-    if (code_ != 0) Input::send_release(code_);
+    if (code_ != 0) output.release(code_);
   }
 
   __u16 code_ = 0;
   Modifiers modifiers_;
 };
 
+// uinputには文字を直接入力する手段がないので、文字のアクションは出力しない。
+// 設定を適用するときにIS_SUPPORTEDを見て取り除き、警告を出す。
 class CharAction final {
  public:
+  static constexpr bool IS_SUPPORTED = false;
+
   explicit CharAction(char16_t c) noexcept : char_(c) {}
 
-  void press(const CharAction&) const noexcept { press(); }
+  void press(const CharAction&, Output& output) const noexcept {
+    press(output);
+  }
+
+  void press(Output&) const noexcept {}
 
-  void press() const noexcept { assert(!"NOIMPL"); }
+  void repeat(const CharAction&, Output& output) const noexcept {
+    press(output);
+  }
 
-  void repeat(const CharAction&) const noexcept { press(); }
+  void repeat(Output& output) const noexcept { press(output); }
 
-  void repeat() const noexcept { press(); }
+  void release(Output&) const noexcept {}
 
-  void release() const noexcept { assert(!"NOIMPL"); }
+  // 何も出力しないので、取り消す文字もない。
+  bool is_printable() const noexcept { return false; }
 
   FUJINAMI_LOGGING_STRUCT(CharAction, (("char", char_)));
 
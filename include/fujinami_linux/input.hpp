@@ -3,6 +3,7 @@
 #include <gsl/gsl>
 #include <unistd.h>
 #include <linux/input.h>
+#include "time.hpp"
 
 namespace fujinami {
 class Input final {
@@ -10,14 +11,15 @@ class Input final {
   static bool init(gsl::czstring event_path,
                    gsl::czstring uinput_path) noexcept;
   static void terminate() noexcept;
-  static bool receive(input_event& event) noexcept;
-  static void send(__u16 code, __s32 value) noexcept;
+  // 読み込み可能な入力を待機せずに読み込む。
+  // 入力の待機はReactorに入力デバイスのfdを渡して行う。
+  static size_t receive(gsl::span<input_event> events) noexcept;
+  static void send(gsl::span<const input_event> events) noexcept;
 
-  static void send_press(__u16 code) noexcept { send(code, 1); }
+  static int fd() noexcept { return evfd_; }
 
-  static void send_repeat(__u16 code) noexcept { send(code, 2); }
-
-  static void send_release(__u16 code) noexcept { send(code, 0); }
+  // 入力のタイムスタンプをClockの時刻にする。
+  static Clock::time_point to_time_point(const timeval& tv) noexcept;
 
   static void send_input(const input_event& ie) noexcept {
     input_event sent_ie = ie;
@@ -26,8 +28,8 @@ class Input final {
   }
 
  private:
-  static int epfd_;
   static int evfd_;
   static int uifd_;
+  static bool is_realtime_;  // タイムスタンプがCLOCK_REALTIMEのまま
 };
 }  // namespace fujinami
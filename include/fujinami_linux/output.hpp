@@ -0,0 +1,66 @@
+﻿#pragma once
+
+#include <vector>
+#include <gsl/gsl>
+#include <sys/time.h>
+#include <linux/input.h>
+#include <fujinami/logging.hpp>
+#include "input.hpp"
+
+namespace fujinami {
+// 出力するキーイベントを溜めておき、uinputへまとめて書き込む
+//
+// キーイベントはMSC_SCAN, EV_KEY, SYN_REPORTからなるフレーム単位で溜める。
+class Output final {
+ public:
+  static constexpr size_t INITIAL_CAPACITY = 64 * 3;
+
+  Output() = default;
+
+  explicit Output(size_t capacity) { events_.reserve(capacity); }
+
+  void press(__u16 code) noexcept { push(code, 1); }
+
+  void repeat(__u16 code) noexcept { push(code, 2); }
+
+  void release(__u16 code) noexcept { push(code, 0); }
+
+  void append(const Output& other) noexcept {
+    events_.insert(events_.end(), other.events_.begin(), other.events_.end());
+  }
+
+  void flush() noexcept {
+    if (events_.empty()) return;
+    timeval time;
+    gettimeofday(&time, nullptr);
+    for (input_event& ie : events_) ie.time = time;
+    Input::send(events_);
+    events_.clear();
+  }
+
+  void clear() noexcept { events_.clear(); }
+
+  bool empty() const noexcept { return events_.empty(); }
+
+  gsl::span<const input_event> events() const noexcept { return events_; }
+
+ private:
+  void push(__u16 code, __s32 value) noexcept {
+    input_event ie{};
+    ie.type = EV_MSC;
+    ie.code = MSC_SCAN;
+    ie.value = code;
+    events_.push_back(ie);
+    ie.type = EV_KEY;
+    ie.code = code;
+    ie.value = value;
+    events_.push_back(ie);
+    ie.type = EV_SYN;
+    ie.code = SYN_REPORT;
+    ie.value = 0;
+    events_.push_back(ie);
+  }
+
+  std::vector<input_event> events_;
+};
+}  // namespace fujinami
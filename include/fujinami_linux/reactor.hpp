@@ -0,0 +1,56 @@
+﻿#pragma once
+
+#include <cstdint>
+#include <fujinami/flagset.hpp>
+#include "time.hpp"
+
+namespace fujinami {
+// 入力スレッドが待つものをすべて1つのepollで待機する
+//
+// 入力デバイス、フローのタイムアウト用のtimerfd、終了や再読み込みを受け取る
+// signalfd、他のスレッドから起こすためのeventfdを持つ。
+class Reactor final {
+ public:
+  enum class Event : uint8_t {
+    INPUT = 1 << 0,    // 入力デバイスが読み込み可能になった
+    TIMEOUT = 1 << 1,  // set_timeoutで指定した時刻を過ぎた
+    QUIT = 1 << 2,     // SIGINTかSIGTERMを受け取った
+    RELOAD = 1 << 3,   // SIGHUPを受け取った
+    WAKEUP = 1 << 4,   // notifyが呼ばれた
+  };
+  using Events = Flagset<Event>;
+  FUJINAMI_FLAGSET_OPERATORS(friend, Events);
+
+  Reactor(const Reactor&) = delete;
+  Reactor(Reactor&&) = delete;
+  Reactor& operator=(const Reactor&) = delete;
+  Reactor& operator=(Reactor&&) = delete;
+
+  Reactor() = default;
+
+  ~Reactor() noexcept { terminate(); }
+
+  // 扱うシグナルをブロックするので、他のスレッドを立てる前に呼ぶ。
+  bool init() noexcept;
+
+  void terminate() noexcept;
+
+  bool add_input(int fd) noexcept;
+
+  // timeout_tpにタイマーをセットする。maxの場合はタイマーを止める。
+  void set_timeout(const Clock::time_point& timeout_tp) noexcept;
+
+  // 他のスレッドから呼び、waitで待機中のスレッドを起こす。
+  void notify() noexcept;
+
+  // いずれかが起きるまで待機し、起きたものを返す。
+  Events wait() noexcept;
+
+ private:
+  int epfd_ = -1;
+  int tmfd_ = -1;
+  int sigfd_ = -1;
+  int evfd_ = -1;
+  Clock::time_point timeout_tp_ = Clock::time_point::max();
+};
+}  // namespace fujinami
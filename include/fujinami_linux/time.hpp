@@ -1,6 +1,7 @@
 ﻿#pragma once
 
 #include <chrono>
+#include <ctime>
 #include <sys/time.h>
 #include <fujinami/logging.hpp>
 
@@ -10,16 +11,32 @@ constexpr std::chrono::microseconds to_duration(const timeval& tv) noexcept {
          std::chrono::microseconds(tv.tv_usec);
 }
 
+constexpr std::chrono::nanoseconds to_duration(const timespec& ts) noexcept {
+  return std::chrono::seconds(ts.tv_sec) + std::chrono::nanoseconds(ts.tv_nsec);
+}
+
+inline timespec to_timespec(std::chrono::nanoseconds dur) noexcept {
+  timespec ts;
+  ts.tv_sec = static_cast<time_t>(dur.count() / 1000000000);
+  ts.tv_nsec = static_cast<long>(dur.count() % 1000000000);
+  return ts;
+}
+
+// CLOCK_MONOTONICに基づく時計
+//
+// 入力デバイスのタイムスタンプもInput::initでCLOCK_MONOTONICに切り替える。
+// 切り替えられない場合はInput::to_time_pointで換算する。
 struct LinuxClock final {
   using rep = int64_t;
   using period = std::micro;
   using duration = std::chrono::duration<rep, period>;
   using time_point = std::chrono::time_point<LinuxClock>;
-  static constexpr bool is_steady = false;
+  static constexpr bool is_steady = true;
   static time_point now() noexcept {
-    timeval tv;
-    gettimeofday(&tv, nullptr);
-    return time_point(to_duration(tv));
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return time_point(
+        std::chrono::duration_cast<duration>(to_duration(ts)));
   }
 };
 using Clock = LinuxClock;
@@ -0,0 +1,65 @@
+﻿#pragma once
+
+#include <cerrno>
+#include <cstdint>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <fujinami/logging.hpp>
+#include "time.hpp"
+
+namespace fujinami {
+// スレッドを跨いで待機中のスレッドを起こすためのイベント
+class Wakeup final {
+ public:
+  Wakeup(const Wakeup&) = delete;
+  Wakeup(Wakeup&&) = delete;
+  Wakeup& operator=(const Wakeup&) = delete;
+  Wakeup& operator=(Wakeup&&) = delete;
+
+  Wakeup() noexcept : fd_(eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) {}
+
+  ~Wakeup() noexcept {
+    if (fd_ >= 0) ::close(fd_);
+  }
+
+  void notify() noexcept {
+    const uint64_t value = 1;
+    ::write(fd_, &value, sizeof(value));
+  }
+
+  // 通知が届くか指定時刻を過ぎるまで待機する。
+  // 通知を受け取った場合はtrueを返す。
+  bool wait_until(const Clock::time_point& timeout_tp) noexcept {
+    pollfd pfd{fd_, POLLIN, 0};
+    while (true) {
+      int result;
+      if (timeout_tp < Clock::time_point::max()) {
+        const auto now = Clock::now();
+        if (timeout_tp <= now) return consume();
+        const auto rel = std::chrono::duration_cast<std::chrono::nanoseconds>(
+            timeout_tp - now);
+        const timespec ts = to_timespec(rel);
+        result = ppoll(&pfd, 1, &ts, nullptr);
+      } else {
+        result = ppoll(&pfd, 1, nullptr, nullptr);
+      }
+      if (result > 0) return consume();
+      if (result == 0) return false;
+      if (errno != EINTR) return false;
+    }
+  }
+
+  bool wait() noexcept { return wait_until(Clock::time_point::max()); }
+
+  int fd() const noexcept { return fd_; }
+
+ private:
+  bool consume() noexcept {
+    uint64_t value = 0;
+    return ::read(fd_, &value, sizeof(value)) == sizeof(value);
+  }
+
+  int fd_ = -1;
+};
+}  // namespace fujinami
@@ -6,6 +6,7 @@
 #include <fujinami/logging.hpp>
 #include <fujinami/flagset.hpp>
 #include <fujinami/key.hpp>
+#include "output.hpp"
 
 namespace fujinami {
 namespace {
@@ -28,8 +29,6 @@ struct CINPUT final : INPUT {
     ki.time = 0;
     ki.dwExtraInfo = 0;
   }
-
-  void send() noexcept { SendInput(1, this, sizeof(INPUT)); }
 };
 
 std::array<Modifier, 8> MODIFIER_FLAGS{
@@ -64,31 +63,42 @@ class KeyAction {
     std::tie(vk_, is_extended_) = to_keycode(key);
   }
 
-  void press(const KeyAction& prev) const noexcept {
-    prev.release_key();
-    update_modifiers(prev);
-    press_key();
+  void press(const KeyAction& prev, Output& output) const noexcept {
+    prev.release_key(output);
+    update_modifiers(prev, output);
+    press_key(output);
+  }
+
+  void press(Output& output) const noexcept {
+    press_modifiers(output);
+    press_key(output);
   }
 
-  void press() const noexcept {
-    press_modifiers();
-    press_key();
+  void repeat(const KeyAction& prev, Output& output) const noexcept {
+    prev.release_key(vk_, is_extended_, output);
+    update_modifiers(prev, output);
+    repeat_key(output);
   }
 
-  void repeat(const KeyAction& prev) const noexcept {
-    prev.release_key(vk_, is_extended_);
-    update_modifiers(prev);
-    repeat_key();
+  void repeat(Output& output) const noexcept {
+    press_modifiers(output);
+    repeat_key(output);
   }
 
-  void repeat() const noexcept {
-    press_modifiers();
-    repeat_key();
+  void release(Output& output) const noexcept {
+    release_key(output);
+    release_modifiers(output);
   }
 
-  void release() const noexcept {
-    release_key();
-    release_modifiers();
+  const Modifiers& modifiers() const noexcept { return modifiers_; }
+
+  // 修飾キーを伴わず、1文字を入力するキーかどうか
+  // IMEの変換を起こすスペースや、カーソル移動などの制御キーは含めない。
+  bool is_printable() const noexcept {
+    if (modifiers_ || is_extended_) return false;
+    return (vk_ >= '0' && vk_ <= '9') || (vk_ >= 'A' && vk_ <= 'Z') ||
+           (vk_ >= VK_OEM_1 && vk_ <= VK_OEM_3) ||
+           (vk_ >= VK_OEM_4 && vk_ <= VK_OEM_8) || vk_ == VK_OEM_102;
   }
 
   FUJINAMI_LOGGING_STRUCT(
@@ -96,56 +106,52 @@ class KeyAction {
       (("vk", vk_))(("is_extended", is_extended_))(("modifiers", modifiers_)));
 
  private:
-  void press_key() const noexcept {
-    if (vk_ != 0) {
-      const bool is_numlocked = !!(GetKeyState(VK_NUMLOCK) & 0x0001);
-      CINPUT(apply_numlock(vk_, is_numlocked), is_extended_).send();
-    }
+  // NumLockの状態はOutput::flushで反映する。
+  void press_key(Output& output) const noexcept {
+    if (vk_ != 0) output.send(CINPUT(vk_, is_extended_));
   }
 
-  void repeat_key() const noexcept {
-    if (vk_ != 0) {
-      const bool is_numlocked = !!(GetKeyState(VK_NUMLOCK) & 0x0001);
-      CINPUT(apply_numlock(vk_, is_numlocked), is_extended_).send();
-    }
+  void repeat_key(Output& output) const noexcept {
+    if (vk_ != 0) output.send(CINPUT(vk_, is_extended_));
   }
 
-  void release_key(WORD next_vk, bool next_is_extended) const noexcept {
+  void release_key(WORD next_vk, bool next_is_extended,
+                   Output& output) const noexcept {
     if (vk_ != 0 && (vk_ != next_vk || is_extended_ != next_is_extended)) {
-      CINPUT(vk_, is_extended_, KEYEVENTF_KEYUP).send();
+      output.send(CINPUT(vk_, is_extended_, KEYEVENTF_KEYUP));
     }
   }
 
-  void release_key() const noexcept {
+  void release_key(Output& output) const noexcept {
     if (vk_ != 0) {
-      CINPUT(vk_, is_extended_, KEYEVENTF_KEYUP).send();
+      output.send(CINPUT(vk_, is_extended_, KEYEVENTF_KEYUP));
     }
   }
 
-  void update_modifiers(const KeyAction& prev) const noexcept {
+  void update_modifiers(const KeyAction& prev, Output& output) const noexcept {
     const Modifiers keyup_modifiers = prev.modifiers_ & ~modifiers_;
     const Modifiers keydown_modifiers = ~prev.modifiers_ & modifiers_;
     for (size_t i = 0; i < MODIFIER_FLAGS.size(); ++i) {
       if (keyup_modifiers & MODIFIER_FLAGS[i]) {
-        MODIFIER_RELEASE_INPUTS[i].send();
+        output.send(MODIFIER_RELEASE_INPUTS[i]);
       } else if (keydown_modifiers & MODIFIER_FLAGS[i]) {
-        MODIFIER_PRESS_INPUTS[i].send();
+        output.send(MODIFIER_PRESS_INPUTS[i]);
       }
     }
   }
 
-  void press_modifiers() const noexcept {
+  void press_modifiers(Output& output) const noexcept {
     for (size_t i = 0; i < MODIFIER_FLAGS.size(); ++i) {
       if (modifiers_ & MODIFIER_FLAGS[i]) {
-        MODIFIER_PRESS_INPUTS[i].send();
+        output.send(MODIFIER_PRESS_INPUTS[i]);
       }
     }
   }
 
-  void release_modifiers() const noexcept {
+  void release_modifiers(Output& output) const noexcept {
     for (size_t i = 0; i < MODIFIER_FLAGS.size(); ++i) {
       if (modifiers_ & MODIFIER_FLAGS[i]) {
-        MODIFIER_RELEASE_INPUTS[i].send();
+        output.send(MODIFIER_RELEASE_INPUTS[i]);
       }
     }
   }
@@ -157,22 +163,30 @@ class KeyAction {
 
 class CharAction final {
  public:
+  static constexpr bool IS_SUPPORTED = true;
+
   explicit CharAction(char16_t c) noexcept : char_(c) {}
 
-  void press(const CharAction&) const noexcept { press(); }
+  void press(const CharAction&, Output& output) const noexcept {
+    press(output);
+  }
 
-  void press() const noexcept {
-    if (char_ != u'\0') {
-      CINPUT input(static_cast<WORD>(char_));
-      SendInput(1, &input, sizeof(INPUT));
-    }
+  void press(Output& output) const noexcept {
+    if (char_ != u'\0') output.send(CINPUT(static_cast<WORD>(char_)));
   }
 
-  void repeat(const CharAction&) const noexcept { press(); }
+  void repeat(const CharAction&, Output& output) const noexcept {
+    press(output);
+  }
+
+  void repeat(Output& output) const noexcept { press(output); }
 
-  void repeat() const noexcept { press(); }
+  void release(Output&) const noexcept {}
 
-  void release() const noexcept {}
+  // 制御文字でなければ1文字を入力する。
+  bool is_printable() const noexcept {
+    return char_ >= u' ' && char_ != u'\x7f';
+  }
 
   FUJINAMI_LOGGING_STRUCT(CharAction, (("char", char_)));
 
@@ -0,0 +1,45 @@
+﻿#pragma once
+
+#include <Windows.h>
+#include <vector>
+#include <fujinami/logging.hpp>
+#include "key.hpp"
+
+namespace fujinami {
+// 出力する入力を溜めておき、SendInputでまとめて送る
+class Output final {
+ public:
+  static constexpr size_t INITIAL_CAPACITY = 64;
+
+  Output() = default;
+
+  explicit Output(size_t capacity) { inputs_.reserve(capacity); }
+
+  void send(const INPUT& input) noexcept { inputs_.push_back(input); }
+
+  void append(const Output& other) noexcept {
+    inputs_.insert(inputs_.end(), other.inputs_.begin(), other.inputs_.end());
+  }
+
+  void flush() noexcept {
+    if (inputs_.empty()) return;
+
+    // テンキーを押す入力はNumLockの状態に応じたキーに置き換える。
+    const bool is_numlocked = !!(GetKeyState(VK_NUMLOCK) & 0x0001);
+    for (INPUT& input : inputs_) {
+      if (!(input.ki.dwFlags & (KEYEVENTF_KEYUP | KEYEVENTF_UNICODE))) {
+        input.ki.wVk = apply_numlock(input.ki.wVk, is_numlocked);
+      }
+    }
+    SendInput(static_cast<UINT>(inputs_.size()), inputs_.data(), sizeof(INPUT));
+    inputs_.clear();
+  }
+
+  void clear() noexcept { inputs_.clear(); }
+
+  bool empty() const noexcept { return inputs_.empty(); }
+
+ private:
+  std::vector<INPUT> inputs_;
+};
+}  // namespace fujinami
@@ -0,0 +1,42 @@
+﻿#pragma once
+
+#include <Windows.h>
+#include <fujinami/logging.hpp>
+#include "time.hpp"
+
+namespace fujinami {
+// スレッドを跨いで待機中のスレッドを起こすためのイベント
+class Wakeup final {
+ public:
+  Wakeup(const Wakeup&) = delete;
+  Wakeup(Wakeup&&) = delete;
+  Wakeup& operator=(const Wakeup&) = delete;
+  Wakeup& operator=(Wakeup&&) = delete;
+
+  Wakeup() noexcept : handle_(CreateEvent(NULL, FALSE, FALSE, NULL)) {}
+
+  ~Wakeup() noexcept {
+    if (handle_) CloseHandle(handle_);
+  }
+
+  void notify() noexcept { SetEvent(handle_); }
+
+  // 通知が届くか指定時刻を過ぎるまで待機する。
+  // 通知を受け取った場合はtrueを返す。
+  bool wait_until(const Clock::time_point& timeout_tp) noexcept {
+    DWORD timeout_ms = INFINITE;
+    if (timeout_tp < Clock::time_point::max()) {
+      const auto now = Clock::now();
+      timeout_ms = timeout_tp <= now ? 0 : (timeout_tp - now).count();
+    }
+    return WaitForSingleObject(handle_, timeout_ms) == WAIT_OBJECT_0;
+  }
+
+  bool wait() noexcept { return wait_until(Clock::time_point::max()); }
+
+  HANDLE handle() const noexcept { return handle_; }
+
+ private:
+  HANDLE handle_ = NULL;
+};
+}  // namespace fujinami
@@ -12,24 +12,24 @@ FlowResult DeferredKeyFlow::reset(State& state) noexcept {
   const KeyPressEvent& front_event = state.events().front().as<KeyPressEvent>();
 
   const Keyset active_keyset = state.modifier_keyset() + front_event.key();
-  const KeysetProperty* keyset_property =
+  const KeysetProperty keyset_property =
       state.find_keyset_property(active_keyset);
 
   // active_keysetを経由するキーセットが登録されていない場合、
   // 状態を初期化して処理を終了する。
-  if (!keyset_property) {
+  if (!keyset_property.is_registered()) {
     FUJINAMI_LOG(trace, "unregistered (keyset:{})", active_keyset);
     state.press_none_key(front_event.key());
     state.pop_event();
     return FlowResult::DONE;
   }
 
-  if (keyset_property->is_mapped()) {
+  if (keyset_property.is_mapped()) {
     // active_keysetにマッピングが存在する場合、
     // active_keysetに登録されている状態に更新する。
     FUJINAMI_LOG(trace, "mapped (keyset:{})", active_keyset);
-    state.apply(active_keyset, keyset_property->trigger_keyset(),
-                keyset_property->modifier_keyset(), front_event.key());
+    state.apply(active_keyset, keyset_property.trigger_keyset(),
+                keyset_property.modifier_keyset(), front_event.key());
   } else {
     // active_keysetにマッピングが存在しない場合、状態を初期化する。
     FUJINAMI_LOG(trace, "unmapped (keyset:{})", active_keyset);
@@ -38,7 +38,7 @@ FlowResult DeferredKeyFlow::reset(State& state) noexcept {
 
   // active_keysetと組み合わせ可能なキーがこれ以上存在しない場合、
   // 現在の状態で確定して処理を終了する。
-  if (keyset_property->is_leaf()) {
+  if (keyset_property.is_leaf()) {
     FUJINAMI_LOG(trace, "leaf (keyset:{})", active_keyset);
     state.pop_event();
     return FlowResult::DONE;
@@ -47,7 +47,7 @@ FlowResult DeferredKeyFlow::reset(State& state) noexcept {
   // active_keysetと組み合わせ可能なキーが存在する場合、
   // 以降のイベントを含めて状態を確定してゆく。
   FUJINAMI_LOG(trace, "begin DEFERRED flow");
-  const auto timeout_dur = state.config() ? (state.config()->timeout_dur()) : Clock::duration::zero();
+  const auto timeout_dur = state.timeout_dur(front_event.key(), keyset_property);
   if (timeout_dur < Clock::duration::max()) {
     timeout_tp_ = front_event.time() + timeout_dur;
   } else {
@@ -78,7 +78,7 @@ FlowResult DeferredKeyFlow::update(State& state) noexcept {
     return FlowResult::CONTINUE;
   }
 
-  const AnyEvent& event = state.events()[observed_event_last_++];
+  const WindowEvent& event = state.events()[observed_event_last_++];
 
   switch (event.type()) {
     case EventType::KEY_PRESS:
@@ -100,6 +100,10 @@ Clock::time_point DeferredKeyFlow::timeout_tp() const noexcept {
   return timeout_tp_;
 }
 
+void DeferredKeyFlow::commit(State& state) noexcept {
+  FUJINAMI_LOG(trace, "commit (timeout:{})", timeout_tp_);
+  state.consume_events(consumed_event_last_);
+}
 
 FlowResult DeferredKeyFlow::update(const KeyPressEvent& event,
                                    State& state) noexcept {
@@ -129,9 +133,9 @@ FlowResult DeferredKeyFlow::update(const KeyPressEvent& event,
   }
 
   // キーが組み合わせ可能でない場合、処理を終了する。
-  if (!keyset_property_->is_combinable(event.key())) {
+  if (!keyset_property_.is_combinable(event.key())) {
     FUJINAMI_LOG(trace, "not-combinable (combinable_keyset:{})",
-                 keyset_property_->combinable_keyset());
+                 keyset_property_.combinable_keyset());
     state.consume_events(consumed_event_last_);
     return FlowResult::DONE;
   }
@@ -142,20 +146,20 @@ FlowResult DeferredKeyFlow::update(const KeyPressEvent& event,
   dontcare_keyset_ += event.key();
 
   keyset_property_ = state.find_keyset_property(pressed_keyset_);
-  if (!keyset_property_) {
+  if (!keyset_property_.is_registered()) {
     FUJINAMI_LOG(trace, "unregistered (keyset:{})", pressed_keyset_);
     state.consume_events(consumed_event_last_);
     return FlowResult::DONE;
   }
 
-  if (keyset_property_->is_mapped()) {
+  if (keyset_property_.is_mapped()) {
     FUJINAMI_LOG(trace, "mapped (keyset:{})", pressed_keyset_);
-    state.apply(pressed_keyset_, keyset_property_->trigger_keyset(),
-                keyset_property_->modifier_keyset(), dontcare_keyset_);
+    state.apply(pressed_keyset_, keyset_property_.trigger_keyset(),
+                keyset_property_.modifier_keyset(), dontcare_keyset_);
     consumed_event_last_ = observed_event_last_;
   }
 
-  if (keyset_property_->is_leaf()) {
+  if (keyset_property_.is_leaf()) {
     FUJINAMI_LOG(trace, "leaf");
     state.consume_events(consumed_event_last_);
     return FlowResult::DONE;
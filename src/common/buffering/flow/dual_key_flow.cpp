@@ -15,15 +15,17 @@ FlowResult DualKeyFlow::reset(State& state) noexcept {
   modifier_keyset_ = state.modifier_keyset();
   dontcare_keyset_ = state.dontcare_keyset() + front_event.key();
   first_key_ = front_event.key();
+  observed_event_last_ = 0;  // front_eventはpopするので0から始める。
   state.pop_event();
   return FlowResult::CONTINUE;
 }
 
 FlowResult DualKeyFlow::update(State& state) noexcept {
-  if (state.events().empty()) {
+  if (observed_event_last_ >= state.events().size()) {
     return FlowResult::CONTINUE;
   } else {
-    const AnyEvent& any_event = state.events().front();
+    // 覗き見たイベントは窓に残し、処理の終了後にエンジンが改めて処理する。
+    const WindowEvent& any_event = state.events()[observed_event_last_];
 
     switch (any_event.type()) {
       case EventType::KEY_PRESS: {
@@ -36,9 +38,13 @@ FlowResult DualKeyFlow::update(State& state) noexcept {
           return FlowResult::DONE;
         }
 
-        // 第1キーと同じキーを押した場合、破棄して次のキーを待つ。
+        // 第1キーと同じキーを押した場合、先頭にあれば破棄して次のキーを待つ。
         FUJINAMI_LOG(trace, "repeat (event:{})", event);
-        state.pop_event();
+        if (observed_event_last_ == 0) {
+          state.pop_event();
+        } else {
+          ++observed_event_last_;
+        }
         return FlowResult::CONTINUE;
       }
       case EventType::KEY_RELEASE: {
@@ -49,6 +55,7 @@ FlowResult DualKeyFlow::update(State& state) noexcept {
           FUJINAMI_LOG(trace, "release (event:{})", event);
           modifier_keyset_ -= event.key();
           dontcare_keyset_ -= event.key();
+          ++observed_event_last_;
           return FlowResult::CONTINUE;
         }
 
@@ -74,17 +81,15 @@ void DualKeyFlow::finish(State& state, bool mod) noexcept {
                 dontcare_keyset_);
   } else {
     const Keyset active_keyset = state.modifier_keyset() + first_key_;
-    const KeysetProperty* keyset_property = nullptr;
-    if (state.layout()) {
-      keyset_property = state.layout()->find_keyset_property(active_keyset);
-    }
-    if (keyset_property && keyset_property->is_mapped()) {
+    const KeysetProperty keyset_property =
+        state.find_keyset_property(active_keyset);
+    if (keyset_property.is_mapped()) {
       // active_keysetにマッピングが存在する場合、
       // active_keysetに登録されている状態に更新する。
       FUJINAMI_LOG(trace, "mapped (keyset:{})", active_keyset);
       state.apply(active_keyset,
-                  keyset_property->trigger_keyset(),
-                  keyset_property->modifier_keyset(),
+                  keyset_property.trigger_keyset(),
+                  keyset_property.modifier_keyset(),
                   dontcare_keyset_);
     } else {
       // active_keysetにマッピングが存在しない場合、状態を初期化する。
@@ -97,8 +102,13 @@ void DualKeyFlow::finish(State& state, bool mod) noexcept {
   }
 }
 
+void DualKeyFlow::commit(State& state) noexcept {
+  FUJINAMI_LOG(trace, "commit as modifier");
+  finish(state, true);
+}
+
 bool DualKeyFlow::is_idle(const State& state) const noexcept {
-  return state.events().empty();
+  return observed_event_last_ == state.events().size();
 }
 }  // namespace buffering
 }  // namespace fujinami
@@ -12,17 +12,15 @@ FlowResult ImmediateKeyFlow::reset(State& state) noexcept {
   const KeyPressEvent& front_event = state.events().front().as<KeyPressEvent>();
 
   const Keyset active_keyset = state.modifier_keyset() + front_event.key();
-  const KeysetProperty* keyset_property = nullptr;
-  if (state.layout()) {
-    keyset_property = state.layout()->find_keyset_property(active_keyset);
-  }
+  const KeysetProperty keyset_property =
+      state.find_keyset_property(active_keyset);
 
-  if (keyset_property && keyset_property->is_mapped()) {
+  if (keyset_property.is_mapped()) {
     // active_keysetにマッピングが存在する場合、
     // active_keysetに登録されている状態に更新する。
     FUJINAMI_LOG(trace, "mapped (keyset:{})", active_keyset);
-    state.apply(active_keyset, keyset_property->trigger_keyset(),
-                keyset_property->modifier_keyset(), front_event.key());
+    state.apply(active_keyset, keyset_property.trigger_keyset(),
+                keyset_property.modifier_keyset(), front_event.key());
   } else {
     // active_keysetにマッピングが存在しない場合、状態を初期化する。
     FUJINAMI_LOG(trace, "unregistered or unmapped (keyset:{})", active_keyset);
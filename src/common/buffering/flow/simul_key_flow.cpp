@@ -1,4 +1,5 @@
 ﻿#include <fujinami/buffering/flow/simul.hpp>
+#include <algorithm>
 #include <fujinami/logging.hpp>
 #include <fujinami/buffering/state.hpp>
 #include <fujinami/buffering/event.hpp>
@@ -14,32 +15,64 @@ FlowResult SimulKeyFlow::reset(State& state) noexcept {
   const KeyPressEvent& front_event = state.events().front().as<KeyPressEvent>();
 
   const Keyset active_keyset = state.modifier_keyset() + front_event.key();
-  const KeysetProperty* keyset_property =
+  const KeysetProperty keyset_property =
       state.find_keyset_property(active_keyset);
 
   FUJINAMI_LOG(trace, "begin SIMUL flow");
-  const auto timeout_dur = state.config() ? (state.config()->timeout_dur()) : Clock::duration::zero();
-  if (timeout_dur < Clock::duration::max()) {
+  const auto timeout_dur = state.timeout_dur(front_event.key(), keyset_property);
+  is_adaptive_ = state.config() && state.config()->adaptive_simul();
+
+  // 学習した判定時間が短ければ、待つ時間も同じ比率で縮める。
+  // 第2キーになりうるのは、第1キーとの同時押しが登録されているキー。
+  Keyset partner_keyset;
+  if (is_adaptive_) {
+    keyset_property.combinable_keyset().for_each([&](Key key) {
+      if (state.find_keyset_property(active_keyset + key).is_mapped()) {
+        partner_keyset += key;
+      }
+    });
+  }
+  const auto press_dur =
+      is_adaptive_ ? timing_.first_window(front_event.key(), partner_keyset,
+                                          timeout_dur / 2)
+                   : timeout_dur / 2;
+  if (press_dur < timeout_dur / 2) {
+    timeout_tp_ = front_event.time() + press_dur * 2;
+  } else if (timeout_dur < Clock::duration::max()) {
     timeout_tp_ = front_event.time() + timeout_dur;
   } else {
     timeout_tp_ = Clock::time_point::max();
   }
-  press_timeout_tp_ = front_event.time() + timeout_dur / 2;  // TODO:
-  release_timeout_tp_ = front_event.time() + timeout_dur / 2;  // TODO:
+  press_timeout_tp_ = front_event.time() + press_dur;
+  // 修飾キーを離す判定時間も既定では押下と同じなので、同じ比率で縮める。
+  release_timeout_tp_ = press_timeout_tp_;
   observed_event_last_ = 0;  // front_eventはpopするので0から始める。
   modifier_keyset_ = state.modifier_keyset();
   dontcare_keyset_ = state.dontcare_keyset() + front_event.key();
   pre_released_keyset_.reset();
   post_released_keyset_.reset();
   first_key_ = front_event.key();
+  first_frame_ = front_event.frame();
   first_begin_tp_ = front_event.time();
   first_end_tp_ = Clock::time_point::max();
   second_key_ = Key::UNKNOWN;
   second_begin_tp_ = Clock::time_point::max();
+  is_same_frame_ = false;
   second_dontcare_keyset_.reset();
   second_post_released_keyset_.reset();
   third_key_ = Key::UNKNOWN;
   third_begin_tp_ = Clock::time_point::max();
+
+  // active_keysetと組み合わせ可能なキーが存在しない場合、
+  // 待たずに第1キーを単打したとして確定する。
+  if (keyset_property.is_leaf()) {
+    FUJINAMI_LOG(trace, "leaf (keyset:{})", active_keyset);
+    first_end_tp_ = front_event.time();
+    state.pop_event();
+    consume(state);
+    return FlowResult::DONE;
+  }
+
   state.pop_event();
   return FlowResult::CONTINUE;
 }
@@ -62,26 +95,33 @@ FlowResult SimulKeyFlow::update(State& state) noexcept {
     return FlowResult::CONTINUE;
   } else {
     // 覗き見るイベントが存在するとき
-    const AnyEvent& any_event = state.events()[observed_event_last_++];
+    const WindowEvent& any_event = state.events()[observed_event_last_++];
     //FUJINAMI_LOG(trace, "update (any_event:{}, index:{})",
     //             any_event, observed_event_last_ - 1);
 
     switch (any_event.type()) {
       case EventType::KEY_PRESS: {
         const auto& event = any_event.as<KeyPressEvent>();
+        const KeyProperty* key_property = state.find_key_property(event.key());
 
         // 第1キーがタイムアウトした場合、
         // キーを離したとして扱い、状態を更新して処理を終了する。
         if (timeout_tp_ <= event.time()) {
           FUJINAMI_LOG(trace, "timed out (timeout:{}, event:{})",
                        timeout_tp_, event);
+          // 判定時間より後に押された第2キーも学習に含め、
+          // 長い押下間隔を取りこぼさないようにする。
+          // 同時押しが登録されていない組はlearnで除く。
+          if (second_key_ == Key::UNKNOWN && !dontcare_keyset_[event.key()] &&
+              key_property && key_property->flow_type() == FlowType::SIMUL) {
+            learn(state, event.key(), event.time());
+          }
           first_end_tp_ = timeout_tp_;
           consume(state);
           return FlowResult::DONE;
         }
 
         // 異なるフロータイプのキーが挟まれた場合、状態を更新して処理を終了する。
-        const KeyProperty* key_property = state.find_key_property(event.key());
         if (!key_property || key_property->flow_type() != FlowType::SIMUL) {
           FUJINAMI_LOG(trace, "interrupt (event:{})", event);
           first_end_tp_ = event.time();
@@ -100,19 +140,17 @@ FlowResult SimulKeyFlow::update(State& state) noexcept {
 
         // 無視するキーでない場合、キーを登録する。
         if (!dontcare_keyset_[event.key()]) {
-          if (third_key_ != Key::UNKNOWN) {
-            // do nothing
-            FUJINAMI_LOG(trace, "more keys (event:{})", event);
-          } else if (second_key_ != Key::UNKNOWN) {
+          if (second_key_ != Key::UNKNOWN) {
+            // 第3キーが揃えば押下間隔を比べられ、以降のイベントでは結果が
+            // 変わらないので、ここで確定する。後続のキーはエンジンが窓から
+            // 読み直し、次の同時打鍵の判定を直ちに始める。
             FUJINAMI_LOG(trace, "register third key (event:{}, dontcare:{}, post_released:{})",
                          event, dontcare_keyset_, post_released_keyset_);
-            dontcare_keyset_ += event.key();
-            post_released_keyset_ -= event.key();
             third_key_ = event.key();
             third_begin_tp_ = event.time();
-            //third_consumed_event_last_ = observed_event_last_;
-            //third_dontcare_keyset_ = dontcare_keyset_;
-            //third_post_released_keyset_ = post_released_keyset_;
+            first_end_tp_ = event.time();
+            consume(state);
+            return FlowResult::DONE;
           } else {
             FUJINAMI_LOG(trace, "register second key (event:{}, dontcare:{}, post_released:{})",
                          event, dontcare_keyset_, post_released_keyset_);
@@ -120,9 +158,32 @@ FlowResult SimulKeyFlow::update(State& state) noexcept {
             post_released_keyset_ -= event.key();
             second_key_ = event.key();
             second_begin_tp_ = event.time();
+            is_same_frame_ = first_frame_ != 0 && event.frame() == first_frame_;
             second_consumed_event_last_ = observed_event_last_;
             second_dontcare_keyset_ = dontcare_keyset_;
             second_post_released_keyset_ = post_released_keyset_;
+
+            // 第1キーと第2キーの同時押しが登録されていない場合、
+            // 以降のイベントによらず第1キーの単打になるので、ここで確定する。
+            const Keyset active_keyset =
+                state.modifier_keyset() - pre_released_keyset_ + first_key_ +
+                second_key_;
+            if (!state.find_keyset_property(active_keyset).is_mapped()) {
+              FUJINAMI_LOG(trace, "unmapped pair (keyset:{})", active_keyset);
+              first_end_tp_ = event.time();
+              second_key_ = Key::UNKNOWN;
+              consume(state);
+              return FlowResult::DONE;
+            }
+
+            // 第1キーと同じフレームで押された場合、
+            // 時刻を比べるまでもなく同時打鍵なので、ここで確定する。
+            if (is_same_frame_) {
+              FUJINAMI_LOG(trace, "same frame (keyset:{})", active_keyset);
+              first_end_tp_ = event.time();
+              consume(state);
+              return FlowResult::DONE;
+            }
           }
         }
         return FlowResult::CONTINUE;
@@ -195,19 +256,78 @@ Clock::time_point SimulKeyFlow::timeout_tp() const noexcept {
   return timeout_tp_;
 }
 
+void SimulKeyFlow::commit(State& state) noexcept {
+  FUJINAMI_LOG(trace, "commit (timeout:{})", timeout_tp_);
+  first_end_tp_ = std::min(timeout_tp_, Clock::now());
+  consume(state);
+}
+
+void SimulKeyFlow::observe(const KeyReleaseEvent& event) noexcept {
+  if (sample_.first_key == Key::UNKNOWN || event.key() != sample_.first_key) {
+    return;
+  }
+
+  // 重なりが押下間隔以上あれば、意図して同時に押したとみなす。
+  const auto overlap = event.time() - sample_.second_begin_tp;
+  timing_.learn(sample_.first_key, sample_.second_key, sample_.gap,
+                sample_.gap <= overlap, sample_.error_rate);
+  sample_.first_key = Key::UNKNOWN;
+}
+
+void SimulKeyFlow::learn(const State& state, Key second_key,
+                         Clock::time_point second_begin_tp) noexcept {
+  // 時間切れや第3キーで終えた場合も、第1キーを離した時刻で見分ける。
+  // 第1キーを離す前に終えたものを数えないと、判定時間が縮むほど
+  // 長い押下間隔の打鍵を取りこぼし、推定が短い側に偏る。
+  if (!is_adaptive_ || second_key == Key::UNKNOWN) return;
+
+  // 同時押しを登録していない組は判定時間を使わないので数えない。
+  // 順次打鍵の組まで数えると、組の表が埋まって学習できなくなる。
+  const Keyset active_keyset =
+      state.modifier_keyset() - pre_released_keyset_ + first_key_ + second_key;
+  if (!state.find_keyset_property(active_keyset).is_mapped()) return;
+
+  sample_.first_key = first_key_;
+  sample_.second_key = second_key;
+  sample_.gap = second_begin_tp - first_begin_tp_;
+  sample_.second_begin_tp = second_begin_tp;
+  sample_.error_rate = state.config()->simul_error_rate();
+
+  // 第1キーを離すイベントがすでに窓に届いていれば、直ちに数える。
+  for (size_t i = 0; i < state.events().size(); ++i) {
+    const WindowEvent& event = state.events()[i];
+    if (event.type() == EventType::KEY_RELEASE &&
+        event.as<KeyReleaseEvent>().key() == first_key_) {
+      observe(event.as<KeyReleaseEvent>());
+      return;
+    }
+  }
+}
+
 void SimulKeyFlow::consume(State& state) noexcept {
+  learn(state, second_key_, second_begin_tp_);
+
+  // 学習している場合は、第1キーと第2キーの組ごとの判定時間を使う。
+  const auto press_timeout_tp =
+      is_adaptive_ ? first_begin_tp_ + timing_.pair_window(
+                                           first_key_, second_key_,
+                                           press_timeout_tp_ - first_begin_tp_)
+                   : press_timeout_tp_;
+
   // 第1キーと第2キーが同時打鍵しているかを調べる。
   bool is_simul = false;
   if (second_key_ != Key::UNKNOWN) {
-    if (third_key_ != Key::UNKNOWN) {
+    if (is_same_frame_) {
+      is_simul = true;
+    } else if (third_key_ != Key::UNKNOWN) {
       const auto p1 = second_begin_tp_ - first_begin_tp_;
       const auto p3 = third_begin_tp_ - second_begin_tp_;
       if (p1 <= p3 &&
-          second_begin_tp_ < press_timeout_tp_) {
+          second_begin_tp_ < press_timeout_tp) {
         is_simul = true;
       }
     } else {
-      if (second_begin_tp_ < press_timeout_tp_) {
+      if (second_begin_tp_ < press_timeout_tp) {
         is_simul = true;
       }
     }
@@ -218,8 +338,8 @@ void SimulKeyFlow::consume(State& state) noexcept {
   if (is_simul) {
     const Keyset fixed_modifier_keyset = state.modifier_keyset() - pre_released_keyset_;
     const Keyset active_keyset = fixed_modifier_keyset + first_key_ + second_key_;
-    const KeysetProperty* keyset_property = state.find_keyset_property(active_keyset);
-    if (!keyset_property || !keyset_property->is_mapped()) {
+    const KeysetProperty keyset_property = state.find_keyset_property(active_keyset);
+    if (!keyset_property.is_mapped()) {
       is_simul = false;
     }
   }
@@ -228,12 +348,12 @@ void SimulKeyFlow::consume(State& state) noexcept {
     // 第1キーと第2キーが同時打鍵したとして、状態を更新する。
     const Keyset fixed_modifier_keyset = state.modifier_keyset() - pre_released_keyset_;
     const Keyset active_keyset = fixed_modifier_keyset + first_key_ + second_key_;
-    const KeysetProperty* keyset_property = state.find_keyset_property(active_keyset);
-    if (keyset_property && keyset_property->is_mapped()) {
+    const KeysetProperty keyset_property = state.find_keyset_property(active_keyset);
+    if (keyset_property.is_mapped()) {
       FUJINAMI_LOG(trace, "mapped (keyset:{})", active_keyset);
       state.apply(active_keyset,
-                  keyset_property->trigger_keyset(),
-                  keyset_property->modifier_keyset() - second_post_released_keyset_,
+                  keyset_property.trigger_keyset(),
+                  keyset_property.modifier_keyset() - second_post_released_keyset_,
                   second_dontcare_keyset_);
     } else {
       FUJINAMI_LOG(trace, "unregistered or unmapped (keyset:{})", active_keyset);
@@ -246,12 +366,12 @@ void SimulKeyFlow::consume(State& state) noexcept {
   } else {
     // 第1キーを単打したとして、状態を更新する。
     const Keyset active_keyset = state.modifier_keyset() - pre_released_keyset_ + first_key_;
-    const KeysetProperty* keyset_property = state.find_keyset_property(active_keyset);
-    if (keyset_property && keyset_property->is_mapped()) {
+    const KeysetProperty keyset_property = state.find_keyset_property(active_keyset);
+    if (keyset_property.is_mapped()) {
       FUJINAMI_LOG(trace, "mapped (keyset:{})", active_keyset);
       state.apply(active_keyset,
-                  keyset_property->trigger_keyset(),
-                  keyset_property->modifier_keyset(),
+                  keyset_property.trigger_keyset(),
+                  keyset_property.modifier_keyset(),
                   first_key_);
     } else {
       FUJINAMI_LOG(trace, "unregistered or unmapped (keyset:{})", active_keyset);
@@ -0,0 +1,191 @@
+﻿#include <fujinami/buffering/simul_timing.hpp>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <vector>
+#include <fujinami/logging.hpp>
+
+namespace fujinami {
+namespace buffering {
+namespace {
+constexpr char MAGIC[4] = {'F', 'J', 'N', 'T'};
+constexpr uint32_t VERSION = 2;
+}  // namespace
+
+Clock::duration SimulTiming::first_window(
+    Key first, const Keyset& partner_keyset,
+    Clock::duration default_dur) const noexcept {
+  // 第1キーの時点では第2キーがわからないので、組の中で最も長いものを使う。
+  // 学習していない組より短くすると、その組の同時打鍵を取りこぼす。
+  bool is_learned = !!partner_keyset;
+  uint8_t window_bins = 0;
+  partner_keyset.for_each([&](Key second) {
+    const Pair* pair = find(to_pair_key(first, second));
+    if (!pair || pair->window_bins == 0) {
+      is_learned = false;
+    } else if (pair->window_bins > window_bins) {
+      window_bins = pair->window_bins;
+    }
+  });
+  return is_learned ? to_window(window_bins, default_dur) : default_dur;
+}
+
+void SimulTiming::learn(Key first, Key second, Clock::duration gap,
+                        bool is_simul, double target_error_rate) noexcept {
+  Pair* pair = find_or_insert(to_pair_key(first, second));
+  pair->learn_tick = ++learn_tick_;
+
+  const int64_t gap_us =
+      std::chrono::duration_cast<std::chrono::microseconds>(gap).count();
+  size_t bin = gap_us > 0 ? static_cast<size_t>(gap_us / BIN_WIDTH_US) : 0;
+  if (bin >= BIN_COUNT) bin = BIN_COUNT - 1;
+  if (is_simul) {
+    ++pair->simul_bins[bin];
+  } else {
+    ++pair->serial_bins[bin];
+  }
+
+  // 古い打鍵の重みを下げ、癖の変化に追従させる。
+  if (++pair->sample_count >= MAX_SAMPLE_COUNT) {
+    uint32_t sample_count = 0;
+    for (size_t i = 0; i < BIN_COUNT; ++i) {
+      pair->simul_bins[i] /= 2;
+      pair->serial_bins[i] /= 2;
+      sample_count += pair->simul_bins[i] + pair->serial_bins[i];
+    }
+    pair->sample_count = sample_count;
+  }
+
+  const uint8_t window_bins = compute_window_bins(*pair, target_error_rate);
+  if (pair->window_bins != window_bins) {
+    FUJINAMI_LOG(debug, "update simul window (first:{}, second:{}, bins:{})",
+                 first, second, window_bins);
+    pair->window_bins = window_bins;
+  }
+}
+
+void SimulTiming::clear() noexcept {
+  pairs_.fill(Pair{});
+  learn_tick_ = 0;
+}
+
+bool SimulTiming::save(const std::string& path) const {
+  std::ofstream ofs(path, std::ios::binary | std::ios::trunc);
+  if (!ofs.is_open()) return false;
+  ofs.write(MAGIC, sizeof(MAGIC));
+  ofs.write(reinterpret_cast<const char*>(&VERSION), sizeof(VERSION));
+  ofs.write(reinterpret_cast<const char*>(pairs_.data()),
+            sizeof(Pair) * pairs_.size());
+  ofs.flush();
+  return !ofs.fail();
+}
+
+bool SimulTiming::load(const std::string& path) {
+  clear();
+
+  std::ifstream ifs(path, std::ios::binary);
+  if (!ifs.is_open()) return false;
+  const std::vector<char> data{std::istreambuf_iterator<char>(ifs),
+                               std::istreambuf_iterator<char>()};
+  if (data.size() != sizeof(MAGIC) + sizeof(VERSION) + sizeof(pairs_) ||
+      std::memcmp(data.data(), MAGIC, sizeof(MAGIC)) != 0) {
+    return false;
+  }
+  uint32_t version = 0;
+  std::memcpy(&version, data.data() + sizeof(MAGIC), sizeof(version));
+  if (version != VERSION) return false;
+  std::memcpy(pairs_.data(), data.data() + sizeof(MAGIC) + sizeof(VERSION),
+              sizeof(pairs_));
+
+  // 探索の前提が崩れていないか確かめる。
+  for (const Pair& pair : pairs_) {
+    if (pair.key == 0) continue;
+    if (find(pair.key) != &pair || pair.window_bins > BIN_COUNT) {
+      clear();
+      return false;
+    }
+    if (pair.learn_tick > learn_tick_) learn_tick_ = pair.learn_tick;
+  }
+  return true;
+}
+
+size_t SimulTiming::pair_count() const noexcept {
+  size_t count = 0;
+  for (const Pair& pair : pairs_) {
+    if (pair.key != 0) ++count;
+  }
+  return count;
+}
+
+const SimulTiming::Pair* SimulTiming::find(uint16_t key) const noexcept {
+  const size_t mask = PAIR_CAPACITY - 1;
+  for (size_t n = 0, i = to_home_index(key); n < PAIR_CAPACITY;
+       ++n, i = (i + 1) & mask) {
+    const Pair& pair = pairs_[i];
+    if (pair.key == key) return &pair;
+    if (pair.key == 0) return nullptr;
+  }
+  return nullptr;
+}
+
+SimulTiming::Pair* SimulTiming::find_or_insert(uint16_t key) noexcept {
+  const size_t mask = PAIR_CAPACITY - 1;
+  for (size_t n = 0, i = to_home_index(key); n < PAIR_CAPACITY;
+       ++n, i = (i + 1) & mask) {
+    Pair& pair = pairs_[i];
+    if (pair.key == key) return &pair;
+    if (pair.key == 0) {
+      pair.key = key;
+      return &pair;
+    }
+  }
+
+  // 空きがなければ、最も長く打っていない組を捨てる。
+  size_t oldest = 0;
+  for (size_t i = 1; i < PAIR_CAPACITY; ++i) {
+    if (pairs_[i].learn_tick < pairs_[oldest].learn_tick) oldest = i;
+  }
+  FUJINAMI_LOG(debug, "evict simul pair (first:{}, second:{})",
+               static_cast<Key>(pairs_[oldest].key >> 8),
+               static_cast<Key>(pairs_[oldest].key & 0xFF));
+  erase(oldest);
+  return find_or_insert(key);
+}
+
+void SimulTiming::erase(size_t index) noexcept {
+  // 後ろに続く組のうち、探索がindexを通るものを前に詰めて穴を塞ぐ。
+  const size_t mask = PAIR_CAPACITY - 1;
+  size_t hole = index;
+  for (size_t n = 1, i = (index + 1) & mask; n < PAIR_CAPACITY;
+       ++n, i = (i + 1) & mask) {
+    if (pairs_[i].key == 0) break;
+    const size_t home = to_home_index(pairs_[i].key);
+    if (((i - home) & mask) >= ((i - hole) & mask)) {
+      pairs_[hole] = pairs_[i];
+      hole = i;
+    }
+  }
+  pairs_[hole] = Pair{};
+}
+
+uint8_t SimulTiming::compute_window_bins(const Pair& pair,
+                                         double target_error_rate) noexcept {
+  if (pair.sample_count < MIN_SAMPLE_COUNT) return 0;
+
+  // 判定時間をkビンとしたとき、それ以降の同時打鍵とそれより前の順次打鍵を
+  // 取り違える。取り違えが目標以下になる最小のkを探す。
+  uint32_t total = 0;
+  uint32_t error = 0;
+  for (size_t i = 0; i < BIN_COUNT; ++i) {
+    total += pair.simul_bins[i] + pair.serial_bins[i];
+    error += pair.simul_bins[i];
+  }
+  const double max_error = target_error_rate * total;
+  for (size_t k = 1; k <= BIN_COUNT; ++k) {
+    error = error - pair.simul_bins[k - 1] + pair.serial_bins[k - 1];
+    if (error <= max_error) return static_cast<uint8_t>(k);
+  }
+  return 0;
+}
+}  // namespace buffering
+}  // namespace fujinami
@@ -0,0 +1,512 @@
+﻿#include <fujinami/config/compiled_config.hpp>
+#include <codecvt>
+#include <cstring>
+#include <fstream>
+#include <locale>
+#include <type_traits>
+#include <fujinami/platform.hpp>
+
+namespace fujinami {
+namespace config {
+namespace {
+constexpr char MAGIC[4] = {'F', 'J', 'N', 'C'};
+#if defined(FUJINAMI_PLATFORM_WIN32)
+constexpr uint32_t PLATFORM_ID = 1;
+#elif defined(FUJINAMI_PLATFORM_LINUX)
+constexpr uint32_t PLATFORM_ID = 2;
+#endif
+
+// FNV-1a
+uint64_t hash_bytes(const char* data, size_t size) noexcept {
+  uint64_t h = 0xCBF29CE484222325ull;
+  for (size_t i = 0; i < size; ++i) {
+    h ^= static_cast<unsigned char>(data[i]);
+    h *= 0x100000001B3ull;
+  }
+  return h;
+}
+
+// UTF-8のパスを各プラットフォームで開ける形式に変換する。
+#if defined(FUJINAMI_PLATFORM_WIN32)
+std::wstring to_native_path(const std::string& path) {
+  std::wstring_convert<std::codecvt_utf8_utf16<wchar_t>> conv;
+  return conv.from_bytes(path.data());
+}
+#elif defined(FUJINAMI_PLATFORM_LINUX)
+const std::string& to_native_path(const std::string& path) { return path; }
+#endif
+
+bool read_file(const std::string& path, std::vector<char>& data) {
+  std::ifstream ifs(to_native_path(path), std::ios::binary);
+  if (!ifs.is_open()) return false;
+  ifs.seekg(0, std::ios::end);
+  const auto end_pos = ifs.tellg();
+  ifs.seekg(0, std::ios::beg);
+  data.resize(static_cast<size_t>(end_pos));
+  if (!data.empty()) ifs.read(data.data(), data.size());
+  return !ifs.fail();
+}
+
+class Writer final {
+ public:
+  explicit Writer(std::ofstream& ofs) noexcept : ofs_(ofs) {}
+
+  template <typename T>
+  void put(const T& value) {
+    static_assert(std::is_trivially_copyable<T>::value, "T must be POD");
+    ofs_.write(reinterpret_cast<const char*>(&value), sizeof(T));
+  }
+
+  void put(const std::string& s) {
+    put(static_cast<uint32_t>(s.size()));
+    ofs_.write(s.data(), s.size());
+  }
+
+  template <typename T>
+  void put(const std::vector<T>& values) {
+    static_assert(std::is_trivially_copyable<T>::value, "T must be POD");
+    put(static_cast<uint32_t>(values.size()));
+    ofs_.write(reinterpret_cast<const char*>(values.data()),
+               values.size() * sizeof(T));
+  }
+
+ private:
+  std::ofstream& ofs_;
+};
+
+// 範囲外を読もうとした場合はfalseを返し、以降の読み込みもすべて失敗させる。
+class Reader final {
+ public:
+  explicit Reader(const std::vector<char>& data) noexcept : data_(data) {}
+
+  template <typename T>
+  bool get(T& value) noexcept {
+    static_assert(std::is_trivially_copyable<T>::value, "T must be POD");
+    if (!consume(sizeof(T))) return false;
+    std::memcpy(&value, data_.data() + pos_ - sizeof(T), sizeof(T));
+    return true;
+  }
+
+  bool get(std::string& s) {
+    uint32_t size = 0;
+    if (!get(size) || !consume(size)) return false;
+    s.assign(data_.data() + pos_ - size, size);
+    return true;
+  }
+
+  template <typename T>
+  bool get(std::vector<T>& values) {
+    static_assert(std::is_trivially_copyable<T>::value, "T must be POD");
+    uint32_t size = 0;
+    if (!get(size)) return false;
+    if (size > (data_.size() - pos_) / sizeof(T)) return fail();
+    values.resize(size);
+    const size_t byte_size = size * sizeof(T);
+    if (!consume(byte_size)) return false;
+    std::memcpy(values.data(), data_.data() + pos_ - byte_size, byte_size);
+    return true;
+  }
+
+  bool is_end() const noexcept { return is_ok_ && pos_ == data_.size(); }
+
+ private:
+  bool consume(size_t size) noexcept {
+    if (!is_ok_ || size > data_.size() - pos_) return fail();
+    pos_ += size;
+    return true;
+  }
+
+  bool fail() noexcept {
+    is_ok_ = false;
+    return false;
+  }
+
+  const std::vector<char>& data_;
+  size_t pos_ = 0;
+  bool is_ok_ = true;
+};
+}  // namespace
+
+void CompiledConfig::reset() noexcept {
+  sources_.clear();
+  timeout_ms_ = -1;
+  default_layout_ = NO_LAYOUT;
+  default_im_layout_ = NO_LAYOUT;
+  auto_layout_ = false;
+  speculative_simul_ = false;
+  undo_actions_.clear();
+  adaptive_simul_ = false;
+  simul_error_rate_ = KeyboardConfig::DEFAULT_SIMUL_ERROR_RATE;
+  realtime_option_ = RealtimeOption{};
+  queue_option_ = QueueOption{};
+  layout_names_.clear();
+  flows_.clear();
+  mappings_.clear();
+  keys_.clear();
+  actions_.clear();
+  transitions_.clear();
+}
+
+void CompiledConfig::add_source(const std::string& path, const char* data,
+                                size_t size) {
+  const uint64_t hash = hash_bytes(data, size);
+  for (Source& source : sources_) {
+    if (source.path == path) {
+      source.hash = hash;
+      return;
+    }
+  }
+  sources_.push_back(Source{path, hash});
+}
+
+bool CompiledConfig::add_source(const std::string& path) {
+  std::vector<char> data;
+  if (!read_file(path, data)) return false;
+  add_source(path, data.data(), data.size());
+  return true;
+}
+
+void CompiledConfig::set_timeout_milliseconds(int32_t timeout_ms) noexcept {
+  timeout_ms_ = timeout_ms;
+}
+
+void CompiledConfig::set_default_layout(uint32_t layout) noexcept {
+  default_layout_ = layout;
+}
+
+void CompiledConfig::set_default_im_layout(uint32_t layout) noexcept {
+  default_im_layout_ = layout;
+}
+
+void CompiledConfig::set_auto_layout(bool is_enabled) noexcept {
+  auto_layout_ = is_enabled;
+}
+
+void CompiledConfig::set_speculative_simul(bool is_enabled) noexcept {
+  speculative_simul_ = is_enabled;
+}
+
+void CompiledConfig::add_undo_action(ActionType type, uint16_t value,
+                                     uint16_t modifiers) {
+  undo_actions_.push_back(
+      ActionRecord{static_cast<uint16_t>(type), value, modifiers});
+}
+
+void CompiledConfig::set_adaptive_simul(bool is_enabled,
+                                        double error_rate) noexcept {
+  adaptive_simul_ = is_enabled;
+  simul_error_rate_ = error_rate;
+}
+
+void CompiledConfig::set_realtime_option(const RealtimeOption& option) noexcept {
+  realtime_option_ = option;
+}
+
+void CompiledConfig::set_queue_option(const QueueOption& option) noexcept {
+  queue_option_ = option;
+}
+
+uint32_t CompiledConfig::add_layout(const std::string& name) {
+  layout_names_.push_back(name);
+  return static_cast<uint32_t>(layout_names_.size() - 1);
+}
+
+void CompiledConfig::add_flow(uint32_t layout, Key key, FlowType flow_type,
+                              int32_t timeout_ms) {
+  flows_.push_back(FlowRecord{layout, static_cast<uint16_t>(key),
+                              static_cast<uint16_t>(flow_type),
+                              timeout_ms < 0 ? -1 : timeout_ms});
+}
+
+void CompiledConfig::begin_mapping(uint32_t layout, int32_t timeout_ms) {
+  mappings_.push_back(MappingRecord{layout,
+                                    static_cast<uint32_t>(keys_.size()), 0,
+                                    static_cast<uint32_t>(actions_.size()), 0,
+                                    timeout_ms < 0 ? -1 : timeout_ms});
+}
+
+void CompiledConfig::add_mapping_key(Key key, KeyRole role) {
+  keys_.push_back(
+      KeyRecord{static_cast<uint16_t>(key), static_cast<uint16_t>(role)});
+  ++mappings_.back().key_count;
+}
+
+void CompiledConfig::add_mapping_action(ActionType type, uint16_t value,
+                                        uint16_t modifiers) {
+  actions_.push_back(
+      ActionRecord{static_cast<uint16_t>(type), value, modifiers});
+  ++mappings_.back().action_count;
+}
+
+void CompiledConfig::end_mapping() {
+  // キーかアクションが空のマッピングは登録しない。
+  const MappingRecord& mapping = mappings_.back();
+  if (mapping.key_count == 0 || mapping.action_count == 0) {
+    keys_.resize(mapping.key_first);
+    actions_.resize(mapping.action_first);
+    mappings_.pop_back();
+  }
+}
+
+void CompiledConfig::add_transition(uint32_t layout, const Keyset& keyset,
+                                    uint32_t next_layout) {
+  TransitionRecord transition{layout, static_cast<uint32_t>(keys_.size()), 0,
+                              next_layout};
+  keyset.for_each([&](Key key) {
+    keys_.push_back(KeyRecord{static_cast<uint16_t>(key),
+                              static_cast<uint16_t>(KeyRole::NONE)});
+    ++transition.key_count;
+  });
+  transitions_.push_back(transition);
+}
+
+bool CompiledConfig::append_action(Command& command,
+                                   const ActionRecord& action) {
+  switch (static_cast<ActionType>(action.type)) {
+    case ActionType::KEY:
+      command.emplace_back(KeyAction(static_cast<Key>(action.value),
+                                     static_cast<Modifier>(action.modifiers)));
+      return true;
+    case ActionType::CHAR:
+      if (!CharAction::IS_SUPPORTED) return false;
+      command.emplace_back(CharAction(static_cast<char16_t>(action.value)));
+      return true;
+    default:
+      throw LoaderError("invalid action");
+  }
+}
+
+void CompiledConfig::apply(KeyboardConfig& config) const {
+  config.reset();
+
+  std::vector<std::shared_ptr<KeyboardLayout>> layouts;
+  layouts.reserve(layout_names_.size());
+  for (const std::string& name : layout_names_) {
+    layouts.push_back(config.create_layout(name));
+  }
+
+  if (timeout_ms_ >= 0) {
+    config.set_timeout_dur(std::chrono::milliseconds(timeout_ms_));
+  }
+  if (default_layout_ != NO_LAYOUT) {
+    config.set_default_layout(layouts.at(default_layout_));
+  }
+  if (default_im_layout_ != NO_LAYOUT) {
+    config.set_default_im_layout(layouts.at(default_im_layout_));
+  }
+  config.set_auto_layout(auto_layout_);
+  config.set_speculative_simul(speculative_simul_);
+  config.set_adaptive_simul(adaptive_simul_, simul_error_rate_);
+  config.set_realtime_option(realtime_option_);
+
+  // 出力できないアクションは取り除き、まとめて警告する。
+  size_t unsupported_count = 0;
+  Command undo_command;
+  for (const ActionRecord& action : undo_actions_) {
+    if (!append_action(undo_command, action)) ++unsupported_count;
+  }
+  config.set_undo_command(std::move(undo_command));
+  config.set_queue_option(queue_option_);
+
+  for (const FlowRecord& flow : flows_) {
+    layouts.at(flow.layout)
+        ->create_flow(static_cast<Key>(flow.key),
+                      static_cast<FlowType>(flow.flow_type),
+                      to_timeout(flow.timeout_ms));
+  }
+
+  std::vector<Key> keys;
+  std::vector<KeyRole> roles;
+  for (const MappingRecord& mapping : mappings_) {
+    keys.clear();
+    roles.clear();
+    for (uint32_t i = 0; i < mapping.key_count; ++i) {
+      const KeyRecord& key = keys_.at(mapping.key_first + i);
+      keys.push_back(static_cast<Key>(key.key));
+      roles.push_back(static_cast<KeyRole>(key.role));
+    }
+    Command command;
+    for (uint32_t i = 0; i < mapping.action_count; ++i) {
+      if (!append_action(command, actions_.at(mapping.action_first + i))) {
+        ++unsupported_count;
+      }
+    }
+    layouts.at(mapping.layout)
+        ->create_mapping(keys, roles, std::move(command),
+                         to_timeout(mapping.timeout_ms));
+  }
+
+  for (const TransitionRecord& transition : transitions_) {
+    Keyset keyset;
+    for (uint32_t i = 0; i < transition.key_count; ++i) {
+      keyset += static_cast<Key>(keys_.at(transition.key_first + i).key);
+    }
+    layouts.at(transition.layout)
+        ->create_transition(keyset, layouts.at(transition.next_layout));
+  }
+
+  if (unsupported_count > 0) {
+    FUJINAMI_LOG(warn,
+                 "character actions are not supported on this platform "
+                 "(count:{})",
+                 unsupported_count);
+  }
+  config.freeze();
+}
+
+void CompiledConfig::save(const std::string& path) const {
+  std::ofstream ofs(to_native_path(path), std::ios::binary | std::ios::trunc);
+  if (!ofs.is_open()) throw LoaderError("failed to open '{}'", path);
+
+  Writer writer(ofs);
+  writer.put(MAGIC);
+  writer.put(static_cast<uint32_t>(VERSION));
+  writer.put(PLATFORM_ID);
+  writer.put(static_cast<uint32_t>(sources_.size()));
+  for (const Source& source : sources_) {
+    writer.put(source.path);
+    writer.put(source.hash);
+  }
+  writer.put(timeout_ms_);
+  writer.put(default_layout_);
+  writer.put(default_im_layout_);
+  writer.put(static_cast<uint8_t>(auto_layout_));
+  writer.put(static_cast<uint8_t>(speculative_simul_));
+  writer.put(undo_actions_);
+  writer.put(static_cast<uint8_t>(adaptive_simul_));
+  writer.put(simul_error_rate_);
+  writer.put(static_cast<uint8_t>(realtime_option_.lock_memory));
+  writer.put(realtime_option_.threads);
+  for (const QueueOption::Queue& queue : queue_option_.queues) {
+    writer.put(queue.capacity);
+    writer.put(static_cast<uint8_t>(queue.overflow_policy));
+  }
+  writer.put(static_cast<uint32_t>(layout_names_.size()));
+  for (const std::string& name : layout_names_) writer.put(name);
+  writer.put(flows_);
+  writer.put(mappings_);
+  writer.put(keys_);
+  writer.put(actions_);
+  writer.put(transitions_);
+
+  ofs.flush();
+  if (ofs.fail()) throw LoaderError("failed to write '{}'", path);
+}
+
+bool CompiledConfig::load(const std::string& path) {
+  reset();
+
+  std::vector<char> data;
+  if (!read_file(path, data)) return false;
+
+  Reader reader(data);
+  char magic[sizeof(MAGIC)];
+  uint32_t version = 0;
+  uint32_t platform_id = 0;
+  if (!reader.get(magic) || std::memcmp(magic, MAGIC, sizeof(MAGIC)) != 0 ||
+      !reader.get(version) || version != VERSION ||
+      !reader.get(platform_id) || platform_id != PLATFORM_ID) {
+    FUJINAMI_LOG(info, "incompatible compiled config (path:{})", path);
+    return false;
+  }
+
+  // 記録したソースが1つでも変わっていれば使わない。
+  uint32_t source_count = 0;
+  if (!reader.get(source_count)) return false;
+  std::vector<char> source_data;
+  for (uint32_t i = 0; i < source_count; ++i) {
+    Source source;
+    if (!reader.get(source.path) || !reader.get(source.hash)) return false;
+    if (!read_file(source.path, source_data) ||
+        hash_bytes(source_data.data(), source_data.size()) != source.hash) {
+      FUJINAMI_LOG(info, "config source has changed (path:{})", source.path);
+      reset();
+      return false;
+    }
+    sources_.push_back(std::move(source));
+  }
+
+  uint8_t auto_layout = 0;
+  uint8_t speculative_simul = 0;
+  uint8_t adaptive_simul = 0;
+  uint8_t lock_memory = 0;
+  uint32_t layout_count = 0;
+  bool is_ok = reader.get(timeout_ms_) && reader.get(default_layout_) &&
+               reader.get(default_im_layout_) && reader.get(auto_layout) &&
+               reader.get(speculative_simul) && reader.get(undo_actions_) &&
+               reader.get(adaptive_simul) && reader.get(simul_error_rate_) &&
+               reader.get(lock_memory) &&
+               reader.get(realtime_option_.threads);
+  for (QueueOption::Queue& queue : queue_option_.queues) {
+    uint8_t overflow_policy = 0;
+    is_ok = is_ok && reader.get(queue.capacity) &&
+            reader.get(overflow_policy);
+    queue.overflow_policy = static_cast<OverflowPolicy>(overflow_policy);
+  }
+  is_ok = is_ok && reader.get(layout_count);
+  for (uint32_t i = 0; is_ok && i < layout_count; ++i) {
+    std::string name;
+    is_ok = reader.get(name);
+    layout_names_.push_back(std::move(name));
+  }
+  is_ok = is_ok && reader.get(flows_) && reader.get(mappings_) &&
+          reader.get(keys_) && reader.get(actions_) &&
+          reader.get(transitions_) && reader.is_end();
+  auto_layout_ = auto_layout != 0;
+  speculative_simul_ = speculative_simul != 0;
+  adaptive_simul_ = adaptive_simul != 0;
+  realtime_option_.lock_memory = lock_memory != 0;
+
+  // 参照先が範囲外の記録がないことを確かめておく。
+  const auto is_valid_range = [](uint32_t first, uint32_t count,
+                                 size_t size) noexcept {
+    return first <= size && count <= size - first;
+  };
+  if (is_ok) {
+    is_ok = (default_layout_ == NO_LAYOUT || is_valid_layout(default_layout_)) &&
+            (default_im_layout_ == NO_LAYOUT ||
+             is_valid_layout(default_im_layout_));
+  }
+  is_ok = is_ok && simul_error_rate_ >= 0.0 && simul_error_rate_ <= 1.0;
+  for (const RealtimeOption::Thread& thread : realtime_option_.threads) {
+    is_ok = is_ok && thread.priority >= 0 && thread.cpu >= -1;
+  }
+  for (size_t i = 0; i < QueueOption::QUEUE_COUNT; ++i) {
+    is_ok = is_ok && QueueOption::is_valid(static_cast<PipelineQueue>(i),
+                                           queue_option_.queues[i]);
+  }
+  for (const FlowRecord& flow : flows_) {
+    is_ok = is_ok && is_valid_layout(flow.layout) && is_valid_flow(flow);
+  }
+  for (const KeyRecord& key : keys_) {
+    is_ok = is_ok && is_valid_key_record(key);
+  }
+  for (const ActionRecord& action : actions_) {
+    is_ok = is_ok && is_valid_action(action);
+  }
+  for (const ActionRecord& action : undo_actions_) {
+    is_ok = is_ok && is_valid_action(action);
+  }
+  for (const MappingRecord& mapping : mappings_) {
+    is_ok = is_ok && is_valid_layout(mapping.layout) &&
+            is_valid_range(mapping.key_first, mapping.key_count,
+                           keys_.size()) &&
+            is_valid_range(mapping.action_first, mapping.action_count,
+                           actions_.size()) &&
+            is_valid_timeout(mapping.timeout_ms);
+  }
+  for (const TransitionRecord& transition : transitions_) {
+    is_ok = is_ok && is_valid_layout(transition.layout) &&
+            is_valid_layout(transition.next_layout) &&
+            is_valid_range(transition.key_first, transition.key_count,
+                           keys_.size());
+  }
+  if (!is_ok) {
+    FUJINAMI_LOG(warn, "broken compiled config (path:{})", path);
+    reset();
+    return false;
+  }
+  return true;
+}
+}  // namespace config
+}  // namespace fujinami
@@ -2,6 +2,7 @@
 #include <string>
 #include <codecvt>
 #include <fstream>
+#include <utility>
 #include <sol.hpp>
 #include <fujinami/platform.hpp>
 #include <fujinami/keyboard_config.hpp>
@@ -11,9 +12,11 @@ namespace fujinami {
 namespace config {
 namespace {
 // package_pathに列挙されたテンプレートを用いてスクリプトを読み込む。
+// 読み込んだスクリプトはコンパイル済みの設定のソースとして記録する。
 sol::object load_script(sol::state_view& lua,
                         const std::string& package_path,
-                        const std::vector<char>& mod_path) {
+                        const std::vector<char>& mod_path,
+                        CompiledConfig& compiled) {
   const auto last = package_path.end();
   auto iter = package_path.begin();
   std::string path;
@@ -46,7 +49,10 @@ sol::object load_script(sol::state_view& lua,
             std::vector<char> code(len);
             if (len > 0) ifs.read(code.data(), code.size());
             const auto result = lua.script(std::string(code.data(), code.size()));
-            if (result.valid()) return result.get<sol::object>();
+            if (result.valid()) {
+              compiled.add_source(path, code.data(), code.size());
+              return result.get<sol::object>();
+            }
           }
 
           path.clear();
@@ -69,9 +75,84 @@ sol::object load_script(sol::state_view& lua,
   assert("UNREACHABLE");
   return sol::nil;
 }
+// コマンドのテーブルを読み、アクションごとにadd_actionを呼ぶ。
+template <typename F>
+void for_each_action(const sol::table& command_tbl, F&& add_action) {
+  command_tbl.for_each([&](const sol::object& i, const sol::table& any_action_tbl) {
+    if (!any_action_tbl.empty()) {
+      switch (any_action_tbl.get<sol::object>(1).get_type()) {
+        case sol::type::number: {
+          const int key = any_action_tbl.get<int>(1);
+          const int modifiers = any_action_tbl.get_or(2, 0);
+          if (key < 0 || key >= int(KEY_COUNT)) throw LoaderError("invalid key");
+          if (modifiers < 0 || modifiers > int(Modifier::ALL)) {
+            throw LoaderError("invalid modifiers");
+          }
+          add_action(CompiledConfig::ActionType::KEY,
+                     static_cast<uint16_t>(key),
+                     static_cast<uint16_t>(modifiers));
+          break;
+        }
+        case sol::type::string: {
+          const auto char_action_str = any_action_tbl.get<std::string>(1);
+#ifdef _MSC_VER
+          std::wstring_convert<std::codecvt_utf8_utf16<int16_t>, int16_t> conv;
+#else
+          std::wstring_convert<std::codecvt_utf8_utf16<char16_t>, char16_t> conv;
+#endif
+          auto str = conv.from_bytes(char_action_str);
+          for (auto c : str) {
+            add_action(CompiledConfig::ActionType::CHAR,
+                       static_cast<uint16_t>(c), uint16_t(0));
+          }
+          break;
+        }
+        default:
+          throw LoaderError("invalid action");
+      }
+    }
+  });
+}
+
+// 標準のrequireで読み込まれたモジュールのファイルもソースとして記録する。
+//
+// package.loadedの名前をpackage.pathのテンプレートに当てはめ、
+// requireと同じく最初に見つかったファイルを記録する。
+void add_loaded_sources(sol::state_view& lua, CompiledConfig& compiled) {
+  const std::string package_path = lua["package"]["path"];
+  const sol::table loaded = lua["package"]["loaded"];
+  loaded.for_each([&](const sol::object& name, const sol::object&) {
+    if (name.get_type() != sol::type::string) return;
+    const std::string modname = name.as<std::string>();
+    std::string path;
+    for (auto iter = package_path.begin();; ++iter) {
+      const char c = iter == package_path.end() ? ';' : *iter;
+      if (c == ';') {
+        if (!path.empty() && compiled.add_source(path)) return;
+        path.clear();
+        if (iter == package_path.end()) return;
+      } else if (c == '?') {
+        for (char m : modname) path.push_back(m == '.' ? '/' : m);
+      } else {
+        path.push_back(c);
+      }
+    }
+  });
+}
+
+// キーやキーセットごとの待ち時間を読む。省略した場合は-1を返す。
+int32_t get_timeout_ms(const sol::optional<int>& timeout_ms) {
+  if (!timeout_ms) return -1;
+  if (*timeout_ms < 0 || *timeout_ms > int(TimeoutOverride::MAX_TIMEOUT_MS)) {
+    throw LoaderError("invalid timeout_milliseconds");
+  }
+  return *timeout_ms;
+}
+}  // namespace
 
 // パス文字列をUnicodeに変換してからスクリプトを読み込む
-sol::object wrequire(sol::this_state self, const std::string& modname) {
+sol::object LuaLoader::wrequire(sol::this_state self,
+                                const std::string& modname) {
   sol::state_view lua(self.L);
 
   const auto& package = lua["package"];
@@ -95,7 +176,7 @@ sol::object wrequire(sol::this_state self, const std::string& modname) {
   const std::string& package_path = package["path"];
 
   // スクリプト読み込みが成功した場合、その戻り値を返す。
-  auto ret = load_script(lua, package_path, mod_path);
+  auto ret = load_script(lua, package_path, mod_path, compiled_);
   if (ret.valid()) {
     preloaded_module = ret;
     return ret;
@@ -127,7 +208,6 @@ sol::object wrequire(sol::this_state self, const std::string& modname) {
 
   throw sol::error(std::move(error_message));
 }
-}  // namespace
 
 LuaLoader::LuaLoader() {}
 
@@ -135,9 +215,8 @@ LuaLoader::~LuaLoader() noexcept {}
 
 void LuaLoader::load(KeyboardConfig& config) {
   config_ = &config;
+  compiled_.reset();
   layout_map_.clear();
-  keys_.clear();
-  roles_.clear();
 
   sol::state lua;
   lua.open_libraries(sol::lib::base, sol::lib::package, sol::lib::coroutine,
@@ -145,7 +224,7 @@ void LuaLoader::load(KeyboardConfig& config) {
                      sol::lib::table, sol::lib::debug, sol::lib::bit32,
                      sol::lib::io, sol::lib::jit, sol::lib::utf8);
 
-  lua.set_function("wrequire", &wrequire);
+  lua.set_function("wrequire", &LuaLoader::wrequire, this);
 
 #if defined(FUJINAMI_PLATFORM_WIN32)
   lua.new_enum("Platform", "NAME", "win32",
@@ -191,6 +270,25 @@ void LuaLoader::load(KeyboardConfig& config) {
   if (!result.valid()) {
     throw LoaderError("failed to load a config file");
   }
+  compiled_.add_source("./fujinami.lua");
+  add_loaded_sources(lua, compiled_);
+
+  compiled_.apply(config);
+}
+
+void LuaLoader::load(KeyboardConfig& config, const std::string& compiled_path) {
+  if (compiled_.load(compiled_path)) {
+    FUJINAMI_LOG(info, "use compiled config (path:{})", compiled_path);
+    compiled_.apply(config);
+    return;
+  }
+
+  load(config);
+  try {
+    compiled_.save(compiled_path);
+  } catch (std::exception& e) {
+    FUJINAMI_LOG(warn, "failed to save compiled config: {}", e.what());
+  }
 }
 
 size_t LuaLoader::get_layout_handle(const std::string& name) {
@@ -203,97 +301,177 @@ void LuaLoader::set_global_option(const sol::table& tbl) {
 
   auto timeout_ms_opt = tbl.get<sol::optional<int>>("timeout_milliseconds");
   if (timeout_ms_opt) {
-    config_->set_timeout_dur(std::chrono::milliseconds(*timeout_ms_opt));
+    if (*timeout_ms_opt < 0) throw LoaderError("invalid timeout_milliseconds");
+    compiled_.set_timeout_milliseconds(*timeout_ms_opt);
   }
   auto default_layout_opt =
       tbl.get<sol::optional<std::string>>("default_layout");
   if (default_layout_opt) {
-    config_->set_default_layout(create_layout(*default_layout_opt)->second);
+    compiled_.set_default_layout(create_layout(*default_layout_opt)->second);
   }
   auto default_im_layout_opt =
       tbl.get<sol::optional<std::string>>("default_im_layout");
   if (default_im_layout_opt) {
-    config_->set_default_im_layout(create_layout(*default_im_layout_opt)->second);
+    compiled_.set_default_im_layout(
+        create_layout(*default_im_layout_opt)->second);
   }
 
   auto auto_layout_opt = tbl.get<sol::optional<bool>>("auto_layout");
   if (auto_layout_opt) {
-    config_->set_auto_layout(*auto_layout_opt);
+    compiled_.set_auto_layout(*auto_layout_opt);
+  }
+
+  // speculative = {enabled = bool, undo = {{Key.BACKSPACE}, ...}}
+  auto speculative_opt = tbl.get<sol::optional<sol::table>>("speculative");
+  if (speculative_opt) {
+    const bool is_enabled = speculative_opt->get_or("enabled", true);
+    auto undo_opt = speculative_opt->get<sol::optional<sol::table>>("undo");
+    size_t undo_action_count = 0;
+    if (undo_opt) {
+      for_each_action(*undo_opt, [&](CompiledConfig::ActionType type,
+                                     uint16_t value, uint16_t modifiers) {
+        compiled_.add_undo_action(type, value, modifiers);
+        ++undo_action_count;
+      });
+    }
+    // 取り消し列がなければ先行出力を取り消せない。
+    if (is_enabled && undo_action_count == 0) {
+      throw LoaderError("speculative undo is empty");
+    }
+    compiled_.set_speculative_simul(is_enabled);
+  }
+
+  // adaptive_simul = {enabled = bool, target_error_rate = number}
+  auto adaptive_simul_opt =
+      tbl.get<sol::optional<sol::table>>("adaptive_simul");
+  if (adaptive_simul_opt) {
+    const bool is_enabled = adaptive_simul_opt->get_or("enabled", true);
+    const double default_error_rate = KeyboardConfig::DEFAULT_SIMUL_ERROR_RATE;
+    const double error_rate =
+        adaptive_simul_opt->get_or("target_error_rate", default_error_rate);
+    if (!(error_rate >= 0.0 && error_rate <= 1.0)) {
+      throw LoaderError("invalid adaptive_simul target_error_rate");
+    }
+    compiled_.set_adaptive_simul(is_enabled, error_rate);
+  }
+
+  // realtime = {lock_memory = bool, hook = {priority = int, cpu = int}, ...}
+  auto realtime_opt = tbl.get<sol::optional<sol::table>>("realtime");
+  if (realtime_opt) {
+    RealtimeOption option = compiled_.realtime_option();
+    auto lock_memory_opt = realtime_opt->get<sol::optional<bool>>("lock_memory");
+    if (lock_memory_opt) option.lock_memory = *lock_memory_opt;
+
+    const std::pair<const char*, PipelineThread> threads[] = {
+        {"hook", PipelineThread::HOOK},
+        {"buffering", PipelineThread::BUFFERING},
+        {"mapping", PipelineThread::MAPPING},
+    };
+    for (const auto& pair : threads) {
+      auto thread_opt = realtime_opt->get<sol::optional<sol::table>>(pair.first);
+      if (!thread_opt) continue;
+      RealtimeOption::Thread& thread = option.thread(pair.second);
+      auto priority_opt = thread_opt->get<sol::optional<int>>("priority");
+      if (priority_opt) {
+        if (*priority_opt < 0 || *priority_opt > 99) {
+          throw LoaderError("invalid realtime priority");
+        }
+        thread.priority = *priority_opt;
+      }
+      auto cpu_opt = thread_opt->get<sol::optional<int>>("cpu");
+      if (cpu_opt) {
+        if (*cpu_opt < -1) throw LoaderError("invalid realtime cpu");
+        thread.cpu = *cpu_opt;
+      }
+    }
+    compiled_.set_realtime_option(option);
+  }
+
+  // queue = {buffering = {capacity = int, overflow = string}, mapping = {...}}
+  auto queue_opt = tbl.get<sol::optional<sol::table>>("queue");
+  if (queue_opt) {
+    QueueOption option = compiled_.queue_option();
+    const std::pair<const char*, PipelineQueue> queues[] = {
+        {"buffering", PipelineQueue::BUFFERING},
+        {"mapping", PipelineQueue::MAPPING},
+    };
+    for (const auto& pair : queues) {
+      auto queue_tbl_opt = queue_opt->get<sol::optional<sol::table>>(pair.first);
+      if (!queue_tbl_opt) continue;
+      QueueOption::Queue& queue = option.queue(pair.second);
+      auto capacity_opt = queue_tbl_opt->get<sol::optional<int>>("capacity");
+      if (capacity_opt) {
+        if (*capacity_opt < static_cast<int>(QueueOption::MIN_CAPACITY) ||
+            *capacity_opt > static_cast<int>(QueueOption::MAX_CAPACITY)) {
+          throw LoaderError("invalid queue capacity");
+        }
+        queue.capacity = static_cast<uint32_t>(*capacity_opt);
+      }
+      auto overflow_opt =
+          queue_tbl_opt->get<sol::optional<std::string>>("overflow");
+      if (overflow_opt) {
+        if (*overflow_opt == "block") {
+          queue.overflow_policy = OverflowPolicy::BLOCK;
+        } else if (*overflow_opt == "drop_repeat") {
+          queue.overflow_policy = OverflowPolicy::DROP_REPEAT;
+        } else if (*overflow_opt == "passthrough") {
+          queue.overflow_policy = OverflowPolicy::PASSTHROUGH;
+        } else {
+          throw LoaderError("invalid queue overflow");
+        }
+      }
+      if (!QueueOption::is_valid(pair.second, queue)) {
+        throw LoaderError("invalid queue option");
+      }
+    }
+    compiled_.set_queue_option(option);
   }
 }
 
-void LuaLoader::create_flow(size_t layout_handle, int key, int flow_type) {
+void LuaLoader::create_flow(size_t layout_handle, int key, int flow_type,
+                            sol::optional<int> timeout_ms) {
   auto iter = layout_map_.find(layout_handle);
   if (iter == layout_map_.end()) throw LoaderError("invalid layout handle");
-  if (key < 0 || key > KEY_COUNT) throw LoaderError("invalid key");
+  if (key < 0 || key >= int(KEY_COUNT)) throw LoaderError("invalid key");
   if (flow_type < int(FlowType::UNKNOWN) ||
       flow_type > int(FlowType::DUAL)) {
     throw LoaderError("invalid flow_type");
   }
-  if (iter->second && key != 0) {
-    iter->second->create_flow(static_cast<Key>(key), static_cast<FlowType>(flow_type));
+  const int32_t timeout = get_timeout_ms(timeout_ms);
+  if (key != 0) {
+    compiled_.add_flow(iter->second, static_cast<Key>(key),
+                       static_cast<FlowType>(flow_type), timeout);
   }
 }
 
 void LuaLoader::create_mapping(size_t layout_handle,
                                const sol::table& active_keys_tbl,
-                               const sol::table& command_tbl) {
+                               const sol::table& command_tbl,
+                               sol::optional<int> timeout_ms) {
   auto iter = layout_map_.find(layout_handle);
   if (iter == layout_map_.end()) throw LoaderError("invalid layout handle");
-  keys_.clear();
-  roles_.clear();
+  compiled_.begin_mapping(iter->second, get_timeout_ms(timeout_ms));
   active_keys_tbl.for_each(
       [&](const sol::object& i, const sol::table& active_key) {
         const int key = active_key.get_or(1, 0);
         const int role = active_key.get_or(2, 0);
-        if (key < 0 || key > KEY_COUNT) throw LoaderError("invalid key");
+        if (key < 0 || key >= int(KEY_COUNT)) throw LoaderError("invalid key");
         if (role < int(KeyRole::NONE) || role > int(KeyRole::MODIFIER)) {
           throw LoaderError("invalid key_role");
         }
         if (key != 0) {
-          keys_.push_back(static_cast<Key>(key));
-          roles_.push_back(static_cast<KeyRole>(role));
+          compiled_.add_mapping_key(static_cast<Key>(key),
+                                    static_cast<KeyRole>(role));
         }
       });
 
-  Command command;
-  command_tbl.for_each([&](const sol::object& i, const sol::table& any_action_tbl) {
-    if (!any_action_tbl.empty()) {
-      const auto action_type = any_action_tbl.get<sol::object>(1).get_type();
-      switch (any_action_tbl.get<sol::object>(1).get_type()) {
-        case sol::type::number: {
-          const int key = any_action_tbl.get<int>(1);
-          const int modifiers = any_action_tbl.get_or(2, 0);
-          if (key < 0 || key > KEY_COUNT) throw LoaderError("invalid key");
-          if (modifiers < 0 || modifiers > int(Modifier::ALL)) {
-            throw LoaderError("invalid modifiers");
-          }
-          command.emplace_back(
-              KeyAction(static_cast<Key>(key), static_cast<Modifier>(modifiers)));
-          break;
-        }
-        case sol::type::string: {
-          const auto char_action_str = any_action_tbl.get<std::string>(1);
-#ifdef _MSC_VER
-          std::wstring_convert<std::codecvt_utf8_utf16<int16_t>, int16_t> conv;
-#else
-          std::wstring_convert<std::codecvt_utf8_utf16<char16_t>, char16_t> conv;
-#endif
-          auto str = conv.from_bytes(char_action_str);
-          for (auto c : str) {
-            command.emplace_back(CharAction(static_cast<char16_t>(c)));
-          }
-          break;
-        }
-        default:
-          throw LoaderError("invalid action");
-      }
-    }
+  for_each_action(command_tbl, [&](CompiledConfig::ActionType type,
+                                   uint16_t value, uint16_t modifiers) {
+    compiled_.add_mapping_action(type, value, modifiers);
   });
 
-  if (iter->second && !keys_.empty() && !command.is_empty()) {
-    iter->second->create_mapping(keys_, roles_, std::move(command));
-  }
+  // キーかアクションが空の場合は登録されない。
+  compiled_.end_mapping();
 }
 
 void LuaLoader::create_next_layout(size_t layout_handle,
@@ -304,12 +482,12 @@ void LuaLoader::create_next_layout(size_t layout_handle,
   Keyset keyset;
   keys_tbl.for_each([&](const sol::object& i, const sol::object& key_obj) {
     int key = key_obj.as<int>();
-    if (key < 0 || key > KEY_COUNT) throw LoaderError("invalid key");
+    if (key < 0 || key >= int(KEY_COUNT)) throw LoaderError("invalid key");
     if (key != 0) keyset += static_cast<Key>(key);
   });
 
-  if (iter->second && keyset && !name.empty()) {
-    iter->second->create_transition(keyset, create_layout(name)->second);
+  if (keyset && !name.empty()) {
+    compiled_.add_transition(iter->second, keyset, create_layout(name)->second);
   }
 }
 
@@ -320,7 +498,7 @@ LuaLoader::LayoutMap::const_iterator LuaLoader::create_layout(const std::string&
   auto iter = layout_map_.find(layout_handle);
   if (iter != layout_map_.end()) return iter;
 
-  auto layout = config_->create_layout(name);
+  const uint32_t layout = compiled_.add_layout(name);
   return layout_map_.emplace(layout_handle, layout).first;
 }
 }  // namespace config
@@ -3,48 +3,86 @@
 #include <fujinami/mapping/engine.hpp>
 
 namespace fujinami {
+namespace {
+// スレッドが何回起きて何回処理したかを出力する。
+void log_stats(const char* name, size_t event_count, size_t update_count,
+               size_t wakeup_count) noexcept {
+  const double wakeups_per_event =
+      event_count > 0 ? double(wakeup_count) / event_count : 0.0;
+  FUJINAMI_LOG(info,
+               "{} thread stats (events:{}, updates:{}, wakeups:{}, "
+               "wakeups/event:{:.2f})",
+               name, event_count, update_count, wakeup_count,
+               wakeups_per_event);
+}
+
+// 先読みの窓が溢れて、判定を待たずに確定した回数を出力する。
+void log_forced_commits(const buffering::Engine& engine) noexcept {
+  const size_t forced_commit_count = engine.forced_commit_count();
+  if (forced_commit_count == 0) return;
+  FUJINAMI_LOG(warn, "event window overflowed (forced_commits:{})",
+               forced_commit_count);
+}
+
+// 先行出力をどれだけ取り消したかを出力する。
+void log_speculation_stats(const buffering::Engine& engine) noexcept {
+  const size_t speculation_count = engine.speculation_count();
+  if (speculation_count == 0) return;
+  const size_t retraction_count = engine.retraction_count();
+  FUJINAMI_LOG(info,
+               "speculation stats (speculations:{}, retractions:{}, "
+               "retraction_rate:{:.3f})",
+               speculation_count, retraction_count,
+               double(retraction_count) / speculation_count);
+}
+
+// 何も学習していなければ、以前に保存したものを残す。
+bool save_timing(const buffering::SimulTiming& timing,
+                 const std::string& path) {
+  if (timing.pair_count() == 0) return true;
+  return timing.save(path);
+}
+}  // namespace
+
 Keyboard::Keyboard()
-    : b_engine_(), b_context_(b_engine_), m_engine_(), m_context_(m_engine_) {}
+    : b_engine_(),
+      b_context_(b_engine_),
+      m_engine_(),
+      m_context_(m_engine_),
+      m_batch_context_(m_context_),
+      m_inline_context_(m_engine_) {}
 
 Keyboard::~Keyboard() noexcept { close(); }
 
-bool Keyboard::open() {
+bool Keyboard::open(KeyboardMode mode, const RealtimeOption& realtime_option,
+                    const QueueOption& queue_option) {
   if (!is_closed_) return true;
-
-  b_thread_ = std::thread([this]() noexcept {
-    using namespace buffering;
-    logging::Logger::init_tls("B");
-    while (true) {
-      if (b_context_.is_closed()) break;
-      if (b_engine_.is_idle()) {
-        AnyEvent event;
-        if (b_context_.receive_event(b_engine_.timeout_tp(), event)) {
-          b_engine_.update(event, m_context_);
-        } else {
-          if (b_context_.is_closed()) break;
-          b_engine_.update(m_context_);
-        }
-      } else {
-        b_engine_.update(m_context_);
-      }
-      std::this_thread::yield();
+  for (size_t i = 0; i < QueueOption::QUEUE_COUNT; ++i) {
+    const auto pipeline_queue = static_cast<PipelineQueue>(i);
+    if (!QueueOption::is_valid(pipeline_queue,
+                               queue_option.queue(pipeline_queue))) {
+      FUJINAMI_LOG(error, "invalid queue option (queue:{})", pipeline_queue);
+      return false;
     }
-  });
+  }
 
-  m_thread_ = std::thread([this]() noexcept {
-    using namespace mapping;
-    logging::Logger::init_tls("M");
-    while (true) {
-      if (m_context_.is_closed()) break;
-      AnyEvent event;
-      if (m_context_.receive_event(event)) {
-        m_engine_.update(event);
-      } else {
-        if (m_context_.is_closed()) break;
-      }
-      std::this_thread::yield();
-    }
-  });
+  // INLINEではスレッドを立てず、send_eventの呼び出し元で処理する。
+  mode_ = mode;
+  if (mode_ == KeyboardMode::INLINE) {
+    inline_pressed_keyset_.reset();
+    is_closed_ = false;
+    return true;
+  }
+
+  realtime_option_ = realtime_option;
+  b_context_.set_option(queue_option.queue(PipelineQueue::BUFFERING));
+  m_context_.set_option(queue_option.queue(PipelineQueue::MAPPING));
+  if (mode_ == KeyboardMode::DRAIN) {
+    b_thread_ = std::thread([this]() noexcept { run_buffering_drain(); });
+  } else {
+    b_thread_ = std::thread([this]() noexcept { run_buffering(); });
+  }
+  m_thread_ = std::thread([this]() noexcept { run_mapping(); });
 
   is_closed_ = false;
   return true;
@@ -52,10 +90,18 @@ bool Keyboard::open() {
 
 void Keyboard::close() noexcept {
   if (!is_closed_) {
+    if (mode_ == KeyboardMode::INLINE) {
+      log_forced_commits(b_engine_);
+      log_speculation_stats(b_engine_);
+      b_engine_.reset();
+      m_engine_.reset();
+    }
     if (b_thread_.joinable()) {
       b_context_.close();
       b_thread_.join();
 
+      log_forced_commits(b_engine_);
+      log_speculation_stats(b_engine_);
       b_context_.reset();
       b_engine_.reset();
     }
@@ -66,11 +112,230 @@ void Keyboard::close() noexcept {
       m_context_.reset();
       m_engine_.reset();
     }
+    if (mode_ != KeyboardMode::INLINE) {
+      FUJINAMI_LOG(info, "queue stats (buffering:{}, mapping:{})",
+                   b_context_.stats(), m_context_.stats());
+    }
+    config_reclaimer_.reset();
+    is_timing_requested_ = false;
+    timing_snapshot_.clear();
+    timing_path_.clear();
     is_closed_ = true;
   }
 }
 
 bool Keyboard::send_event(const buffering::AnyEvent& event) noexcept {
+  if (mode_ == KeyboardMode::INLINE) {
+    if (is_closed_) return false;
+    // 窓が溢れても判定中のフローを確定させて受け入れるので、常にtrueを返す。
+    b_engine_.update(event, m_inline_context_);
+    drain();
+    if (event.type() == buffering::EventType::KEY_PRESS) {
+      inline_pressed_keyset_ += event.as<buffering::KeyPressEvent>().key();
+    } else if (event.type() == buffering::EventType::KEY_RELEASE) {
+      inline_pressed_keyset_ -= event.as<buffering::KeyReleaseEvent>().key();
+    }
+    return true;
+  }
   return b_context_.send_event(event);
 }
+
+bool Keyboard::is_pressed(Key key) const noexcept {
+  if (mode_ == KeyboardMode::INLINE) return inline_pressed_keyset_[key];
+  return b_context_.is_pressed(key);
+}
+
+bool Keyboard::install_config(
+    std::shared_ptr<const KeyboardConfig> config) noexcept {
+  const KeyboardConfig* config_ptr = config.get();
+  const uint64_t epoch = config_reclaimer_.install(std::move(config));
+  const bool is_sent = send_event(buffering::ControlEvent(config_ptr, epoch));
+  collect_configs();
+  return is_sent;
+}
+
+QueueStats Keyboard::queue_stats(PipelineQueue pipeline_queue) const noexcept {
+  switch (pipeline_queue) {
+    case PipelineQueue::BUFFERING:
+      return b_context_.stats();
+    case PipelineQueue::MAPPING:
+      return m_context_.stats();
+  }
+  return QueueStats{};
+}
+
+bool Keyboard::load_simul_timing(const std::string& path) {
+  if (!is_closed_) return false;
+  if (!b_engine_.simul_timing().load(path)) return false;
+  FUJINAMI_LOG(info, "load simul timing (path:{}, pairs:{})", path,
+               b_engine_.simul_timing().pair_count());
+  return true;
+}
+
+bool Keyboard::save_simul_timing(const std::string& path) const {
+  if (!is_closed_) return false;
+  return save_timing(b_engine_.simul_timing(), path);
+}
+
+bool Keyboard::checkpoint_simul_timing(const std::string& path) {
+  if (is_closed_) return save_simul_timing(path);
+  if (mode_ == KeyboardMode::INLINE) {
+    return save_timing(b_engine_.simul_timing(), path);
+  }
+  // 前回頼んだ写しをまだ保存していなければ、それを待つ。
+  if (!timing_path_.empty()) return true;
+  timing_path_ = path;
+  is_timing_requested_.store(true, std::memory_order_release);
+  return true;
+}
+
+void Keyboard::update() noexcept {
+  if (is_closed_) return;
+  if (mode_ == KeyboardMode::INLINE && b_engine_.timeout_tp() <= Clock::now()) {
+    b_engine_.update(m_inline_context_);
+    drain();
+  }
+  collect_configs();
+  save_timing_snapshot();
+}
+
+Clock::time_point Keyboard::timeout_tp() const noexcept {
+  if (is_closed_ || mode_ != KeyboardMode::INLINE) {
+    return Clock::time_point::max();
+  }
+  return b_engine_.timeout_tp();
+}
+
+void Keyboard::run_buffering() noexcept {
+  using namespace buffering;
+  logging::Logger::init_tls("B");
+  apply_realtime_thread(realtime_option_, PipelineThread::BUFFERING);
+  // イベントかタイムアウトでのみ起き、進められる処理がない間は待機する。
+  const size_t begin_wakeup_count = b_context_.wakeup_count();
+  size_t event_count = 0;
+  size_t update_count = 0;
+  while (true) {
+    if (b_context_.is_closed()) break;
+    if (b_engine_.is_idle()) {
+      AnyEvent event;
+      if (b_context_.receive_event(b_engine_.timeout_tp(), event)) {
+        ++event_count;
+        b_engine_.update(event, m_context_);
+      } else {
+        if (b_context_.is_closed()) break;
+        b_engine_.update(m_context_);
+      }
+    } else {
+      b_engine_.update(m_context_);
+    }
+    // 以前の設定を解放できるか、写しを渡したときは呼び出し元を起こす。
+    bool do_wakeup = config_reclaimer_.enter(
+        ConfigReclaimer::Reader::BUFFERING, b_engine_.epoch());
+    if (publish_simul_timing()) do_wakeup = true;
+    if (do_wakeup) wakeup();
+    ++update_count;
+  }
+  log_stats("B", event_count, update_count,
+            b_context_.wakeup_count() - begin_wakeup_count);
+}
+
+void Keyboard::run_buffering_drain() noexcept {
+  using namespace buffering;
+  logging::Logger::init_tls("B");
+  apply_realtime_thread(realtime_option_, PipelineThread::BUFFERING);
+  // 届いているイベントをまとめて取り出し、進められなくなるまで処理してから
+  // 後段へまとめて送る。update_countはまとめて処理した回数を数える。
+  const size_t begin_wakeup_count = b_context_.wakeup_count();
+  size_t event_count = 0;
+  size_t update_count = 0;
+  while (true) {
+    if (b_context_.is_closed()) break;
+    const size_t count = b_context_.receive_events(
+        b_engine_.timeout_tp(), [this](const AnyEvent& event) noexcept {
+          b_engine_.update(event, m_batch_context_);
+        });
+    if (count == 0) {
+      if (b_context_.is_closed()) break;
+      b_engine_.update(m_batch_context_);
+    }
+    b_engine_.drain(m_batch_context_);
+    m_batch_context_.flush();
+    bool do_wakeup = config_reclaimer_.enter(
+        ConfigReclaimer::Reader::BUFFERING, b_engine_.epoch());
+    if (publish_simul_timing()) do_wakeup = true;
+    if (do_wakeup) wakeup();
+    event_count += count;
+    ++update_count;
+  }
+  m_batch_context_.flush();
+  log_stats("B", event_count, update_count,
+            b_context_.wakeup_count() - begin_wakeup_count);
+}
+
+void Keyboard::run_mapping() noexcept {
+  using namespace mapping;
+  logging::Logger::init_tls("M");
+  apply_realtime_thread(realtime_option_, PipelineThread::MAPPING);
+  const size_t begin_wakeup_count = m_context_.wakeup_count();
+  size_t event_count = 0;
+  while (true) {
+    if (m_context_.is_closed()) break;
+    AnyEvent event;
+    if (m_context_.receive_event(event)) {
+      ++event_count;
+      m_engine_.update(event);
+      if (config_reclaimer_.enter(ConfigReclaimer::Reader::MAPPING,
+                                  m_engine_.epoch())) {
+        wakeup();
+      }
+    } else {
+      if (m_context_.is_closed()) break;
+    }
+  }
+  log_stats("M", event_count, event_count,
+            m_context_.wakeup_count() - begin_wakeup_count);
+}
+
+void Keyboard::collect_configs() noexcept {
+  // 現在の設定しか保持していなければ、解放するものはない。
+  if (config_reclaimer_.size() <= 1) return;
+  const size_t count = config_reclaimer_.collect();
+  if (count > 0) FUJINAMI_LOG(debug, "reclaim configs (count:{})", count);
+}
+
+bool Keyboard::publish_simul_timing() noexcept {
+  if (!is_timing_requested_.load(std::memory_order_acquire)) return false;
+  timing_snapshot_ = b_engine_.simul_timing();
+  is_timing_requested_.store(false, std::memory_order_release);
+  return true;
+}
+
+void Keyboard::save_timing_snapshot() noexcept {
+  // 頼んだ写しが届くまでは、BUFFERINGのスレッドが書いている。
+  if (timing_path_.empty() ||
+      is_timing_requested_.load(std::memory_order_acquire)) {
+    return;
+  }
+  try {
+    if (!save_timing(timing_snapshot_, timing_path_)) {
+      FUJINAMI_LOG(warn, "failed to save simul timing (path:{})",
+                   timing_path_);
+    }
+  } catch (std::exception& e) {
+    FUJINAMI_LOG(warn, "failed to save simul timing: {}", e.what());
+  }
+  timing_path_.clear();
+}
+
+void Keyboard::wakeup() noexcept {
+  if (wakeup_) wakeup_();
+}
+
+void Keyboard::drain() noexcept {
+  b_engine_.drain(m_inline_context_);
+  config_reclaimer_.enter(ConfigReclaimer::Reader::BUFFERING,
+                          b_engine_.epoch());
+  config_reclaimer_.enter(ConfigReclaimer::Reader::MAPPING,
+                          m_engine_.epoch());
+}
 }  // namespace fujinami
@@ -6,7 +6,8 @@ namespace mapping {
 Engine::Engine() noexcept {}
 
 Engine::~Engine() noexcept {
-  if (prev_command_) prev_command_->release();
+  if (prev_command_) prev_command_->release(output_);
+  output_.flush();
 }
 
 void Engine::update(const AnyEvent& event) noexcept {
@@ -20,36 +21,41 @@ void Engine::update(const AnyEvent& event) noexcept {
     case EventType::KEY_RELEASE:
       update(event.as<KeyReleaseEvent>());
       break;
-    case EventType::LAYOUT:
-      update(event.as<LayoutEvent>());
+    case EventType::RETRACT:
+      update(event.as<RetractEvent>());
+      break;
+    case EventType::CONFIG:
+      update(event.as<ConfigEvent>());
       break;
   }
+
+  // コマンドの実行で溜めた出力をまとめて送る。
+  output_.flush();
 }
 
 void Engine::reset() noexcept {
   if (prev_command_) {
-    prev_command_->release();
+    prev_command_->release(output_);
     prev_command_ = nullptr;
   }
-  layout_ = nullptr;
+  output_.flush();
+  transition_cache_.reset();
+  epoch_ = 0;
+  config_ = nullptr;
 }
 
 void Engine::update(const KeyPressEvent& event) noexcept {
   FUJINAMI_LOG(debug, "press (event:{})", event);
 
-  const Command* command = nullptr;
-  if (layout_) {
-    command = layout_->find_command(event.active_keyset());
-  }
-
+  const Command* command = event.command();
   FUJINAMI_LOG(trace, "execute command (prev?:{}, next?:{})", prev_command_,
                command);
   if (command) {
-    command->press(prev_command_);
+    transition_cache_.press(prev_command_, *command, output_);
     prev_command_ = command;
   } else {
     if (prev_command_) {
-      prev_command_->release();
+      prev_command_->release(output_);
       prev_command_ = nullptr;
     }
   }
@@ -57,19 +63,15 @@ void Engine::update(const KeyPressEvent& event) noexcept {
 void Engine::update(const KeyRepeatEvent& event) noexcept {
   FUJINAMI_LOG(debug, "repeat (event:{})", event);
 
-  const Command* command = nullptr;
-  if (layout_) {
-    command = layout_->find_command(event.active_keyset());
-  }
-
+  const Command* command = event.command();
   FUJINAMI_LOG(trace, "execute command (prev?:{}, next?:{})", prev_command_,
                command);
   if (command) {
-    command->repeat(prev_command_);
+    transition_cache_.repeat(prev_command_, *command, output_);
     prev_command_ = command;
   } else {
     if (prev_command_) {
-      prev_command_->release();
+      prev_command_->release(output_);
       prev_command_ = nullptr;
     }
   }
@@ -80,14 +82,38 @@ void Engine::update(const KeyReleaseEvent& event) noexcept {
 
   if (prev_command_) {
     FUJINAMI_LOG(trace, "execute command (prev?:{})", prev_command_);
-    prev_command_->release();
+    prev_command_->release(output_);
+    prev_command_ = nullptr;
+  }
+}
+
+void Engine::update(const RetractEvent& event) noexcept {
+  FUJINAMI_LOG(debug, "retract (event:{})", event);
+
+  if (prev_command_) {
+    prev_command_->release(output_);
     prev_command_ = nullptr;
   }
+  if (config_) {
+    // 先行して出力した打鍵や文字を1つずつ取り消す。
+    const Command& undo_command = config_->undo_command();
+    for (uint32_t i = 0; i < event.unit_count(); ++i) {
+      undo_command.press(nullptr, output_);
+      undo_command.release(output_);
+    }
+  }
 }
 
-void Engine::update(const LayoutEvent& event) noexcept {
-  FUJINAMI_LOG(debug, "reset layout (event:{})", event);
-  layout_ = event.layout();
+void Engine::update(const ConfigEvent& event) noexcept {
+  FUJINAMI_LOG(debug, "reset config (event:{})", event);
+
+  // 押したままのコマンドは古い設定のものなので、差し替える前に離す。
+  if (prev_command_) {
+    prev_command_->release(output_);
+    prev_command_ = nullptr;
+  }
+  epoch_ = event.epoch();
+  config_ = event.config();
 }
 }  // namespace mapping
 }  // namespace fujinami
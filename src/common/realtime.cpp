@@ -0,0 +1,119 @@
+﻿#include <fujinami/realtime.hpp>
+#include <fujinami/platform.hpp>
+#if defined(FUJINAMI_PLATFORM_WIN32)
+#include <Windows.h>
+#elif defined(FUJINAMI_PLATFORM_LINUX)
+#include <cerrno>
+#include <cstring>
+#include <malloc.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#endif
+
+namespace fujinami {
+namespace {
+// スタックを先に触っておき、ホットパスでページフォルトが起きないようにする。
+void prefault_stack() noexcept {
+  constexpr size_t PREFAULT_STACK_SIZE = 64 * 1024;
+  volatile char stack[PREFAULT_STACK_SIZE];
+  for (size_t i = 0; i < PREFAULT_STACK_SIZE; i += 4096) stack[i] = 0;
+}
+}  // namespace
+
+#if defined(FUJINAMI_PLATFORM_WIN32)
+bool apply_realtime_thread(const RealtimeOption& option,
+                           PipelineThread pipeline_thread) noexcept {
+  const RealtimeOption::Thread& thread = option.thread(pipeline_thread);
+  bool is_ok = true;
+  if (thread.priority > 0) {
+    if (SetThreadPriority(GetCurrentThread(), THREAD_PRIORITY_TIME_CRITICAL)) {
+      FUJINAMI_LOG(info, "set thread priority (thread:{}, priority:TIME_CRITICAL)",
+                   pipeline_thread);
+    } else {
+      FUJINAMI_LOG(warn, "failed to set thread priority (thread:{}, error:{})",
+                   pipeline_thread, GetLastError());
+      is_ok = false;
+    }
+  }
+  if (thread.cpu >= 0) {
+    const DWORD_PTR mask = DWORD_PTR(1) << thread.cpu;
+    if (thread.cpu < int(sizeof(DWORD_PTR) * 8) &&
+        SetThreadAffinityMask(GetCurrentThread(), mask) != 0) {
+      FUJINAMI_LOG(info, "set thread affinity (thread:{}, cpu:{})",
+                   pipeline_thread, thread.cpu);
+    } else {
+      FUJINAMI_LOG(warn, "failed to set thread affinity (thread:{}, cpu:{})",
+                   pipeline_thread, thread.cpu);
+      is_ok = false;
+    }
+  }
+  if (option.lock_memory) prefault_stack();
+  return is_ok;
+}
+
+bool apply_realtime_memory(const RealtimeOption& option) noexcept {
+  if (!option.lock_memory) return true;
+  FUJINAMI_LOG(warn, "lock_memory is not supported on this platform");
+  return false;
+}
+#elif defined(FUJINAMI_PLATFORM_LINUX)
+bool apply_realtime_thread(const RealtimeOption& option,
+                           PipelineThread pipeline_thread) noexcept {
+  const RealtimeOption::Thread& thread = option.thread(pipeline_thread);
+  bool is_ok = true;
+  if (thread.priority > 0) {
+    sched_param param{};
+    param.sched_priority = thread.priority;
+    const int error = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+    if (error == 0) {
+      FUJINAMI_LOG(info, "set SCHED_FIFO (thread:{}, priority:{})",
+                   pipeline_thread, thread.priority);
+    } else {
+      // 権限がない場合はEPERMになるが、通常のスケジューリングで続行する。
+      FUJINAMI_LOG(warn, "failed to set SCHED_FIFO (thread:{}, error:{})",
+                   pipeline_thread, std::strerror(error));
+      is_ok = false;
+    }
+  }
+  if (thread.cpu >= 0) {
+    cpu_set_t cpu_set;
+    CPU_ZERO(&cpu_set);
+    int error = EINVAL;
+    if (thread.cpu < CPU_SETSIZE) {
+      CPU_SET(thread.cpu, &cpu_set);
+      error = pthread_setaffinity_np(pthread_self(), sizeof(cpu_set), &cpu_set);
+    }
+    if (error == 0) {
+      FUJINAMI_LOG(info, "set thread affinity (thread:{}, cpu:{})",
+                   pipeline_thread, thread.cpu);
+    } else {
+      FUJINAMI_LOG(warn,
+                   "failed to set thread affinity (thread:{}, cpu:{}, error:{})",
+                   pipeline_thread, thread.cpu, std::strerror(error));
+      is_ok = false;
+    }
+  }
+  if (option.lock_memory) prefault_stack();
+  return is_ok;
+}
+
+bool apply_realtime_memory(const RealtimeOption& option) noexcept {
+  if (!option.lock_memory) return true;
+
+  // 解放したメモリをOSへ返さないようにし、再確保でのページフォルトを防ぐ。
+  mallopt(M_TRIM_THRESHOLD, -1);
+  mallopt(M_MMAP_MAX, 0);
+
+  // 確保済みのページ (読み込んだレイアウトやキューを含む) をすべて固定し、
+  // 以降に確保するページも確保した時点で固定する。
+  if (mlockall(MCL_CURRENT | MCL_FUTURE) != 0) {
+    FUJINAMI_LOG(warn, "failed to lock memory (error:{})",
+                 std::strerror(errno));
+    return false;
+  }
+  FUJINAMI_LOG(info, "locked memory");
+  return true;
+}
+#endif
+}  // namespace fujinami
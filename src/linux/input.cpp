@@ -1,8 +1,8 @@
 ﻿#include <cassert>
 #include <cstring>
+#include <ctime>
 #include <fcntl.h>
 #include <unistd.h>
-#include <sys/epoll.h>
 #include <linux/uinput.h>
 #include <fujinami/logging.hpp>
 #include <fujinami_linux/input.hpp>
@@ -41,23 +41,23 @@ class FileDescriptor final {
 };
 }  // namespace
 
-int Input::epfd_ = -1;
 int Input::evfd_ = -1;
 int Input::uifd_ = -1;
+bool Input::is_realtime_ = false;
 
 bool Input::init(gsl::czstring event_path, gsl::czstring uinput_path) noexcept {
   terminate();
 
-  FileDescriptor epfd(epoll_create(1));
-  if (!epfd) return false;
-
   FileDescriptor evfd(open(event_path, O_RDONLY | O_NONBLOCK));
   if (!evfd) return false;
 
-  epoll_event event;
-  event.events = EPOLLIN;
-  event.data.fd = evfd.fd();
-  if (epoll_ctl(epfd.fd(), EPOLL_CTL_ADD, evfd.fd(), &event) < 0) return false;
+  // タイムスタンプをClockと同じCLOCK_MONOTONICにする。
+  // 切り替えられない場合はCLOCK_REALTIMEのまま受け取り、読むときに換算する。
+  int clock_id = CLOCK_MONOTONIC;
+  is_realtime_ = ioctl(evfd.fd(), EVIOCSCLOCKID, &clock_id) < 0;
+  if (is_realtime_) {
+    FUJINAMI_LOG(warn, "failed to set clock id, convert realtime timestamps");
+  }
 
   FileDescriptor uifd(open(uinput_path, O_WRONLY | O_NONBLOCK));
   if (!uifd) return false;
@@ -81,7 +81,6 @@ bool Input::init(gsl::czstring event_path, gsl::czstring uinput_path) noexcept {
 
   if (ioctl(evfd.fd(), EVIOCGRAB, 1) < 0) return false;
 
-  epfd_ = epfd.detach();
   evfd_ = evfd.detach();
   uifd_ = uifd.detach();
   return true;
@@ -90,10 +89,6 @@ bool Input::init(gsl::czstring event_path, gsl::czstring uinput_path) noexcept {
 void Input::terminate() noexcept {
   ioctl(evfd_, EVIOCGRAB, 0);
 
-  if (epfd_ >= 0) {
-    close(epfd_);
-    epfd_ = -1;
-  }
   if (evfd_ >= 0) {
     close(evfd_);
     evfd_ = -1;
@@ -104,31 +99,31 @@ void Input::terminate() noexcept {
   }
 }
 
-bool Input::receive(input_event& event) noexcept {
-  epoll_event ee;
-  if (epoll_wait(epfd_, &ee, 1, -1) != 1) return false;
+size_t Input::receive(gsl::span<input_event> events) noexcept {
+  if (events.empty()) return 0;
 
-  input_event ie;
-  if (read(evfd_, &ie, sizeof(ie)) != sizeof(ie)) return false;
+  // 読み込み可能なイベントを一度にすべて読み込む。
+  const ssize_t size =
+      read(evfd_, events.data(), events.size() * sizeof(input_event));
+  if (size < static_cast<ssize_t>(sizeof(input_event))) return 0;
+  return static_cast<size_t>(size) / sizeof(input_event);
+}
 
-  event = ie;
-  return true;
+Clock::time_point Input::to_time_point(const timeval& tv) noexcept {
+  const Clock::time_point tp(to_duration(tv));
+  if (!is_realtime_) return tp;
+
+  // 現在の両時計の差を引いて、CLOCK_MONOTONICの時刻にする。
+  timespec realtime_ts;
+  timespec monotonic_ts;
+  clock_gettime(CLOCK_REALTIME, &realtime_ts);
+  clock_gettime(CLOCK_MONOTONIC, &monotonic_ts);
+  return tp - std::chrono::duration_cast<Clock::duration>(
+                  to_duration(realtime_ts) - to_duration(monotonic_ts));
 }
 
-void Input::send(__u16 code, __s32 value) noexcept {
-  input_event ie{};
-  gettimeofday(&ie.time, nullptr);
-  ie.type = EV_MSC;
-  ie.code = MSC_SCAN;
-  ie.value = code;
-  write(uifd_, &ie, sizeof(ie));
-  ie.type = EV_KEY;
-  ie.code = code;
-  ie.value = value;
-  write(uifd_, &ie, sizeof(ie));
-  ie.type = EV_SYN;
-  ie.code = SYN_REPORT;
-  ie.value = 0;
-  write(uifd_, &ie, sizeof(ie));
+void Input::send(gsl::span<const input_event> events) noexcept {
+  if (events.empty()) return;
+  write(uifd_, events.data(), events.size() * sizeof(input_event));
 }
 }  // namespace fujinami
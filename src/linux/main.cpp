@@ -1,11 +1,14 @@
-﻿#include <iostream>
-#include <signal.h>
+﻿#include <algorithm>
+#include <array>
+#include <cstring>
+#include <iostream>
 #include <fujinami/logging.hpp>
 #include <fujinami/time.hpp>
 #include <fujinami/keyboard.hpp>
 #include <fujinami/keyboard_config.hpp>
 #include <fujinami/config/loader.hpp>
 #include <fujinami_linux/input.hpp>
+#include <fujinami_linux/reactor.hpp>
 
 namespace f = fujinami;
 namespace fl = fujinami::logging;
@@ -14,14 +17,24 @@ namespace fm = fujinami::mapping;
 namespace fc = fujinami::config;
 
 namespace {
-std::atomic<bool> quit{false};
+// fujinami-compileが書き出すものと同じ
+constexpr const char* COMPILED_CONFIG_PATH = "./fujinami.compiled";
+// 学習したSIMULの判定時間
+constexpr const char* SIMUL_TIMING_PATH = "./fujinami.timing";
+// 異常終了しても学習を失わないよう、この間隔で保存する。
+constexpr auto SIMUL_TIMING_SAVE_INTERVAL = std::chrono::minutes(5);
 std::atomic<bool> do_passthrough{false};
+// SYN_REPORTで区切られたフレームの番号 (0は不明を表すので使わない)
+uint32_t input_frame = 1;
+f::Reactor reactor;
 f::Keyboard keyboard;
 std::shared_ptr<f::KeyboardConfig> keyboard_config;
 }  // namespace
 
 bool init(int, char**) noexcept;
 void terminate() noexcept;
+bool reload_keyboard_config() noexcept;
+void process(const input_event& ie) noexcept;
 
 FUJINAMI_LOGGING_DEFINE_PRINT(inline, input_event, ie,
                               (fl::Separator sep;
@@ -34,71 +47,37 @@ int main(int argc, char* argv[]) {
   // HACK: wait to flush RETURN key event
   sleep(1);
 
-  // set SIGINT handler
-  if (signal(SIGINT, [](int) { quit = true; }) == SIG_ERR) {
-    perror("failed to set SIGINT handler");
+  // シグナルをブロックするので、スレッドを立てる前に初期化する。
+  if (!reactor.init()) {
+    perror("failed to initialize reactor");
     return EXIT_FAILURE;
   }
 
   if (!init(argc, argv)) return EXIT_FAILURE;
 
   // main loop
-  input_event ie;
-  while (!quit) {
-    if (f::Input::receive(ie)) {
-      if (do_passthrough) {
-        if (ie.type == EV_KEY) {
-          switch (ie.code) {
-            case KEY_SCROLLLOCK:
-              if (ie.value == 0) {
-                if (do_passthrough) {
-                  FUJINAMI_LOG(trace, "passthrough disabled (data:{})", ie);
-                } else {
-                  FUJINAMI_LOG(trace, "passthrough enabled (data:{})", ie);
-                }
-                do_passthrough = !do_passthrough;
-              }
-              break;
-            default:
-              f::Input::send_input(ie);
-              break;
-          }
-        } else {
-          f::Input::send_input(ie);
-        }
-      } else {
-        if (ie.type == EV_KEY) {
-          switch (ie.code) {
-            case KEY_SCROLLLOCK:
-              if (ie.value == 0) {
-                if (do_passthrough) {
-                  FUJINAMI_LOG(trace, "passthrough disabled (data:{})", ie);
-                } else {
-                  FUJINAMI_LOG(trace, "passthrough enabled (data:{})", ie);
-                }
-                do_passthrough = !do_passthrough;
-              }
-              break;
-            default:
-              FUJINAMI_LOG(trace, "send event (data:{})", ie);
-
-              const auto time = f::Clock::time_point(f::to_duration(ie.time));
-              const f::Key key = f::to_key(ie.code);
-              if (ie.value == 0) {
-                if (!keyboard.send_event(fb::KeyReleaseEvent(time, key))) {
-                  FUJINAMI_LOG(warn, "queue is full");
-                }
-              } else {
-                if (!keyboard.send_event(fb::KeyPressEvent(time, key))) {
-                  FUJINAMI_LOG(warn, "queue is full");
-                }
-              }
-              break;
-          }
-        }
+  std::array<input_event, 64> ies;
+  f::Clock::time_point save_tp = f::Clock::now() + SIMUL_TIMING_SAVE_INTERVAL;
+  while (true) {
+    // INLINEの場合はタイムアウトを待つ処理があれば、その時刻にタイマーで起きる。
+    // 学習結果を保存する時刻にも起きる。
+    // 各段のスレッドが以前の設定を手放したときや、学習結果の写しを
+    // 渡したときはnotifyで起き、updateで解放や保存を済ませる。
+    reactor.set_timeout(std::min(keyboard.timeout_tp(), save_tp));
+    const f::Reactor::Events events = reactor.wait();
+    if (events.is_any(f::Reactor::Event::QUIT)) break;
+    if (events.is_any(f::Reactor::Event::RELOAD)) reload_keyboard_config();
+    if (events.is_any(f::Reactor::Event::INPUT)) {
+      const size_t count = f::Input::receive(ies);
+      for (size_t i = 0; i < count; ++i) process(ies[i]);
+    }
+    keyboard.update();
+    if (save_tp <= f::Clock::now()) {
+      if (!keyboard.checkpoint_simul_timing(SIMUL_TIMING_PATH)) {
+        FUJINAMI_LOG(warn, "failed to save simul timing");
       }
+      save_tp = f::Clock::now() + SIMUL_TIMING_SAVE_INTERVAL;
     }
-    std::this_thread::yield();
   }
 
   terminate();
@@ -117,37 +96,60 @@ bool init(int argc, char* argv[]) noexcept {
   //}
 
   // コマンドオプション
-  if (argc != 2) {
-    FUJINAMI_LOG(error, "USAGE: fujinami /dev/input/eventX");
+  // --inlineを指定すると、スレッドを分けずに入力スレッドですべて処理する。
+  // --drainを指定すると、溜まったイベントをまとめて処理して後段へ送る。
+  f::KeyboardMode mode = f::KeyboardMode::THREADED;
+  if (argc == 3 && strcmp(argv[1], "--inline") == 0) {
+    mode = f::KeyboardMode::INLINE;
+  } else if (argc == 3 && strcmp(argv[1], "--drain") == 0) {
+    mode = f::KeyboardMode::DRAIN;
+  } else if (argc != 2) {
+    FUJINAMI_LOG(error,
+                 "USAGE: fujinami [--inline|--drain] /dev/input/eventX");
     return false;
   }
-  const char* path = argv[1];
+  const char* path = argv[argc - 1];
 
   // KeyboardLayout
   try {
     keyboard_config = std::make_shared<f::KeyboardConfig>();
     fc::LuaLoader loader;
-    loader.load(*keyboard_config);
+    loader.load(*keyboard_config, COMPILED_CONFIG_PATH);
   } catch (std::exception& e) {
     FUJINAMI_LOG(error, "failed to load config: {}", e.what());
     return false;
   }
 
+  // リアルタイム実行 (適用できなかったものは飛ばして続行する)
+  const f::RealtimeOption& realtime_option = keyboard_config->realtime_option();
+  f::apply_realtime_memory(realtime_option);
+
   // Keyboard
   try {
-    keyboard.open();
-    keyboard.send_event(fb::ControlEvent(keyboard_config));
+    keyboard.load_simul_timing(SIMUL_TIMING_PATH);
+    keyboard.set_wakeup([]() noexcept { reactor.notify(); });
+    keyboard.open(mode, realtime_option, keyboard_config->queue_option());
+    FUJINAMI_LOG(info, "keyboard is opened (mode:{})", mode);
+    keyboard.install_config(keyboard_config);
   } catch (std::exception& e) {
     FUJINAMI_LOG(error, "failed to open a keyboard: {}", e.what());
     return false;
   }
 
+  // 立てたスレッドが優先度とCPUを引き継がないよう、openの後で適用する。
+  f::apply_realtime_thread(realtime_option, f::PipelineThread::HOOK);
+
   // keyboard hook
   if (!f::Input::init(path, "/dev/uinput")) {
     perror("hook");
     FUJINAMI_LOG(error, "failed to enable keyboard hook");
     return false;
   }
+  if (!reactor.add_input(f::Input::fd())) {
+    perror("reactor");
+    FUJINAMI_LOG(error, "failed to watch keyboard input");
+    return false;
+  }
 
   return true;
 }
@@ -158,8 +160,101 @@ void terminate() noexcept {
 
   // Keyboard
   keyboard.close();
+  if (!keyboard.save_simul_timing(SIMUL_TIMING_PATH)) {
+    FUJINAMI_LOG(warn, "failed to save simul timing");
+  }
   keyboard_config = nullptr;
 
+  // reactor
+  reactor.terminate();
+
   // ロガー
   fl::Logger::terminate();
 }
+
+bool reload_keyboard_config() noexcept {
+  FUJINAMI_LOG(debug, "load new config");
+  std::shared_ptr<f::KeyboardConfig> new_keyboard_config;
+  try {
+    new_keyboard_config = std::make_shared<f::KeyboardConfig>();
+    fc::LuaLoader loader;
+    loader.load(*new_keyboard_config, COMPILED_CONFIG_PATH);
+  } catch (std::exception& e) {
+    FUJINAMI_LOG(error, "failed to reload: {}", e.what());
+    return false;
+  }
+
+  keyboard.install_config(new_keyboard_config);
+  keyboard_config = std::move(new_keyboard_config);
+  return true;
+}
+
+void process(const input_event& ie) noexcept {
+  // 同じフレームのキーは同時に押したものとして扱えるよう、番号を付けて送る。
+  if (ie.type == EV_SYN && ie.code == SYN_REPORT) {
+    if (++input_frame == 0) input_frame = 1;
+  }
+
+  if (do_passthrough) {
+    if (ie.type == EV_KEY) {
+      switch (ie.code) {
+        case KEY_SCROLLLOCK:
+          if (ie.value == 0) {
+            if (do_passthrough) {
+              FUJINAMI_LOG(trace, "passthrough disabled (data:{})", ie);
+            } else {
+              FUJINAMI_LOG(trace, "passthrough enabled (data:{})", ie);
+            }
+            do_passthrough = !do_passthrough;
+          }
+          break;
+        default: {
+          // 素通しに切り替える前に送ったキーは、離すイベントも送る。
+          // 素通しにすると後段ではキーが押されたままになる。
+          const f::Key key = f::to_key(ie.code);
+          if (ie.value == 0 && keyboard.is_pressed(key) &&
+              keyboard.send_event(fb::KeyReleaseEvent(
+                  f::Input::to_time_point(ie.time), key))) {
+            break;
+          }
+          f::Input::send_input(ie);
+          break;
+        }
+      }
+    } else {
+      f::Input::send_input(ie);
+    }
+  } else {
+    if (ie.type == EV_KEY) {
+      switch (ie.code) {
+        case KEY_SCROLLLOCK:
+          if (ie.value == 0) {
+            if (do_passthrough) {
+              FUJINAMI_LOG(trace, "passthrough disabled (data:{})", ie);
+            } else {
+              FUJINAMI_LOG(trace, "passthrough enabled (data:{})", ie);
+            }
+            do_passthrough = !do_passthrough;
+          }
+          break;
+        default:
+          FUJINAMI_LOG(trace, "send event (data:{})", ie);
+
+          const auto time = f::Input::to_time_point(ie.time);
+          const f::Key key = f::to_key(ie.code);
+          const bool is_sent =
+              ie.value == 0
+                  ? keyboard.send_event(fb::KeyReleaseEvent(time, key))
+                  : keyboard.send_event(
+                        fb::KeyPressEvent(time, key, input_frame));
+          if (!is_sent) {
+            // 詰まったキューを待たず、以降の入力を素通しにする。
+            FUJINAMI_LOG(warn, "queue is full, passthrough enabled");
+            do_passthrough = true;
+            f::Input::send_input(ie);
+          }
+          break;
+      }
+    }
+  }
+}
@@ -0,0 +1,126 @@
+﻿#include <array>
+#include <cerrno>
+#include <csignal>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
+#include <fujinami/logging.hpp>
+#include <fujinami_linux/reactor.hpp>
+
+namespace fujinami {
+namespace {
+sigset_t make_sigset() noexcept {
+  sigset_t sigset;
+  sigemptyset(&sigset);
+  sigaddset(&sigset, SIGINT);
+  sigaddset(&sigset, SIGTERM);
+  sigaddset(&sigset, SIGHUP);
+  return sigset;
+}
+
+bool add_fd(int epfd, int fd) noexcept {
+  epoll_event event{};
+  event.events = EPOLLIN;
+  event.data.fd = fd;
+  return epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &event) == 0;
+}
+
+void close_fd(int& fd) noexcept {
+  if (fd >= 0) {
+    close(fd);
+    fd = -1;
+  }
+}
+}  // namespace
+
+bool Reactor::init() noexcept {
+  terminate();
+
+  // シグナルはsignalfdで受け取るので、このスレッドと以降に立てるスレッドでは
+  // ブロックしておく。
+  const sigset_t sigset = make_sigset();
+  if (pthread_sigmask(SIG_BLOCK, &sigset, nullptr) != 0) return false;
+
+  epfd_ = epoll_create1(EPOLL_CLOEXEC);
+  tmfd_ = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+  sigfd_ = signalfd(-1, &sigset, SFD_NONBLOCK | SFD_CLOEXEC);
+  evfd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (epfd_ < 0 || tmfd_ < 0 || sigfd_ < 0 || evfd_ < 0 ||
+      !add_fd(epfd_, tmfd_) || !add_fd(epfd_, sigfd_) ||
+      !add_fd(epfd_, evfd_)) {
+    terminate();
+    return false;
+  }
+  timeout_tp_ = Clock::time_point::max();
+  return true;
+}
+
+void Reactor::terminate() noexcept {
+  close_fd(epfd_);
+  close_fd(tmfd_);
+  close_fd(sigfd_);
+  close_fd(evfd_);
+}
+
+bool Reactor::add_input(int fd) noexcept {
+  return epfd_ >= 0 && fd >= 0 && add_fd(epfd_, fd);
+}
+
+void Reactor::set_timeout(const Clock::time_point& timeout_tp) noexcept {
+  if (timeout_tp == timeout_tp_) return;
+  timeout_tp_ = timeout_tp;
+
+  // 0を指定するとタイマーが止まるので、過ぎた時刻は1nsにする。
+  itimerspec spec{};
+  if (timeout_tp < Clock::time_point::max()) {
+    spec.it_value = to_timespec(timeout_tp.time_since_epoch());
+    if (spec.it_value.tv_sec == 0 && spec.it_value.tv_nsec == 0) {
+      spec.it_value.tv_nsec = 1;
+    }
+  }
+  timerfd_settime(tmfd_, TFD_TIMER_ABSTIME, &spec, nullptr);
+}
+
+void Reactor::notify() noexcept {
+  const uint64_t value = 1;
+  write(evfd_, &value, sizeof(value));
+}
+
+Reactor::Events Reactor::wait() noexcept {
+  std::array<epoll_event, 8> ees;
+  int count;
+  do {
+    count = epoll_wait(epfd_, ees.data(), static_cast<int>(ees.size()), -1);
+  } while (count < 0 && errno == EINTR);
+
+  Events events;
+  for (int i = 0; i < count; ++i) {
+    const int fd = ees[i].data.fd;
+    if (fd == tmfd_) {
+      uint64_t expirations;
+      if (read(tmfd_, &expirations, sizeof(expirations)) > 0) {
+        // 同じ時刻では再びセットし直せるよう、覚えている時刻を捨てる。
+        timeout_tp_ = Clock::time_point::max();
+        events += Event::TIMEOUT;
+      }
+    } else if (fd == sigfd_) {
+      signalfd_siginfo info;
+      while (read(sigfd_, &info, sizeof(info)) == sizeof(info)) {
+        if (info.ssi_signo == SIGHUP) {
+          events += Event::RELOAD;
+        } else {
+          events += Event::QUIT;
+        }
+      }
+    } else if (fd == evfd_) {
+      uint64_t value;
+      if (read(evfd_, &value, sizeof(value)) > 0) events += Event::WAKEUP;
+    } else {
+      events += Event::INPUT;
+    }
+  }
+  return events;
+}
+}  // namespace fujinami
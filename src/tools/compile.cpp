@@ -0,0 +1,43 @@
+﻿// 設定スクリプトを評価して、コンパイル済みの設定を書き出す
+//
+// USAGE: fujinami-compile [OUTPUT]
+// 設定スクリプトはfujinami本体と同じくカレントディレクトリから読み込む。
+#include <cstdio>
+#include <cstdlib>
+#include <exception>
+#include <string>
+#include <fujinami/logging.hpp>
+#include <fujinami/keyboard_config.hpp>
+#include <fujinami/config/loader.hpp>
+
+namespace f = fujinami;
+namespace fl = fujinami::logging;
+namespace fc = fujinami::config;
+
+int main(int argc, char* argv[]) {
+  if (argc > 2) {
+    std::fprintf(stderr, "USAGE: fujinami-compile [OUTPUT]\n");
+    return EXIT_FAILURE;
+  }
+  const std::string path = argc == 2 ? argv[1] : "./fujinami.compiled";
+
+  fl::Logger::init();
+  fl::Logger::init_tls("C");
+
+  int result = EXIT_SUCCESS;
+  try {
+    f::KeyboardConfig config;
+    fc::LuaLoader loader;
+    loader.load(config);
+    loader.compiled().save(path);
+    std::printf("%s: %zu layouts, %zu mappings\n", path.c_str(),
+                loader.compiled().layout_count(),
+                loader.compiled().mapping_count());
+  } catch (std::exception& e) {
+    std::fprintf(stderr, "failed to compile config: %s\n", e.what());
+    result = EXIT_FAILURE;
+  }
+
+  fl::Logger::terminate();
+  return result;
+}
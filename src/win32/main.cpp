@@ -16,7 +16,16 @@ namespace fc = fujinami::config;
 namespace fh = fujinami_hook;
 
 namespace {
+// fujinami-compileが書き出すものと同じ
+constexpr const char* COMPILED_CONFIG_PATH = "./fujinami.compiled";
+// 学習したSIMULの判定時間
+constexpr const char* SIMUL_TIMING_PATH = "./fujinami.timing";
+// 異常終了しても学習を失わないよう、この間隔で保存する。
+constexpr UINT SIMUL_TIMING_SAVE_INTERVAL_MS = 5 * 60 * 1000;
 constexpr UINT WM_APP_NOTIFICATION = WM_APP + 1;
+// Keyboardの各段のスレッドから起こされたときに届く
+constexpr UINT WM_APP_WAKEUP = WM_APP + 2;
+constexpr UINT_PTR SIMUL_TIMING_TIMER_ID = 1;
 
 #ifdef DEVEL
 const wchar_t* const TITLE = L"fujinami (devel)";
@@ -115,23 +124,51 @@ bool init(HINSTANCE hinstance) noexcept {
   try {
     keyboard_config = std::make_shared<f::KeyboardConfig>();
     fc::LuaLoader loader;
-    loader.load(*keyboard_config);
+    loader.load(*keyboard_config, COMPILED_CONFIG_PATH);
   } catch (std::exception& e) {
     FUJINAMI_LOG(error, "failed to load: {}", e.what());
     keyboard_config.reset();
     do_passthrough = true;
   }
 
+  // リアルタイム実行 (適用できなかったものは飛ばして続行する)
+  // フックはこのスレッドで呼ばれる。
+  f::RealtimeOption realtime_option;
+  f::QueueOption queue_option;
+  if (keyboard_config) {
+    realtime_option = keyboard_config->realtime_option();
+    queue_option = keyboard_config->queue_option();
+  }
+  // 低レベルフックはLowLevelHooksTimeoutを超えるとOSに外されるので、
+  // フックのスレッドを待たせるoverflow_policyは使わない。
+  f::QueueOption::Queue& b_queue =
+      queue_option.queue(f::PipelineQueue::BUFFERING);
+  if (b_queue.overflow_policy != f::OverflowPolicy::PASSTHROUGH) {
+    FUJINAMI_LOG(info, "use PASSTHROUGH for buffering queue (policy:{})",
+                 b_queue.overflow_policy);
+    b_queue.overflow_policy = f::OverflowPolicy::PASSTHROUGH;
+  }
+  f::apply_realtime_memory(realtime_option);
+
   // Keyboard
   try {
-    keyboard.open();
-    keyboard.send_event(fb::ControlEvent(keyboard_config));
+    keyboard.load_simul_timing(SIMUL_TIMING_PATH);
+    keyboard.set_wakeup(
+        []() noexcept { PostMessage(hwnd, WM_APP_WAKEUP, 0, 0); });
+    keyboard.open(f::KeyboardMode::THREADED, realtime_option, queue_option);
+    keyboard.install_config(keyboard_config);
   } catch (std::exception& e) {
     FUJINAMI_LOG(error, "failed to open a keyboard: {}", e.what());
     delete_notification_icon();
     return false;
   }
 
+  // 立てたスレッドが優先度とCPUを引き継がないよう、openの後で適用する。
+  f::apply_realtime_thread(realtime_option, f::PipelineThread::HOOK);
+
+  // 学習結果の定期的な保存
+  SetTimer(hwnd, SIMUL_TIMING_TIMER_ID, SIMUL_TIMING_SAVE_INTERVAL_MS, NULL);
+
   // keyboard hook
   kbdll_hhook = fh::Enable(WH_KEYBOARD_LL, kbdll_hook_proc, 0);
   if (!kbdll_hhook) {
@@ -157,7 +194,11 @@ void terminate(HINSTANCE hinstance) noexcept {
   kbdll_hhook = NULL;
 
   // Keyboard
+  KillTimer(hwnd, SIMUL_TIMING_TIMER_ID);
   keyboard.close();
+  if (!keyboard.save_simul_timing(SIMUL_TIMING_PATH)) {
+    FUJINAMI_LOG(warn, "failed to save simul timing");
+  }
 
   // 通知アイコン
   delete_notification_icon();
@@ -265,13 +306,14 @@ bool reload_keyboard_config() {
   try {
     new_keyboard_config = std::make_shared<f::KeyboardConfig>();
     fc::LuaLoader loader;
-    loader.load(*new_keyboard_config);
+    loader.load(*new_keyboard_config, COMPILED_CONFIG_PATH);
   } catch (std::exception& e) {
     FUJINAMI_LOG(error, "failed to reload: {}", e.what());
     return false;
   }
 
-  keyboard.send_event(fb::ControlEvent(new_keyboard_config));
+  // 以前の設定がまだ参照されていれば、WM_APP_WAKEUPで改めて解放する。
+  keyboard.install_config(new_keyboard_config);
   update_notification_menu(*new_keyboard_config);
   keyboard_config = std::move(new_keyboard_config);
   return true;
@@ -352,18 +394,31 @@ LRESULT CALLBACK kbdll_hook_proc(int code, WPARAM wparam,
         } else {
           const f::Key key = f::to_key(static_cast<WORD>(data->vkCode),
                                        !!(data->flags & LLKHF_EXTENDED));
-          if (data->flags & LLKHF_UP) {
-            if (!keyboard.send_event(fb::KeyReleaseEvent(time, key))) {
-              FUJINAMI_LOG(warn, "queue is full");
-            }
-          } else {
-            if (!keyboard.send_event(fb::KeyPressEvent(time, key))) {
-              FUJINAMI_LOG(warn, "queue is full");
-            }
+          const bool is_sent =
+              (data->flags & LLKHF_UP)
+                  ? keyboard.send_event(fb::KeyReleaseEvent(time, key))
+                  : keyboard.send_event(fb::KeyPressEvent(time, key));
+          if (!is_sent) {
+            // フックを長く止めるとOSに外されるので、待たずに素通しにする。
+            FUJINAMI_LOG(warn, "queue is full, passthrough enabled");
+            do_passthrough = true;
+            break;
           }
         }
         return TRUE;
       }
+
+      // 素通しに切り替える前に送ったキーは、離すイベントも送る。
+      // 素通しにすると後段ではキーが押されたままになる。
+      if (data->flags & LLKHF_UP) {
+        const f::Key key = f::to_key(static_cast<WORD>(data->vkCode),
+                                     !!(data->flags & LLKHF_EXTENDED));
+        const auto time = f::Clock::time_point(f::Clock::duration(data->time));
+        if (keyboard.is_pressed(key) &&
+            keyboard.send_event(fb::KeyReleaseEvent(time, key))) {
+          return TRUE;
+        }
+      }
       break;
     }
   }
@@ -379,18 +434,18 @@ LRESULT CALLBACK window_proc(HWND hwnd, UINT msg, WPARAM wparam,
         const size_t i = id - IDM_LAYOUT0;
         if (keyboard_config) {
           keyboard_config->set_default_layout(keyboard_config->layout(i));
-          keyboard.send_event(
-              fb::DefaultLayoutEvent(keyboard_config->default_layout(),
-                                     keyboard_config->default_im_layout()));
+          keyboard.send_event(fb::DefaultLayoutEvent(
+              keyboard_config->default_layout().get(),
+              keyboard_config->default_im_layout().get()));
           update_notification_menu(*keyboard_config);
         }
       } else if (id >= IDM_IM_LAYOUT0 && id <= IDM_IM_LAYOUT_MAX) {
         const size_t i = id - IDM_IM_LAYOUT0;
         if (keyboard_config) {
           keyboard_config->set_default_im_layout(keyboard_config->layout(i));
-          keyboard.send_event(
-              fb::DefaultLayoutEvent(keyboard_config->default_layout(),
-                                     keyboard_config->default_im_layout()));
+          keyboard.send_event(fb::DefaultLayoutEvent(
+              keyboard_config->default_layout().get(),
+              keyboard_config->default_im_layout().get()));
           update_notification_menu(*keyboard_config);
         }
       }
@@ -412,6 +467,19 @@ LRESULT CALLBACK window_proc(HWND hwnd, UINT msg, WPARAM wparam,
       }
       return 0;
     }
+    case WM_TIMER: {
+      if (wparam == SIMUL_TIMING_TIMER_ID) {
+        if (!keyboard.checkpoint_simul_timing(SIMUL_TIMING_PATH)) {
+          FUJINAMI_LOG(warn, "failed to save simul timing");
+        }
+      }
+      return 0;
+    }
+    case WM_APP_WAKEUP: {
+      // 差し替えた設定の解放と、届いた学習結果の写しの保存を済ませる。
+      keyboard.update();
+      return 0;
+    }
     case WM_APP_NOTIFICATION: {
       switch (LOWORD(lparam)) {
         case WM_CONTEXTMENU: {
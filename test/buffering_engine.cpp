@@ -0,0 +1,436 @@
+﻿#include <catch.hpp>
+#include <initializer_list>
+#include <utility>
+#include <vector>
+#include <fujinami/buffering/engine.hpp>
+#include <fujinami/mapping/context.hpp>
+
+using namespace std::chrono_literals;
+using namespace fujinami;
+using namespace fujinami::buffering;
+
+namespace {
+// 後段のEngineの代わりに受け取ったイベントを記録する
+struct Recorder final {
+  void update(const mapping::AnyEvent& event) {
+    types.push_back(event.type());
+    switch (event.type()) {
+      case mapping::EventType::KEY_PRESS:
+        commands.push_back(event.as<mapping::KeyPressEvent>().command());
+        break;
+      case mapping::EventType::KEY_REPEAT:
+        commands.push_back(event.as<mapping::KeyRepeatEvent>().command());
+        break;
+      case mapping::EventType::RETRACT:
+        unit_counts.push_back(event.as<mapping::RetractEvent>().unit_count());
+        commands.push_back(nullptr);
+        break;
+      case mapping::EventType::CONFIG:
+        config = event.as<mapping::ConfigEvent>().config();
+        epoch = event.as<mapping::ConfigEvent>().epoch();
+        commands.push_back(nullptr);
+        break;
+      default:
+        commands.push_back(nullptr);
+        break;
+    }
+  }
+
+  std::vector<mapping::EventType> types;
+  std::vector<const Command*> commands;
+  std::vector<uint32_t> unit_counts;
+  const KeyboardConfig* config = nullptr;
+  uint64_t epoch = 0;
+};
+
+// キューを介して後段へ送る
+struct QueuedPipeline final {
+  void flush() {
+    mapping::AnyEvent event;
+    while (context.try_receive_event(event)) recorder.update(event);
+  }
+
+  Recorder recorder;
+  mapping::Context context;
+};
+
+// 溜めたイベントをまとめて後段へ送る
+struct BatchPipeline final {
+  void flush() {
+    context.flush();
+    mapping::AnyEvent event;
+    while (queue.try_receive_event(event)) recorder.update(event);
+  }
+
+  Recorder recorder;
+  mapping::Context queue;
+  mapping::BatchContext context{queue};
+};
+
+// 後段を直接呼び出す
+struct InlinePipeline final {
+  void flush() {}
+
+  Recorder recorder;
+  mapping::BasicInlineContext<Recorder> context{recorder};
+};
+
+// Keyboardと同じ手順でイベントを流し、後段が受け取ったイベントを返す。
+template <typename Pipeline>
+Recorder run(const std::shared_ptr<KeyboardConfig>& config,
+             const std::vector<AnyEvent>& events) {
+  Engine engine;
+  Pipeline pipeline;
+  const auto step = [&]() {
+    engine.drain(pipeline.context);
+    if (engine.timeout_tp() <= Clock::now()) engine.update(pipeline.context);
+    pipeline.flush();
+  };
+  engine.update(AnyEvent(ControlEvent(config.get(), 1)), pipeline.context);
+  step();
+  for (const AnyEvent& event : events) {
+    engine.update(event, pipeline.context);
+    step();
+  }
+  return std::move(pipeline.recorder);
+}
+}  // namespace
+
+TEST_CASE("buffering::Engine", "[fujinami][buffering]") {
+  const Key simul_key = to_key(1);
+  const Key immediate_key = to_key(2);
+  const Keyset simul_keyset{simul_key};
+  const Keyset immediate_keyset{immediate_key};
+
+  auto config = std::make_shared<KeyboardConfig>();
+  config->set_timeout_dur(50ms);
+  auto layout = config->create_layout("layout");
+  layout->create_flow(simul_key, FlowType::SIMUL);
+  layout->create_flow(immediate_key, FlowType::IMMEDIATE);
+  layout->create_mapping({simul_key}, {KeyRole::TRIGGER}, Command{});
+  layout->create_mapping({immediate_key}, {KeyRole::TRIGGER}, Command{});
+  config->set_default_layout(layout);
+
+  // SIMULのキーは組み合わせ可能なキーがないので、待たずに確定する。
+  const auto begin_tp = Clock::now() - 1s;
+  const std::vector<AnyEvent> events{
+      KeyPressEvent(begin_tp, immediate_key),
+      KeyReleaseEvent(begin_tp + 10ms, immediate_key),
+      KeyPressEvent(begin_tp + 20ms, simul_key),
+      KeyReleaseEvent(begin_tp + 200ms, simul_key),
+  };
+  const std::vector<mapping::EventType> expected_types{
+      mapping::EventType::CONFIG,      mapping::EventType::KEY_PRESS,
+      mapping::EventType::KEY_RELEASE, mapping::EventType::KEY_PRESS,
+      mapping::EventType::KEY_RELEASE,
+  };
+  const std::vector<const Command*> expected_commands{
+      nullptr, layout->find_keyset_entry(immediate_keyset)->command(), nullptr,
+      layout->find_keyset_entry(simul_keyset)->command(), nullptr,
+  };
+
+  SECTION("queued") {
+    const Recorder recorder = run<QueuedPipeline>(config, events);
+    REQUIRE(recorder.types == expected_types);
+    REQUIRE(recorder.commands == expected_commands);
+    REQUIRE(recorder.config == config.get());
+    REQUIRE(recorder.epoch == 1);
+  }
+
+  SECTION("batch") {
+    const Recorder recorder = run<BatchPipeline>(config, events);
+    REQUIRE(recorder.types == expected_types);
+    REQUIRE(recorder.commands == expected_commands);
+    REQUIRE(recorder.config == config.get());
+    REQUIRE(recorder.epoch == 1);
+  }
+
+  SECTION("inline") {
+    const Recorder recorder = run<InlinePipeline>(config, events);
+    REQUIRE(recorder.types == expected_types);
+    REQUIRE(recorder.commands == expected_commands);
+    REQUIRE(recorder.config == config.get());
+    REQUIRE(recorder.epoch == 1);
+  }
+}
+
+TEST_CASE("buffering::Engine speculative", "[fujinami][buffering]") {
+  const Key left_key = to_key(1);
+  const Key right_key = to_key(2);
+  const Key multi_key = to_key(3);
+
+  auto config = std::make_shared<KeyboardConfig>();
+  config->set_timeout_dur(50ms);
+  config->set_speculative_simul(true);
+  auto layout = config->create_layout("layout");
+  layout->create_flow(left_key, FlowType::SIMUL);
+  layout->create_flow(right_key, FlowType::SIMUL);
+  layout->create_flow(multi_key, FlowType::SIMUL);
+  const Key enter_key = to_key(4);
+  const auto create_command = [](std::initializer_list<__u16> codes) {
+    Command command;
+    for (__u16 code : codes) {
+      command.emplace_back(KeyAction(to_key(code), Modifiers{}));
+    }
+    return command;
+  };
+  layout->create_flow(enter_key, FlowType::SIMUL);
+  layout->create_mapping({left_key}, {KeyRole::TRIGGER},
+                         create_command({KEY_A}));
+  layout->create_mapping({right_key}, {KeyRole::TRIGGER},
+                         create_command({KEY_B}));
+  layout->create_mapping({multi_key}, {KeyRole::TRIGGER},
+                         create_command({KEY_D, KEY_E}));
+  layout->create_mapping({enter_key}, {KeyRole::TRIGGER},
+                         create_command({KEY_ENTER}));
+  layout->create_mapping({left_key, right_key},
+                         {KeyRole::TRIGGER, KeyRole::TRIGGER},
+                         create_command({KEY_C}));
+  layout->create_mapping({multi_key, right_key},
+                         {KeyRole::TRIGGER, KeyRole::TRIGGER},
+                         create_command({KEY_F}));
+  layout->create_mapping({enter_key, right_key},
+                         {KeyRole::TRIGGER, KeyRole::TRIGGER},
+                         create_command({KEY_G}));
+  config->set_default_layout(layout);
+  const Command* left_command =
+      layout->find_keyset_entry(Keyset{left_key})->command();
+  const Command* chord_command =
+      layout->find_keyset_entry(Keyset{left_key, right_key})->command();
+
+  // 時間切れにならないよう、イベント時刻を先に置く。
+  const auto begin_tp = Clock::now() + 1h;
+
+  SECTION("confirmed") {
+    const Recorder recorder = run<InlinePipeline>(
+        config, {
+                    KeyPressEvent(begin_tp, left_key),
+                    KeyReleaseEvent(begin_tp + 10ms, left_key),
+                });
+    REQUIRE(recorder.types == std::vector<mapping::EventType>{
+                                  mapping::EventType::CONFIG,
+                                  mapping::EventType::KEY_PRESS,
+                                  mapping::EventType::KEY_RELEASE,
+                              });
+    REQUIRE(recorder.commands[1] == left_command);
+  }
+
+  SECTION("retracted") {
+    const Recorder recorder = run<QueuedPipeline>(
+        config, {
+                    KeyPressEvent(begin_tp, left_key),
+                    KeyPressEvent(begin_tp + 5ms, right_key),
+                    KeyReleaseEvent(begin_tp + 30ms, left_key),
+                    KeyReleaseEvent(begin_tp + 31ms, right_key),
+                });
+    REQUIRE(recorder.types.size() == 5);
+    REQUIRE(recorder.types[1] == mapping::EventType::KEY_PRESS);
+    REQUIRE(recorder.commands[1] == left_command);
+    REQUIRE(recorder.types[2] == mapping::EventType::RETRACT);
+    REQUIRE(recorder.unit_counts == std::vector<uint32_t>{1});
+    REQUIRE(recorder.types[3] == mapping::EventType::KEY_PRESS);
+    REQUIRE(recorder.commands[3] == chord_command);
+    REQUIRE(recorder.types[4] == mapping::EventType::KEY_RELEASE);
+  }
+
+  SECTION("retracted multiple actions") {
+    // 2文字を先行して出力したので、2単位を取り消す。
+    const Recorder recorder = run<QueuedPipeline>(
+        config, {
+                    KeyPressEvent(begin_tp, multi_key),
+                    KeyPressEvent(begin_tp + 5ms, right_key),
+                    KeyReleaseEvent(begin_tp + 30ms, multi_key),
+                    KeyReleaseEvent(begin_tp + 31ms, right_key),
+                });
+    REQUIRE(recorder.types.size() == 5);
+    REQUIRE(recorder.types[1] == mapping::EventType::KEY_PRESS);
+    REQUIRE(recorder.commands[1] ==
+            layout->find_keyset_entry(Keyset{multi_key})->command());
+    REQUIRE(recorder.types[2] == mapping::EventType::RETRACT);
+    REQUIRE(recorder.unit_counts == std::vector<uint32_t>{2});
+    REQUIRE(recorder.types[3] == mapping::EventType::KEY_PRESS);
+    REQUIRE(recorder.commands[3] ==
+            layout->find_keyset_entry(Keyset{multi_key, right_key})->command());
+  }
+
+  SECTION("not speculated") {
+    // Enterは文字を入力しないので取り消せず、先行して出力しない。
+    const Recorder recorder = run<QueuedPipeline>(
+        config, {
+                    KeyPressEvent(begin_tp, enter_key),
+                    KeyPressEvent(begin_tp + 5ms, right_key),
+                    KeyReleaseEvent(begin_tp + 30ms, enter_key),
+                    KeyReleaseEvent(begin_tp + 31ms, right_key),
+                });
+    REQUIRE(recorder.types == std::vector<mapping::EventType>{
+                                  mapping::EventType::CONFIG,
+                                  mapping::EventType::KEY_PRESS,
+                                  mapping::EventType::KEY_RELEASE,
+                              });
+    REQUIRE(recorder.commands[1] ==
+            layout->find_keyset_entry(Keyset{enter_key, right_key})->command());
+  }
+}
+
+TEST_CASE("buffering::Engine dual", "[fujinami][buffering]") {
+  const Key dual_key = to_key(1);
+  const Key other_key = to_key(2);
+
+  auto config = std::make_shared<KeyboardConfig>();
+  auto layout = config->create_layout("layout");
+  layout->create_flow(dual_key, FlowType::DUAL);
+  layout->create_flow(other_key, FlowType::IMMEDIATE);
+  layout->create_mapping({dual_key}, {KeyRole::TRIGGER}, Command{});
+  layout->create_mapping({other_key}, {KeyRole::TRIGGER}, Command{});
+  config->set_default_layout(layout);
+  const Command* dual_command =
+      layout->find_keyset_entry(Keyset{dual_key})->command();
+
+  // DUALのフロー中に他のキーを離しても、drainが止まらずに進む。
+  const auto begin_tp = Clock::now();
+  const Recorder recorder = run<InlinePipeline>(
+      config, {
+                  KeyPressEvent(begin_tp, other_key),
+                  KeyPressEvent(begin_tp + 10ms, dual_key),
+                  KeyReleaseEvent(begin_tp + 20ms, other_key),
+                  KeyReleaseEvent(begin_tp + 30ms, dual_key),
+              });
+  REQUIRE(recorder.types.size() >= 3);
+  REQUIRE(recorder.types[2] == mapping::EventType::KEY_PRESS);
+  REQUIRE(recorder.commands[2] == dual_command);
+  REQUIRE(recorder.types.back() == mapping::EventType::KEY_RELEASE);
+}
+
+TEST_CASE("buffering::Engine overflow", "[fujinami][buffering]") {
+  const Key dual_key = to_key(1);
+  const Key other_key = to_key(2);
+
+  auto config = std::make_shared<KeyboardConfig>();
+  auto layout = config->create_layout("layout");
+  layout->create_flow(dual_key, FlowType::DUAL);
+  layout->create_flow(other_key, FlowType::IMMEDIATE);
+  layout->create_mapping({dual_key}, {KeyRole::TRIGGER}, Command{});
+  config->set_default_layout(layout);
+
+  Engine engine;
+  InlinePipeline pipeline;
+  engine.update(AnyEvent(ControlEvent(config.get(), 1)), pipeline.context);
+
+  // DUALのフローは他のキーを離すイベントを窓に残すので、窓が溢れる。
+  // 溢れてもイベントを捨てず、フローを確定させて処理を続ける。
+  const auto begin_tp = Clock::now();
+  engine.update(AnyEvent(KeyPressEvent(begin_tp, dual_key)),
+                pipeline.context);
+  const size_t capacity = EventWindow::CAPACITY;
+  for (size_t i = 0; i <= capacity; ++i) {
+    engine.update(AnyEvent(KeyReleaseEvent(begin_tp + 1ms, other_key)),
+                  pipeline.context);
+  }
+  REQUIRE(engine.forced_commit_count() == 1);
+
+  engine.update(AnyEvent(KeyReleaseEvent(begin_tp + 2ms, dual_key)),
+                pipeline.context);
+  engine.drain(pipeline.context);
+  REQUIRE(engine.is_idle());
+  REQUIRE(pipeline.recorder.types.back() == mapping::EventType::KEY_RELEASE);
+}
+
+TEST_CASE("buffering::Engine repeat", "[fujinami][buffering]") {
+  const Key key = to_key(1);
+
+  auto config = std::make_shared<KeyboardConfig>();
+  auto first_layout = config->create_layout("first");
+  auto second_layout = config->create_layout("second");
+  for (auto&& layout : {first_layout, second_layout}) {
+    layout->create_flow(key, FlowType::IMMEDIATE);
+    Command command;
+    command.emplace_back(CharAction(layout == first_layout ? u'a' : u'b'));
+    layout->create_mapping({key}, {KeyRole::TRIGGER}, std::move(command));
+  }
+  first_layout->create_transition(Keyset{key}, second_layout);
+  config->set_default_layout(first_layout);
+  const Command* first_command =
+      first_layout->find_keyset_entry(Keyset{key})->command();
+
+  // 遷移を伴うキーのリピートは、遷移前のレイアウトのコマンドを送る。
+  const auto begin_tp = Clock::now();
+  const Recorder recorder = run<InlinePipeline>(
+      config, {
+                  KeyPressEvent(begin_tp, key),
+                  KeyPressEvent(begin_tp + 10ms, key),
+                  KeyReleaseEvent(begin_tp + 20ms, key),
+              });
+  REQUIRE(recorder.types == std::vector<mapping::EventType>{
+                                mapping::EventType::CONFIG,
+                                mapping::EventType::KEY_PRESS,
+                                mapping::EventType::KEY_REPEAT,
+                                mapping::EventType::KEY_RELEASE,
+                            });
+  REQUIRE(recorder.commands[1] == first_command);
+  REQUIRE(recorder.commands[2] == first_command);
+}
+
+TEST_CASE("buffering::Engine rollover", "[fujinami][buffering]") {
+  const Key a = to_key(1);
+  const Key b = to_key(2);
+  const Key c = to_key(3);
+  const Key d = to_key(4);
+
+  auto config = std::make_shared<KeyboardConfig>();
+  config->set_timeout_dur(50ms);
+  auto layout = config->create_layout("layout");
+  for (Key key : {a, b, c, d}) {
+    layout->create_flow(key, FlowType::SIMUL);
+    layout->create_mapping({key}, {KeyRole::TRIGGER}, Command{});
+  }
+  for (auto&& pair : {std::make_pair(a, b), std::make_pair(b, c),
+                      std::make_pair(c, d)}) {
+    layout->create_mapping({pair.first, pair.second},
+                           {KeyRole::TRIGGER, KeyRole::TRIGGER}, Command{});
+  }
+  config->set_default_layout(layout);
+  const auto find_command = [&](const Keyset& keyset) {
+    return layout->find_keyset_entry(keyset)->command();
+  };
+  const auto press_commands = [](const Recorder& recorder) {
+    std::vector<const Command*> commands;
+    for (size_t i = 0; i < recorder.types.size(); ++i) {
+      if (recorder.types[i] == mapping::EventType::KEY_PRESS) {
+        commands.push_back(recorder.commands[i]);
+      }
+    }
+    return commands;
+  };
+
+  // 4つのキーを重ねて押す。aの後は間が空き、bとcは続けて押している。
+  // 時間切れにならないよう、イベント時刻を先に置く。
+  const auto begin_tp = Clock::now() + 1h;
+  const std::vector<AnyEvent> presses{
+      KeyPressEvent(begin_tp, a),
+      KeyPressEvent(begin_tp + 30ms, b),
+      KeyPressEvent(begin_tp + 35ms, c),
+      KeyPressEvent(begin_tp + 70ms, d),
+  };
+
+  SECTION("committed without release") {
+    // 第3キーを押した時点で判定が確定するので、離すのを待たずに送る。
+    const Recorder recorder = run<InlinePipeline>(config, presses);
+    REQUIRE(press_commands(recorder) ==
+            std::vector<const Command*>{find_command(Keyset{a}),
+                                        find_command(Keyset{b, c})});
+  }
+
+  SECTION("released") {
+    std::vector<AnyEvent> events = presses;
+    events.push_back(KeyReleaseEvent(begin_tp + 80ms, a));
+    events.push_back(KeyReleaseEvent(begin_tp + 90ms, b));
+    events.push_back(KeyReleaseEvent(begin_tp + 95ms, c));
+    events.push_back(KeyReleaseEvent(begin_tp + 120ms, d));
+    const Recorder recorder = run<QueuedPipeline>(config, events);
+    REQUIRE(press_commands(recorder) ==
+            std::vector<const Command*>{find_command(Keyset{a}),
+                                        find_command(Keyset{b, c}),
+                                        find_command(Keyset{d})});
+    REQUIRE(recorder.types.back() == mapping::EventType::KEY_RELEASE);
+  }
+}
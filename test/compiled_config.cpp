@@ -0,0 +1,135 @@
+﻿#include <catch.hpp>
+#include <cstdio>
+#include <fstream>
+#include <fujinami/config/compiled_config.hpp>
+
+using namespace fujinami;
+using namespace fujinami::config;
+
+TEST_CASE("CompiledConfig", "[fujinami][config]") {
+  const char* compiled_path = "compiled_config_test.compiled";
+  const char* source_path = "compiled_config_test.lua";
+  const Key a = static_cast<Key>(1);
+  const Key b = static_cast<Key>(2);
+
+  std::ofstream(source_path) << "-- source";
+
+  CompiledConfig compiled;
+  REQUIRE(compiled.add_source(source_path));
+  const uint32_t first = compiled.add_layout("first");
+  const uint32_t second = compiled.add_layout("second");
+  compiled.set_timeout_milliseconds(50);
+  compiled.set_default_layout(first);
+  RealtimeOption realtime_option;
+  realtime_option.lock_memory = true;
+  realtime_option.thread(PipelineThread::BUFFERING).priority = 50;
+  realtime_option.thread(PipelineThread::BUFFERING).cpu = 1;
+  compiled.set_realtime_option(realtime_option);
+  QueueOption queue_option;
+  queue_option.queue(PipelineQueue::BUFFERING).capacity = 64;
+  queue_option.queue(PipelineQueue::BUFFERING).overflow_policy =
+      OverflowPolicy::PASSTHROUGH;
+  queue_option.queue(PipelineQueue::MAPPING).overflow_policy =
+      OverflowPolicy::DROP_REPEAT;
+  compiled.set_queue_option(queue_option);
+  compiled.set_speculative_simul(true);
+  compiled.add_undo_action(CompiledConfig::ActionType::KEY, 14);
+  compiled.add_flow(first, a, FlowType::SIMUL, 30);
+  compiled.begin_mapping(first, 80);
+  compiled.add_mapping_key(a, KeyRole::TRIGGER);
+  compiled.add_mapping_key(b, KeyRole::MODIFIER);
+  compiled.add_mapping_action(CompiledConfig::ActionType::KEY, 30);
+  compiled.end_mapping();
+  compiled.begin_mapping(first);
+  compiled.add_mapping_key(b, KeyRole::TRIGGER);
+  compiled.end_mapping();  // アクションがないので登録されない
+  compiled.add_transition(first, Keyset{a, b}, second);
+  REQUIRE(compiled.mapping_count() == 1);
+
+  compiled.save(compiled_path);
+
+  SECTION("load") {
+    CompiledConfig loaded;
+    REQUIRE(loaded.load(compiled_path));
+    REQUIRE(loaded.layout_count() == 2);
+    REQUIRE(loaded.mapping_count() == 1);
+
+    KeyboardConfig config;
+    loaded.apply(config);
+    REQUIRE(config.layout_count() == 2);
+    REQUIRE(config.timeout_dur() == std::chrono::milliseconds(50));
+    const RealtimeOption& loaded_realtime_option = config.realtime_option();
+    REQUIRE(loaded_realtime_option.lock_memory);
+    REQUIRE(loaded_realtime_option.thread(PipelineThread::BUFFERING).priority ==
+            50);
+    REQUIRE(loaded_realtime_option.thread(PipelineThread::BUFFERING).cpu == 1);
+    REQUIRE(loaded_realtime_option.thread(PipelineThread::HOOK).priority == 0);
+    REQUIRE(config.speculative_simul());
+    REQUIRE(config.undo_command().action_count() == 1);
+    const QueueOption& loaded_queue_option = config.queue_option();
+    REQUIRE(loaded_queue_option.queue(PipelineQueue::BUFFERING).capacity == 64);
+    REQUIRE(loaded_queue_option.queue(PipelineQueue::BUFFERING)
+                .overflow_policy == OverflowPolicy::PASSTHROUGH);
+    REQUIRE(loaded_queue_option.queue(PipelineQueue::MAPPING).capacity ==
+            uint32_t(QueueOption::DEFAULT_CAPACITY));
+    REQUIRE(loaded_queue_option.queue(PipelineQueue::MAPPING)
+                .overflow_policy == OverflowPolicy::DROP_REPEAT);
+    const auto layout = config.default_layout();
+    REQUIRE(layout == config.layout(0));
+    REQUIRE(layout->is_frozen());
+    REQUIRE(layout->find_key_property(a)->flow_type() == FlowType::SIMUL);
+    REQUIRE(layout->find_key_property(a)->timeout().value_or(
+                Clock::duration::zero()) == std::chrono::milliseconds(30));
+    const KeysetProperty property =
+        layout->find_keyset_property(Keyset{a, b});
+    REQUIRE(property.is_mapped());
+    REQUIRE(property.trigger_keyset() == Keyset{a});
+    REQUIRE(property.modifier_keyset() == Keyset{b});
+    REQUIRE(property.timeout().value_or(Clock::duration::zero()) ==
+            std::chrono::milliseconds(80));
+    REQUIRE(layout->find_command(Keyset{a, b}));
+    REQUIRE(!layout->find_command(Keyset{b}));
+    REQUIRE(layout->find_next_layout(Keyset{a, b}) ==
+            config.layout(1).get());
+  }
+
+  SECTION("source has changed") {
+    std::ofstream(source_path) << "-- changed";
+    CompiledConfig loaded;
+    REQUIRE(!loaded.load(compiled_path));
+  }
+
+  SECTION("invalid action") {
+    compiled.begin_mapping(first);
+    compiled.add_mapping_key(b, KeyRole::TRIGGER);
+    compiled.add_mapping_action(CompiledConfig::ActionType::KEY,
+                                uint16_t(KEY_COUNT));
+    compiled.end_mapping();
+    compiled.save(compiled_path);
+    CompiledConfig loaded;
+    REQUIRE(!loaded.load(compiled_path));
+  }
+
+  SECTION("char action") {
+    // 文字を出力できないプラットフォームでは、文字のアクションを取り除く。
+    compiled.begin_mapping(first);
+    compiled.add_mapping_key(b, KeyRole::TRIGGER);
+    compiled.add_mapping_action(CompiledConfig::ActionType::CHAR, u'x');
+    compiled.add_mapping_action(CompiledConfig::ActionType::KEY, 30);
+    compiled.end_mapping();
+    KeyboardConfig config;
+    compiled.apply(config);
+    const Command* command = config.default_layout()->find_command(Keyset{b});
+    REQUIRE(command);
+    REQUIRE(command->action_count() == (CharAction::IS_SUPPORTED ? 2 : 1));
+  }
+
+  SECTION("broken") {
+    std::ofstream(compiled_path, std::ios::binary | std::ios::app) << 'x';
+    CompiledConfig loaded;
+    REQUIRE(!loaded.load(compiled_path));
+  }
+
+  std::remove(compiled_path);
+  std::remove(source_path);
+}
@@ -0,0 +1,37 @@
+﻿#include <catch.hpp>
+#include <fujinami/config_reclaimer.hpp>
+
+using namespace fujinami;
+
+TEST_CASE("ConfigReclaimer", "[fujinami]") {
+  using Reader = ConfigReclaimer::Reader;
+  ConfigReclaimer reclaimer;
+  auto first = std::make_shared<KeyboardConfig>();
+  auto second = std::make_shared<KeyboardConfig>();
+
+  const uint64_t first_epoch = reclaimer.install(first);
+  reclaimer.enter(Reader::BUFFERING, first_epoch);
+  reclaimer.enter(Reader::MAPPING, first_epoch);
+  const uint64_t second_epoch = reclaimer.install(second);
+  REQUIRE(second_epoch > first_epoch);
+  REQUIRE(reclaimer.collect() == 0);
+
+  // 全段が新しい設定を使い始めるまでは古い設定を解放しない。
+  // エポックが変わったときだけtrueを返し、呼び出し元を起こす合図にする。
+  REQUIRE(reclaimer.enter(Reader::BUFFERING, second_epoch));
+  REQUIRE(!reclaimer.enter(Reader::BUFFERING, second_epoch));
+  REQUIRE(reclaimer.collect() == 0);
+  REQUIRE(first.use_count() == 2);
+
+  reclaimer.enter(Reader::MAPPING, second_epoch);
+  REQUIRE(reclaimer.collect() == 1);
+  REQUIRE(first.use_count() == 1);
+
+  // 現在の設定は解放しない。
+  REQUIRE(reclaimer.size() == 1);
+  REQUIRE(second.use_count() == 2);
+
+  reclaimer.reset();
+  REQUIRE(reclaimer.size() == 0);
+  REQUIRE(second.use_count() == 1);
+}
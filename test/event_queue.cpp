@@ -0,0 +1,120 @@
+﻿#include <catch.hpp>
+#include <thread>
+#include <vector>
+#include <fujinami/event_queue.hpp>
+
+using namespace std::chrono_literals;
+using namespace fujinami;
+
+TEST_CASE("EventQueue", "[fujinami]") {
+  SECTION("capacity") {
+    EventQueue<int> queue(3);
+    REQUIRE(queue.capacity() == 4);
+    REQUIRE(queue.push(0));
+    REQUIRE(queue.push(1));
+    REQUIRE(queue.push(2));
+    REQUIRE(queue.push(3));
+    REQUIRE(!queue.push(4));
+
+    int value = -1;
+    REQUIRE(queue.try_pop(value));
+    REQUIRE(value == 0);
+    REQUIRE(queue.wakeup_count() == 0);
+    REQUIRE(queue.push(4));
+    for (int i = 1; i <= 4; ++i) {
+      REQUIRE(queue.try_pop(value));
+      REQUIRE(value == i);
+    }
+    REQUIRE(!queue.try_pop(value));
+  }
+
+  SECTION("batch") {
+    EventQueue<int> queue(4);
+    REQUIRE(queue.stage(0));
+    REQUIRE(queue.stage(1));
+    REQUIRE(queue.stage(2));
+
+    // commitするまで受信側には見えない。
+    std::vector<int> values;
+    const auto receive = [&](int value) { values.push_back(value); };
+    REQUIRE(queue.try_pop_all(receive) == 0);
+    queue.commit();
+    REQUIRE(queue.try_pop_all(receive) == 3);
+    REQUIRE(values == std::vector<int>{0, 1, 2});
+
+    // 満杯になった場合は溜めたものを公開する。
+    for (int i = 3; i < 7; ++i) REQUIRE(queue.stage(i));
+    REQUIRE(!queue.stage(7));
+    REQUIRE(queue.pop_all(Clock::time_point::max(), receive) == 4);
+    REQUIRE(values == std::vector<int>{0, 1, 2, 3, 4, 5, 6});
+    REQUIRE(queue.wakeup_count() == 0);
+  }
+
+  SECTION("stats") {
+    EventQueue<int> queue(4);
+    for (int i = 0; i < 4; ++i) REQUIRE(queue.push(i));
+    REQUIRE(!queue.push(4));
+    REQUIRE(!queue.push(4));
+    REQUIRE(queue.overflow_count() == 2);
+
+    int value = -1;
+    REQUIRE(queue.try_pop(value));
+    REQUIRE(queue.high_water_mark() == 4);
+    REQUIRE(queue.wait_writable());
+    REQUIRE(queue.push(4));
+
+    // 容量を変えると中身と統計を捨てて開き直す。
+    queue.close();
+    queue.reset(16);
+    REQUIRE(queue.capacity() == 16);
+    REQUIRE(queue.high_water_mark() == 0);
+    REQUIRE(queue.overflow_count() == 0);
+    REQUIRE(!queue.try_pop(value));
+    REQUIRE(queue.push(5));
+    REQUIRE(queue.try_pop(value));
+    REQUIRE(value == 5);
+  }
+
+  SECTION("timed out") {
+    EventQueue<int> queue;
+    int value = -1;
+    const auto begin_tp = Clock::now();
+    REQUIRE(!queue.pop(begin_tp + 10ms, value));
+    REQUIRE(begin_tp + 10ms <= Clock::now());
+    REQUIRE(value == -1);
+    REQUIRE(queue.wakeup_count() == 1);
+  }
+
+  SECTION("close") {
+    EventQueue<int> queue;
+    std::thread thread([&]() {
+      std::this_thread::sleep_for(10ms);
+      queue.close();
+    });
+    int value = -1;
+    REQUIRE(!queue.pop(value));
+    REQUIRE(!queue.push(0));
+    thread.join();
+  }
+
+  SECTION("producer and consumer") {
+    constexpr int COUNT = 100000;
+    EventQueue<int> queue(64);
+    std::thread thread([&]() {
+      for (int i = 0; i < COUNT;) {
+        if (queue.push(i)) {
+          ++i;
+        } else {
+          std::this_thread::yield();
+        }
+      }
+    });
+    bool is_ordered = true;
+    for (int i = 0; i < COUNT; ++i) {
+      int value = -1;
+      if (!queue.pop(value) || value != i) is_ordered = false;
+    }
+    thread.join();
+    REQUIRE(is_ordered);
+  }
+}
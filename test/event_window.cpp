@@ -0,0 +1,47 @@
+﻿#include <catch.hpp>
+#include <fujinami/buffering/event_window.hpp>
+
+using namespace std::chrono_literals;
+using namespace fujinami;
+using namespace fujinami::buffering;
+
+TEST_CASE("EventWindow", "[fujinami][buffering]") {
+  const Key key = to_key(1);
+  EventWindow window;
+
+  SECTION("key events") {
+    for (size_t i = 0; i < EventWindow::CAPACITY; ++i) {
+      REQUIRE(window.push(KeyPressEvent(Clock::time_point(1ms * i), key)));
+    }
+    REQUIRE(window.is_full());
+    REQUIRE(!window.push(KeyReleaseEvent(Clock::time_point(0ms), key)));
+
+    window.consume(2);
+    REQUIRE(window.size() == EventWindow::CAPACITY - 2);
+    REQUIRE(window.front().as<KeyPressEvent>().time() == Clock::time_point(2ms));
+    REQUIRE(window.push(KeyReleaseEvent(Clock::time_point(1s), key)));
+    const WindowEvent& back = window[window.size() - 1];
+    REQUIRE(back.type() == EventType::KEY_RELEASE);
+    REQUIRE(back.as<KeyReleaseEvent>().time() == Clock::time_point(1s));
+  }
+
+  SECTION("out of line events") {
+    auto config = std::make_shared<KeyboardConfig>();
+    REQUIRE(window.push(KeyPressEvent(Clock::time_point(0ms), key)));
+    REQUIRE(window.push(ControlEvent(config.get(), 1)));
+
+    window.pop();
+    REQUIRE(window.front().type() == EventType::CONTROL);
+    const ControlEvent& control = window.front_payload().as<ControlEvent>();
+    REQUIRE(control.config() == config.get());
+    REQUIRE(control.epoch() == 1);
+    window.pop();
+    REQUIRE(window.empty());
+
+    for (size_t i = 0; i < EventWindow::PAYLOAD_CAPACITY; ++i) {
+      REQUIRE(window.push(ControlEvent(nullptr, 0)));
+    }
+    REQUIRE(!window.push(ControlEvent(nullptr, 0)));
+    REQUIRE(window.push(KeyPressEvent(Clock::time_point(0ms), key)));
+  }
+}
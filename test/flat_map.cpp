@@ -0,0 +1,84 @@
+﻿#include <catch.hpp>
+#include <fujinami/flat_map.hpp>
+#include <fujinami/frozen_map.hpp>
+#include <fujinami/keyset.hpp>
+
+using namespace fujinami;
+
+TEST_CASE("FlatMap", "[fujinami]") {
+  SECTION("emplace and find") {
+    FlatMap<Keyset, int> map;
+    REQUIRE(map.find(Keyset{to_key(1)}) == nullptr);
+    REQUIRE(map.emplace(Keyset{to_key(1)}, 1).second);
+    REQUIRE(map.emplace(Keyset{to_key(1), to_key(2)}, 12).second);
+    REQUIRE(!map.emplace(Keyset{to_key(1)}, 2).second);
+    REQUIRE(map.size() == 2);
+    REQUIRE(*map.find(Keyset{to_key(1)}) == 1);
+    REQUIRE(*map.find(Keyset{to_key(2), to_key(1)}) == 12);
+    REQUIRE(map.find(Keyset{to_key(2)}) == nullptr);
+  }
+
+  SECTION("rehash") {
+    FlatMap<Keyset, size_t> map;
+    for (size_t i = 2; i < KEY_COUNT; ++i) {
+      map[Keyset{static_cast<Key>(i)}] = i;
+      map[Keyset{static_cast<Key>(i), static_cast<Key>(i - 1)}] = i * 1000;
+    }
+    REQUIRE(map.size() == (KEY_COUNT - 2) * 2);
+    REQUIRE(map.size() * 2 <= map.capacity());
+    bool is_found = true;
+    for (size_t i = 2; i < KEY_COUNT; ++i) {
+      const size_t* value = map.find(Keyset{static_cast<Key>(i)});
+      if (!value || *value != i) is_found = false;
+      value = map.find(Keyset{static_cast<Key>(i - 1), static_cast<Key>(i)});
+      if (!value || *value != i * 1000) is_found = false;
+    }
+    REQUIRE(is_found);
+  }
+
+  SECTION("clear") {
+    FlatMap<Keyset, int> map;
+    map[Keyset{to_key(1)}] = 1;
+    map.clear();
+    REQUIRE(map.empty());
+    REQUIRE(map.find(Keyset{to_key(1)}) == nullptr);
+  }
+}
+
+TEST_CASE("Keyset", "[fujinami]") {
+  const Keyset keyset{to_key(1), to_key(70), to_key(200)};
+  REQUIRE(keyset.count() == 3);
+  REQUIRE(keyset[to_key(70)]);
+  REQUIRE(!keyset[to_key(71)]);
+  REQUIRE(keyset.contains(Keyset{to_key(1), to_key(200)}));
+  REQUIRE(!keyset.contains(Keyset{to_key(1), to_key(2)}));
+  REQUIRE((keyset - to_key(70)) == Keyset{to_key(1), to_key(200)});
+  REQUIRE(!(keyset - keyset));
+  REQUIRE(hash_value(keyset) != hash_value(keyset - to_key(200)));
+}
+
+TEST_CASE("FrozenMap", "[fujinami]") {
+  FlatMap<Keyset, size_t> map;
+  for (size_t i = 2; i < KEY_COUNT; ++i) {
+    map[Keyset{static_cast<Key>(i)}] = i;
+    map[Keyset{static_cast<Key>(i), static_cast<Key>(i - 1)}] = i * 1000;
+  }
+
+  FrozenMap<Keyset, size_t> frozen_map;
+  REQUIRE(frozen_map.find(Keyset{static_cast<Key>(2)}) == nullptr);
+  REQUIRE(frozen_map.build(map));
+  REQUIRE(frozen_map.size() == map.size());
+
+  bool is_found = true;
+  for (size_t i = 2; i < KEY_COUNT; ++i) {
+    const size_t* value = frozen_map.find(Keyset{static_cast<Key>(i)});
+    if (!value || *value != i) is_found = false;
+    value = frozen_map.find(
+        Keyset{static_cast<Key>(i - 1), static_cast<Key>(i)});
+    if (!value || *value != i * 1000) is_found = false;
+  }
+  REQUIRE(is_found);
+  REQUIRE(frozen_map.find(Keyset{static_cast<Key>(1)}) == nullptr);
+  REQUIRE(frozen_map.find(Keyset{static_cast<Key>(2), static_cast<Key>(4)}) ==
+          nullptr);
+}
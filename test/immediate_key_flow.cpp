@@ -40,7 +40,7 @@ TEST_CASE("ImmediateKeyFlow", "[fujinami][buffering][flow]") {
   SECTION("press unmapped key") {
     ImmediateKeyFlow flow;
     State state;
-    state.reset(config);
+    state.reset(config.get());
 
     // 0: Up Up Up
     state.push_event(KeyPressEvent{Clock::time_point(0ms), unmapped_key});
@@ -56,7 +56,7 @@ TEST_CASE("ImmediateKeyFlow", "[fujinami][buffering][flow]") {
     State state;
 
     // 0: Tp Tp Tp
-    state.reset(config);
+    state.reset(config.get());
     state.push_event(KeyPressEvent{Clock::time_point(0ms), trigger_key});
     state.push_event(KeyPressEvent{Clock::time_point(2ms), trigger_key});
     state.push_event(KeyPressEvent{Clock::time_point(3ms), trigger_key});
@@ -65,7 +65,7 @@ TEST_CASE("ImmediateKeyFlow", "[fujinami][buffering][flow]") {
     REQUIRE_STATE(trigger_keyset, none_keyset, trigger_keyset);
 
     // 1: Mp Mp Mp
-    state.reset(config);
+    state.reset(config.get());
     state.push_event(KeyPressEvent{Clock::time_point(100ms), modifier_key});
     state.push_event(KeyPressEvent{Clock::time_point(102ms), modifier_key});
     state.push_event(KeyPressEvent{Clock::time_point(103ms), modifier_key});
@@ -74,14 +74,14 @@ TEST_CASE("ImmediateKeyFlow", "[fujinami][buffering][flow]") {
     REQUIRE_STATE(none_keyset, modifier_keyset, modifier_keyset);
 
     // 2: Tp Mp
-    state.reset(config);
+    state.reset(config.get());
     state.push_event(KeyPressEvent{Clock::time_point(200ms), trigger_key});
     state.push_event(KeyPressEvent{Clock::time_point(201ms), modifier_key});
     REQUIRE_STATE(trigger_keyset, none_keyset, trigger_keyset);
     REQUIRE_STATE(none_keyset, modifier_keyset, all_keyset);
 
     // 3: Mp Tp
-    state.reset(config);
+    state.reset(config.get());
     state.push_event(KeyPressEvent{Clock::time_point(300ms), modifier_key});
     state.push_event(KeyPressEvent{Clock::time_point(301ms), trigger_key});
     REQUIRE_STATE(none_keyset, modifier_keyset, modifier_keyset);
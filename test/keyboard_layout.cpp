@@ -0,0 +1,59 @@
+﻿#include <catch.hpp>
+#include <fujinami/keyboard_layout.hpp>
+
+using namespace fujinami;
+
+TEST_CASE("KeyboardLayout", "[fujinami]") {
+  const Key a = static_cast<Key>(1);
+  const Key b = static_cast<Key>(2);
+  const Key c = static_cast<Key>(3);
+  const Key d = static_cast<Key>(4);
+  const KeyRole t = KeyRole::TRIGGER;
+
+  KeyboardLayout layout("KeyboardLayoutTest");
+  REQUIRE(layout.create_mapping({a, b, c}, {t, t, t}, Command{}));
+  REQUIRE(layout.create_mapping({a, d}, {t, t}, Command{}));
+  REQUIRE(layout.create_mapping({a}, {t}, Command{}));
+  REQUIRE(!layout.create_mapping({a, d}, {t, t}, Command{}));
+
+  SECTION("mapped node") {
+    const KeysetProperty property = layout.find_keyset_property(Keyset{a});
+    REQUIRE(property.is_mapped());
+    REQUIRE(property.is_node());
+    REQUIRE(property.combinable_keyset() == Keyset{b, c, d});
+    REQUIRE(layout.find_command(Keyset{a}));
+  }
+
+  SECTION("unmapped node") {
+    const KeysetProperty property =
+        layout.find_keyset_property(Keyset{b, c});
+    REQUIRE(property.is_registered());
+    REQUIRE(!property.is_mapped());
+    REQUIRE(property.combinable_keyset() == Keyset{a});
+    REQUIRE(!layout.find_command(Keyset{b, c}));
+  }
+
+  SECTION("mapped leaf") {
+    const KeysetProperty property =
+        layout.find_keyset_property(Keyset{a, b, c});
+    REQUIRE(property.is_mapped());
+    REQUIRE(property.is_leaf());
+  }
+
+  SECTION("frozen") {
+    layout.freeze();
+    REQUIRE(layout.is_frozen());
+    REQUIRE(layout.find_keyset_property(Keyset{a}).is_mapped());
+    REQUIRE(layout.find_keyset_property(Keyset{a, d}).is_leaf());
+    REQUIRE(layout.find_keyset_property(Keyset{b}).combinable_keyset() ==
+            (Keyset{a, c}));
+    REQUIRE(layout.find_command(Keyset{a, b, c}));
+    REQUIRE(!layout.find_command(Keyset{a, b}));
+    REQUIRE_THROWS(layout.create_mapping({b}, {t}, Command{}));
+  }
+
+  SECTION("unregistered") {
+    REQUIRE(!layout.find_keyset_property(Keyset{b, d}).is_registered());
+    REQUIRE(!layout.find_keyset_property(Keyset{}).is_registered());
+  }
+}
@@ -1,4 +1,5 @@
 ﻿#include <catch.hpp>
+#include <vector>
 #include <fujinami/buffering/flow/simul.hpp>
 
 using namespace std::chrono_literals;
@@ -28,12 +29,12 @@ using namespace fujinami::buffering;
     REQUIRE(state.dontcare_keyset() == dc);\
   } while(false)
 
+// 第3キーを押した時点で確定する。
 #define REQUIRE_STATE_3(c, t, m, dc)\
   do {\
     const size_t size = state.events().size();\
     REQUIRE(flow.reset(state) == FlowResult::CONTINUE);\
     REQUIRE(flow.update(state) == FlowResult::CONTINUE);\
-    REQUIRE(flow.update(state) == FlowResult::CONTINUE);\
     REQUIRE(flow.update(state) == FlowResult::DONE);\
     REQUIRE(size == state.events().size() + c);\
     REQUIRE(state.trigger_keyset() == t);\
@@ -63,7 +64,9 @@ TEST_CASE("SimulKeyFlow", "[fujinami][buffering][flow]") {
   layout->create_flow(trigger_key_1, FlowType::SIMUL);
   layout->create_flow(trigger_key_2, FlowType::SIMUL);
   layout->create_flow(trigger_key_3, FlowType::SIMUL);
+  layout->create_flow(trigger_key_4, FlowType::SIMUL);
   layout->create_mapping({trigger_key_1}, {trigger_key_role}, Command{});
+  layout->create_mapping({trigger_key_4}, {trigger_key_role}, Command{});
   layout->create_mapping({trigger_key_1, trigger_key_2},
                          {trigger_key_role, trigger_key_role},
                          Command{});
@@ -79,42 +82,52 @@ TEST_CASE("SimulKeyFlow", "[fujinami][buffering][flow]") {
 
   SECTION("1KEY: timed out without next key") {
     // キーイベントが来ないままタイムアウトする
-    state.reset(config);
+    state.reset(config.get());
     state.push_event(KeyPressEvent{begin_tp, trigger_key_1});
     REQUIRE_STATE_1(trigger_keyset_1, none_keyset, trigger_keyset_1);
   }
   SECTION("1KEY: timed out with next key") {
     // タイムアウト後にキーイベントが来る
-    state.reset(config);
+    state.reset(config.get());
     state.push_event(KeyPressEvent{begin_tp, trigger_key_1});
     state.push_event(KeyPressEvent{end_tp, trigger_key_2});
     REQUIRE_STATE_1(trigger_keyset_1, none_keyset, trigger_keyset_1);
   }
   SECTION("1KEY: repeat K1") {
     // キーリピートが発生する
-    state.reset(config);
+    state.reset(config.get());
     state.push_event(KeyPressEvent{begin_tp, trigger_key_1});
     state.push_event(KeyPressEvent{begin_tp + 1ms, trigger_key_1});
     REQUIRE_STATE_1(trigger_keyset_1, none_keyset, trigger_keyset_1);
   }
   SECTION("1KEY: release K1") {
     // 第1キーを離す
-    state.reset(config);
+    state.reset(config.get());
     state.push_event(KeyPressEvent{begin_tp, trigger_key_1});
     state.push_event(KeyReleaseEvent{begin_tp + 1ms, trigger_key_1});
     REQUIRE_STATE_1(trigger_keyset_1, none_keyset, trigger_keyset_1);
   }
 
+  SECTION("1KEY: leaf") {
+    // 組み合わせ可能なキーがないので待たずに確定する
+    state.reset(config.get());
+    state.push_event(KeyPressEvent{Clock::now(), trigger_key_4});
+    REQUIRE(flow.reset(state) == FlowResult::DONE);
+    REQUIRE(state.events().empty());
+    REQUIRE(state.trigger_keyset() == Keyset{trigger_key_4});
+    REQUIRE(state.dontcare_keyset() == Keyset{trigger_key_4});
+  }
+
   SECTION("2KEYS-1: timed out without next key") {
     // キーイベントが来ないままタイムアウトする
-    state.reset(config);
+    state.reset(config.get());
     state.push_event(KeyPressEvent{begin_tp, trigger_key_1});
     state.push_event(KeyPressEvent{begin_tp + press_timeout_dur, trigger_key_2});
     REQUIRE_STATE_2(1, trigger_keyset_1, none_keyset, trigger_keyset_1);
   }
   SECTION("2KEYS-1: timed out with next key") {
     // タイムアウト後にキーイベントが来る
-    state.reset(config);
+    state.reset(config.get());
     state.push_event(KeyPressEvent{begin_tp, trigger_key_1});
     state.push_event(KeyPressEvent{middle_tp, trigger_key_2});
     state.push_event(KeyPressEvent{end_tp, trigger_key_3});
@@ -122,24 +135,36 @@ TEST_CASE("SimulKeyFlow", "[fujinami][buffering][flow]") {
   }
   SECTION("2KEYS-1: release K1") {
     // 第1キーを離す
-    state.reset(config);
+    state.reset(config.get());
     state.push_event(KeyPressEvent{begin_tp, trigger_key_1});
     state.push_event(KeyPressEvent{middle_tp, trigger_key_2});
     state.push_event(KeyReleaseEvent{end_tp - 1ms, trigger_key_1});
     REQUIRE_STATE_2(1, trigger_keyset_1, none_keyset, trigger_keyset_1);
   }
 
+  SECTION("2KEYS-1: unmapped pair") {
+    // 同時押しが登録されていないので第2キーを押した時点で確定する
+    state.reset(config.get());
+    state.push_event(KeyPressEvent{Clock::now(), trigger_key_1});
+    state.push_event(KeyPressEvent{Clock::now(), trigger_key_3});
+    REQUIRE(flow.reset(state) == FlowResult::CONTINUE);
+    REQUIRE(flow.update(state) == FlowResult::DONE);
+    REQUIRE(state.events().size() == 1);
+    REQUIRE(state.trigger_keyset() == trigger_keyset_1);
+    REQUIRE(state.dontcare_keyset() == trigger_keyset_1);
+  }
+
   // 同時打鍵
   SECTION("2KEYS-2: timed out without next key") {
     // キーイベントが来ないままタイムアウトする
-    state.reset(config);
+    state.reset(config.get());
     state.push_event(KeyPressEvent{begin_tp, trigger_key_1});
     state.push_event(KeyPressEvent{middle_tp - 1ms, trigger_key_2});
     REQUIRE_STATE_2(2, trigger_keyset_12, none_keyset, trigger_keyset_12);
   }
   SECTION("2KEYS-2: timed out with next key") {
     // タイムアウト後にキーイベントが来る
-    state.reset(config);
+    state.reset(config.get());
     state.push_event(KeyPressEvent{begin_tp, trigger_key_1});
     state.push_event(KeyPressEvent{middle_tp - 1ms, trigger_key_2});
     state.push_event(KeyPressEvent{end_tp, trigger_key_3});
@@ -147,16 +172,29 @@ TEST_CASE("SimulKeyFlow", "[fujinami][buffering][flow]") {
   }
   SECTION("2KEYS-2: release K1") {
     // 第1キーを離す
-    state.reset(config);
+    state.reset(config.get());
     state.push_event(KeyPressEvent{begin_tp, trigger_key_1});
     state.push_event(KeyPressEvent{middle_tp - 1ms, trigger_key_2});
     state.push_event(KeyReleaseEvent{end_tp - 1ms, trigger_key_1});
     REQUIRE_STATE_2(2, trigger_keyset_12, none_keyset, trigger_keyset_12);
   }
 
+  SECTION("2KEYS-2: same frame") {
+    // 同じフレームで押されたので待たずに確定する
+    const auto now = Clock::now();
+    state.reset(config.get());
+    state.push_event(KeyPressEvent{now, trigger_key_1, 7});
+    state.push_event(KeyPressEvent{now, trigger_key_2, 7});
+    REQUIRE(flow.reset(state) == FlowResult::CONTINUE);
+    REQUIRE(flow.update(state) == FlowResult::DONE);
+    REQUIRE(state.events().empty());
+    REQUIRE(state.trigger_keyset() == trigger_keyset_12);
+    REQUIRE(state.dontcare_keyset() == trigger_keyset_12);
+  }
+
   // 単打
   SECTION("3KEYS-1:") {
-    state.reset(config);
+    state.reset(config.get());
     state.push_event(KeyPressEvent{begin_tp - 15ms, trigger_key_1});
     state.push_event(KeyPressEvent{begin_tp, trigger_key_2});
     state.push_event(KeyPressEvent{begin_tp + 10ms, trigger_key_3});
@@ -165,15 +203,32 @@ TEST_CASE("SimulKeyFlow", "[fujinami][buffering][flow]") {
 
   // 同時打鍵
   SECTION("3KEYS-2:") {
-    state.reset(config);
+    state.reset(config.get());
     state.push_event(KeyPressEvent{begin_tp - 10ms, trigger_key_1});
     state.push_event(KeyPressEvent{begin_tp, trigger_key_2});
     state.push_event(KeyPressEvent{begin_tp + 15ms, trigger_key_3});
     REQUIRE_STATE_3(2, trigger_keyset_12, none_keyset, trigger_keyset_12);
   }
 
+  // 第1キーを離す前に時間切れで終えても、離した時点で学習する。
+  SECTION("learn after timed out") {
+    config->set_adaptive_simul(true, 0.05);
+    state.reset(config.get());
+    state.push_event(KeyPressEvent{begin_tp, trigger_key_1});
+    state.push_event(KeyPressEvent{begin_tp + 10ms, trigger_key_2});
+
+    REQUIRE(flow.reset(state) == FlowResult::CONTINUE);
+    REQUIRE(flow.update(state) == FlowResult::CONTINUE);
+    REQUIRE(flow.update(state) == FlowResult::DONE);
+    REQUIRE(flow.timing().pair_count() == 0);
+    flow.observe(KeyReleaseEvent{end_tp + 10ms, trigger_key_2});
+    REQUIRE(flow.timing().pair_count() == 0);
+    flow.observe(KeyReleaseEvent{end_tp + 20ms, trigger_key_1});
+    REQUIRE(flow.timing().pair_count() == 1);
+  }
+
   SECTION("idle") {
-    state.reset(config);
+    state.reset(config.get());
     state.push_event(KeyPressEvent{begin_tp, trigger_key_1});
     state.push_event(KeyPressEvent{middle_tp, trigger_key_2});
     state.push_event(KeyPressEvent{end_tp, trigger_key_3});
@@ -190,10 +245,51 @@ TEST_CASE("SimulKeyFlow", "[fujinami][buffering][flow]") {
   }
 
   SECTION("timeout_tp") {
-    state.reset(config);
+    state.reset(config.get());
     state.push_event(KeyPressEvent{begin_tp, trigger_key_1});
 
     flow.reset(state);
     REQUIRE(flow.timeout_tp() == begin_tp + timeout_dur);
   }
 }
+
+TEST_CASE("SimulKeyFlow timeout override", "[fujinami][buffering][flow]") {
+  const Key key_1 = to_key(1);
+  const Key key_2 = to_key(2);
+  const Key key_3 = to_key(3);
+  const KeyRole role = KeyRole::TRIGGER;
+
+  auto config = std::make_shared<KeyboardConfig>();
+  config->set_timeout_dur(1000ms);
+  auto layout = config->create_layout("layout");
+  for (Key key : {key_1, key_2, key_3}) {
+    layout->create_flow(key, FlowType::SIMUL);
+    layout->create_mapping({key}, {role}, Command{});
+  }
+  // key_1から組み合わせうるのは上書きした同時押しだけ、
+  // key_2からは上書きしない同時押しも組み合わせうる。
+  const std::vector<Key> keys_12{key_1, key_2};
+  const std::vector<Key> keys_23{key_2, key_3};
+  const std::vector<KeyRole> roles{role, role};
+  layout->create_mapping(keys_12, roles, Command{}, TimeoutOverride{100});
+  layout->create_mapping(keys_23, roles, Command{});
+  config->set_default_layout(layout);
+
+  SimulKeyFlow flow;
+  State state;
+  const auto begin_tp = Clock::now();
+
+  SECTION("overridden chord") {
+    state.reset(config.get());
+    state.push_event(KeyPressEvent{begin_tp, key_1});
+    REQUIRE(flow.reset(state) == FlowResult::CONTINUE);
+    REQUIRE(flow.timeout_tp() == begin_tp + 100ms);
+  }
+
+  SECTION("chord without override") {
+    state.reset(config.get());
+    state.push_event(KeyPressEvent{begin_tp, key_2});
+    REQUIRE(flow.reset(state) == FlowResult::CONTINUE);
+    REQUIRE(flow.timeout_tp() == begin_tp + 1000ms);
+  }
+}
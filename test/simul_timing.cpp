@@ -0,0 +1,73 @@
+﻿#include <catch.hpp>
+#include <cstdio>
+#include <fujinami/buffering/simul_timing.hpp>
+
+using namespace std::chrono_literals;
+using namespace fujinami;
+using namespace fujinami::buffering;
+
+TEST_CASE("SimulTiming", "[fujinami][buffering]") {
+  const Key first = to_key(1);
+  const Key second = to_key(2);
+  const Key other = to_key(3);
+  const Clock::duration default_dur = 50ms;
+
+  const Keyset partner_keyset{second};
+  const Keyset unlearned_keyset{second, other};
+
+  SimulTiming timing;
+  REQUIRE(timing.first_window(first, partner_keyset, default_dur) ==
+          default_dur);
+
+  // 同時打鍵は10ms以内、順次打鍵は30ms以上の間隔で押す。
+  for (int i = 0; i < 20; ++i) {
+    timing.learn(first, second, 6ms, true, 0.05);
+    timing.learn(first, second, 35ms, false, 0.05);
+  }
+  REQUIRE(timing.pair_window(first, second, default_dur) == 8ms);
+  REQUIRE(timing.first_window(first, partner_keyset, default_dur) == 8ms);
+  REQUIRE(timing.pair_window(first, other, default_dur) == default_dur);
+  REQUIRE(timing.first_window(second, Keyset{first}, default_dur) ==
+          default_dur);
+
+  // 学習していない組がある場合、その組を取りこぼさないように縮めない。
+  REQUIRE(timing.first_window(first, unlearned_keyset, default_dur) ==
+          default_dur);
+  REQUIRE(timing.first_window(first, Keyset{}, default_dur) == default_dur);
+
+  // 学習した判定時間は既定値より長くしない。
+  REQUIRE(timing.first_window(first, partner_keyset, 5ms) == 5ms);
+
+  SECTION("evict oldest pair") {
+    const auto learn_pair = [&](Key pair_first, Key pair_second) {
+      for (int i = 0; i < 20; ++i) {
+        timing.learn(pair_first, pair_second, 6ms, true, 0.05);
+        timing.learn(pair_first, pair_second, 35ms, false, 0.05);
+      }
+    };
+    const size_t capacity = SimulTiming::PAIR_CAPACITY;
+    for (size_t i = 0; i < capacity; ++i) {
+      learn_pair(to_key(10 + i / 16), to_key(40 + i % 16));
+    }
+    REQUIRE(timing.pair_count() == capacity);
+    REQUIRE(timing.pair_window(first, second, default_dur) == default_dur);
+    REQUIRE(timing.first_window(first, partner_keyset, default_dur) ==
+            default_dur);
+    for (size_t i = 0; i < capacity; ++i) {
+      REQUIRE(timing.pair_window(to_key(10 + i / 16), to_key(40 + i % 16),
+                                 default_dur) == 8ms);
+    }
+  }
+
+  SECTION("save and load") {
+    const std::string path = "simul_timing_test.timing";
+    REQUIRE(timing.save(path));
+    SimulTiming loaded;
+    REQUIRE(loaded.load(path));
+    REQUIRE(loaded.pair_count() == 1);
+    REQUIRE(loaded.first_window(first, partner_keyset, default_dur) == 8ms);
+    std::remove(path.c_str());
+    REQUIRE(!loaded.load(path));
+    REQUIRE(loaded.pair_count() == 0);
+  }
+}